@@ -1,12 +1,35 @@
+#include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/crc32.h>
+#include <linux/delay.h>
+#include <linux/falloc.h>
+#include <linux/freezer.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
 #include <linux/init.h>
+#include <linux/iomap.h>
+#include <linux/jhash.h>
+#include <linux/kthread.h>
+#include <linux/list_sort.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mount.h>
 #include <linux/writeback.h>
 #include <linux/fs_context.h>
+#include <linux/fs_parser.h>
 #include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/percpu_counter.h>
 #include <linux/printk.h>
+#include <linux/random.h>
+#include <linux/rbtree.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/statfs.h>
+#include <linux/uaccess.h>
 #include <linux/kernel.h>
 #include "fileStorage.h"
 #include "fileStorageOperations.h"
@@ -34,60 +57,430 @@ read_directory_block(struct super_block *sb, uint64_t block_number)
 	return bh;
 }
 
-int
-find_free_index(uint32_t *bitmap, int max, const char *error_msg)
-{
-	int idx;
-
-	for (idx = 0; idx < max; idx++) {
-		if (!IS_SET(bitmap, idx))
-			return idx;
-	}
-
-	pr_err("%s\n", error_msg);
-	return -ENOSPC;
-}
-
 struct ezfs_super_block *
 get_ezfs_superblock(struct super_block *sb)
 {
-	struct ezfs_sb_buffer_heads *sb_heads = sb->s_fs_info;
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
 	struct buffer_head *sb_buffer_head =
-	    check_buffer_head(sb_heads ? sb_heads->sb_bh : NULL,
+	    check_buffer_head(sbi ? sbi->sb_bh : NULL,
 			      "Superblock buffer head");
 	return (struct ezfs_super_block *) check_buffer_head(sb_buffer_head,
 							     "Superblock buffer")->
 	    b_data;
 }
 
+static void
+ezfs_encode_time(struct ezfs_timestamp *t, struct timespec64 ts)
+{
+	t->sec = lower_32_bits(ts.tv_sec);
+	t->nsec = ts.tv_nsec |
+		  (upper_32_bits(ts.tv_sec) << EZFS_NSEC_BITS);
+}
+
+static struct timespec64
+ezfs_decode_time(const struct ezfs_timestamp *t)
+{
+	struct timespec64 ts = {
+		.tv_sec = t->sec |
+			  (time64_t) (t->nsec >> EZFS_NSEC_BITS) << 32,
+		.tv_nsec = t->nsec & EZFS_NSEC_MASK,
+	};
+
+	return ts;
+}
+
+static inline bool
+ezfs_has_inline_data(struct inode *inode)
+{
+	return test_bit(EZFS_STATE_INLINE_DATA, &EZFS_I(inode)->state);
+}
+
+static inline bool
+ezfs_compressed(struct inode *inode)
+{
+	return test_bit(EZFS_STATE_COMPRESS, &EZFS_I(inode)->state);
+}
+
+/* The number of disk blocks behind @ext. */
+static inline uint32_t
+ezfs_extent_phys(const struct ezfs_extent *ext)
+{
+	if (ext->e_flags & EZFS_EXT_COMPRESSED)
+		return ext->e_flags >> EZFS_EXT_PHYS_SHIFT;
+	return ext->e_len;
+}
+
+/* Encodes @inode into its on-disk form. The caller holds the map lock.
+ * Inline data is written straight into the record, so it is left alone.
+ */
 static void
 write_inode_helper(struct inode *inode, struct ezfs_inode *ezfs_inode)
 {
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+
+	if (ezfs_has_inline_data(inode)) {
+		memset(ezfs_inode, 0, offsetof(struct ezfs_inode, inline_data));
+		ezfs_inode->flags = EZFS_INODE_INLINE_DATA;
+	} else {
+		memset(ezfs_inode, 0, sizeof(*ezfs_inode));
+	}
+	if (ezfs_compressed(inode))
+		ezfs_inode->flags |= EZFS_INODE_COMPRESS;
 	ezfs_inode->mode = inode->i_mode;
 	ezfs_inode->file_size = inode->i_size;
 	ezfs_inode->nlink = inode->i_nlink;
-	ezfs_inode->i_atime = inode->i_atime;
-	ezfs_inode->i_mtime = inode->i_mtime;
-	ezfs_inode->i_ctime = inode->i_ctime;
+	ezfs_encode_time(&ezfs_inode->i_atime, inode->i_atime);
+	ezfs_encode_time(&ezfs_inode->i_mtime, inode->i_mtime);
+	ezfs_encode_time(&ezfs_inode->i_ctime, inode->i_ctime);
 	ezfs_inode->uid = inode->i_uid.val;
 	ezfs_inode->gid = inode->i_gid.val;
-	ezfs_inode->nblocks = inode->i_blocks / 8;
+	ezfs_inode->nblocks = inode->i_blocks / EZFS_BLOCK_SECTORS;
+	ezfs_inode->nextents = ei->nextents;
+	ezfs_inode->group = ei->group;
+	ezfs_inode->extent_blk = ei->extent_blk;
+	memcpy(ezfs_inode->extents, ei->map,
+	       min_t(unsigned int, ei->nextents, EZFS_INLINE_EXTENTS) *
+	       sizeof(struct ezfs_extent));
 }
 
+static const struct iomap_ops ezfs_iomap_ops = {
+	.iomap_begin = ezfs_iomap_begin,
+	.iomap_end = ezfs_iomap_end,
+};
+
 int
 ezfs_readpage(struct file *file_handle, struct page *page_obj)
 {
+	struct inode *inode = page_obj->mapping->host;
+
 	pr_debug("EZFS: Reading page from file %pD\n", file_handle);
 
-	return block_read_full_page(page_obj, ezfs_get_block);
+	if (ezfs_compressed(inode) && !ezfs_has_inline_data(inode))
+		return ezfs_readpage_compressed(page_obj);
+	return iomap_readpage(page_obj, &ezfs_iomap_ops);
+}
+
+void
+ezfs_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+
+	if (ezfs_compressed(inode) && !ezfs_has_inline_data(inode))
+		ezfs_readahead_compressed(rac);
+	else
+		iomap_readahead(rac, &ezfs_iomap_ops);
+}
+
+/* Unwritten blocks become written ones only once their data is on disk,
+ * so that a crash in between leaves them reading as zeros. Their buffers
+ * are queued on the inode when the write completes, and the page stays
+ * under writeback until ezfs_end_io_work() has converted them.
+ */
+static struct workqueue_struct *ezfs_end_io_wq;
+
+static void
+ezfs_end_buffer_write(struct buffer_head *bh, int uptodate)
+{
+	struct ezfs_inode_info *ei = EZFS_I(bh->b_page->mapping->host);
+	unsigned long flags;
+
+	/* A failed write leaves the block unwritten, and the buffer marked
+	 * for the next attempt.
+	 */
+	if (!buffer_ezfs_unwritten(bh) || !uptodate) {
+		end_buffer_async_write(bh, uptodate);
+		return;
+	}
+	spin_lock_irqsave(&ei->io_lock, flags);
+	bh->b_private = ei->io_done;
+	ei->io_done = bh;
+	spin_unlock_irqrestore(&ei->io_lock, flags);
+	queue_work(ezfs_end_io_wq, &ei->io_work);
+}
+
+/* Converts the blocks of the buffers written since the last run, a range
+ * of contiguous ones at a time, then ends their writes. The list is in
+ * the reverse order of completion, so a sequential write grows a range at
+ * its start.
+ */
+static void
+ezfs_end_io_work(struct work_struct *work)
+{
+	struct ezfs_inode_info *ei =
+	    container_of(work, struct ezfs_inode_info, io_work);
+	struct inode *inode = &ei->vfs_inode;
+	unsigned int blkbits = inode->i_blkbits;
+	struct buffer_head *bh, *next, *done;
+	sector_t lblk, from = 0, to = 0;
+	int ret, err = 0;
+
+	spin_lock_irq(&ei->io_lock);
+	done = ei->io_done;
+	ei->io_done = NULL;
+	spin_unlock_irq(&ei->io_lock);
+
+	for (bh = done; bh; bh = bh->b_private) {
+		lblk = ((sector_t) bh->b_page->index <<
+			(PAGE_SHIFT - blkbits)) + (bh_offset(bh) >> blkbits);
+		if (from < to && lblk + 1 == from) {
+			from = lblk;
+			continue;
+		}
+		if (from < to && lblk == to) {
+			to++;
+			continue;
+		}
+		if (from < to) {
+			ret = ezfs_convert_unwritten(inode, from, to);
+			if (ret)
+				err = ret;
+		}
+		from = lblk;
+		to = lblk + 1;
+	}
+	if (from < to) {
+		ret = ezfs_convert_unwritten(inode, from, to);
+		if (ret)
+			err = ret;
+	}
+
+	/* The inode may go as soon as the last page leaves writeback. */
+	for (bh = done; bh; bh = next) {
+		next = bh->b_private;
+		bh->b_private = NULL;
+		if (!err)
+			clear_buffer_ezfs_unwritten(bh);
+		end_buffer_async_write(bh, !err);
+	}
+}
+
+/* block_write_full_page(), with writes to unwritten blocks completing
+ * through ezfs_end_buffer_write().
+ */
+static int
+ezfs_write_full_page(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t i_size = i_size_read(inode);
+	pgoff_t end_index = i_size >> PAGE_SHIFT;
+	unsigned int offset = i_size & (PAGE_SIZE - 1);
+
+	if (page->index >= end_index) {
+		/* Wholly past EOF: a truncate is on its way. */
+		if (page->index > end_index || !offset) {
+			unlock_page(page);
+			return 0;
+		}
+		zero_user_segment(page, offset, PAGE_SIZE);
+	}
+	return __block_write_full_page(inode, page, ezfs_get_block, wbc,
+				       ezfs_end_buffer_write);
 }
 
 int
 ezfs_writepage(struct page *target_page, struct writeback_control *wb_ctrl)
 {
+	struct inode *inode = target_page->mapping->host;
+
 	pr_debug("EZFS: Writing page to disk\n");
 
-	return block_write_full_page(target_page, ezfs_get_block, wb_ctrl);
+	/* A compressed cluster is only written whole, by writepages. */
+	if (ezfs_compressed(inode)) {
+		redirty_page_for_writepage(wb_ctrl, target_page);
+		unlock_page(target_page);
+		return 0;
+	}
+
+	set_bit(EZFS_STATE_FLUSH, &EZFS_I(target_page->mapping->host)->state);
+	return ezfs_write_full_page(target_page, wb_ctrl);
+}
+
+/* One ezfs_writepages() pass: the bio being built, and the sector that
+ * would extend it.
+ */
+struct ezfs_wb_ctx {
+	struct bio *bio;
+	sector_t next_sector;
+};
+
+static void
+ezfs_end_bio_write(struct bio *bio)
+{
+	struct bio_vec *bvec;
+	struct bvec_iter_all iter_all;
+
+	bio_for_each_segment_all(bvec, bio, iter_all)
+		page_endio(bvec->bv_page, true,
+			   blk_status_to_errno(bio->bi_status));
+	bio_put(bio);
+}
+
+static void
+ezfs_wb_submit(struct ezfs_wb_ctx *ctx)
+{
+	if (ctx->bio) {
+		submit_bio(ctx->bio);
+		ctx->bio = NULL;
+	}
+}
+
+/* write_cache_pages() callback. Pages whose blocks are all dirty and sit
+ * right after the previous page on disk are added to the current bio, so a
+ * contiguous file goes out in a few large writes. Anything unusual (no
+ * buffers, a partly dirty page, a page past EOF, an unwritten block, an
+ * allocation error) is left to ezfs_write_full_page().
+ */
+static int
+ezfs_writepage_bio(struct page *page, struct writeback_control *wbc,
+		   void *data)
+{
+	struct ezfs_wb_ctx *ctx = data;
+	struct inode *inode = page->mapping->host;
+	unsigned int blkbits = inode->i_blkbits;
+	loff_t i_size = i_size_read(inode);
+	unsigned int offset = i_size & (PAGE_SIZE - 1);
+	struct buffer_head *bh, *head;
+	sector_t lblk, first = 0, sector;
+	unsigned int nr = 0;
+
+	if (!page_has_buffers(page) ||
+	    page->index > (i_size >> PAGE_SHIFT) ||
+	    (page->index == (i_size >> PAGE_SHIFT) && !offset))
+		goto fallback;
+
+	lblk = (sector_t) page->index << (PAGE_SHIFT - blkbits);
+	bh = head = page_buffers(page);
+	do {
+		if (!buffer_dirty(bh) || !buffer_uptodate(bh))
+			goto fallback;
+		if (!buffer_mapped(bh) || buffer_delay(bh)) {
+			if (ezfs_get_block(inode, lblk, bh, 1))
+				goto fallback;
+			clear_buffer_delay(bh);
+			if (buffer_new(bh)) {
+				clear_buffer_new(bh);
+				clean_bdev_bh_alias(bh);
+			}
+		}
+		if (buffer_ezfs_unwritten(bh) ||
+		    (nr && bh->b_blocknr != first + nr))
+			goto fallback;
+		if (!nr)
+			first = bh->b_blocknr;
+		nr++;
+		lblk++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	/* The part of the last page past EOF goes out as zeros. */
+	if (page->index == (i_size >> PAGE_SHIFT))
+		zero_user_segment(page, offset, PAGE_SIZE);
+
+	sector = first << (blkbits - 9);
+	if (ctx->bio && ctx->next_sector != sector)
+		ezfs_wb_submit(ctx);
+	for (;;) {
+		if (!ctx->bio) {
+			ctx->bio = bio_alloc(GFP_NOFS, BIO_MAX_PAGES);
+			bio_set_dev(ctx->bio, inode->i_sb->s_bdev);
+			ctx->bio->bi_iter.bi_sector = sector;
+			ctx->bio->bi_opf = REQ_OP_WRITE | wbc_to_write_flags(wbc);
+			ctx->bio->bi_end_io = ezfs_end_bio_write;
+			wbc_init_bio(wbc, ctx->bio);
+		}
+		if (bio_add_page(ctx->bio, page, PAGE_SIZE, 0) == PAGE_SIZE)
+			break;
+		ezfs_wb_submit(ctx);
+	}
+	wbc_account_cgroup_owner(wbc, page, PAGE_SIZE);
+	ctx->next_sector = sector + (PAGE_SIZE >> 9);
+
+	do {
+		clear_buffer_dirty(bh);
+		bh = bh->b_this_page;
+	} while (bh != head);
+	set_page_writeback(page);
+	unlock_page(page);
+	return 0;
+
+fallback:
+	ezfs_wb_submit(ctx);
+	return ezfs_write_full_page(page, wbc);
+}
+
+int
+ezfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct ezfs_wb_ctx ctx = { .bio = NULL };
+	long nr_to_write = wbc->nr_to_write;
+	pgoff_t start = 0, end = -1;
+	struct blk_plug plug;
+	int ret;
+
+	if (!wbc->range_cyclic) {
+		start = wbc->range_start >> PAGE_SHIFT;
+		end = wbc->range_end >> PAGE_SHIFT;
+	}
+
+	if (ezfs_compressed(mapping->host))
+		return ezfs_writepages_compressed(mapping, wbc);
+
+	/* Blocks that cannot be allocated here are retried one by one in
+	 * ezfs_write_full_page(), which reports the error for the right page.
+	 */
+	ret = ezfs_alloc_delayed(mapping, start, end);
+	if (ret)
+		pr_debug("EZFS: Batched allocation failed: %d\n", ret);
+
+	blk_start_plug(&plug);
+	ret = write_cache_pages(mapping, wbc, ezfs_writepage_bio, &ctx);
+	ezfs_wb_submit(&ctx);
+	blk_finish_plug(&plug);
+	if (wbc->nr_to_write != nr_to_write)
+		set_bit(EZFS_STATE_FLUSH, &EZFS_I(mapping->host)->state);
+	return ret;
+}
+
+/* Delayed buffers that are thrown away before writeback give their
+ * reservation back, unless ezfs_writepages() already allocated the block.
+ * Compressed files have no reservations.
+ */
+void
+ezfs_invalidatepage(struct page *page, unsigned int offset,
+		    unsigned int length)
+{
+	struct inode *inode = page->mapping->host;
+	unsigned int block_start = 0, stop = offset + length;
+	struct buffer_head *bh, *head;
+	struct ezfs_extent ext;
+	unsigned int idx;
+	sector_t lblk;
+	int status;
+
+	if (!page_has_buffers(page) || ezfs_compressed(inode))
+		goto out;
+
+	lblk = (sector_t) page->index << (PAGE_SHIFT - inode->i_blkbits);
+	bh = head = page_buffers(page);
+	do {
+		if (block_start >= offset && block_start + bh->b_size <= stop &&
+		    buffer_delay(bh)) {
+			mutex_lock(ezfs_map_lock(inode));
+			status = ezfs_extent_lookup(inode, lblk, &ext, &idx);
+			/* Unwritten blocks are delayed without one. */
+			if (status == -ENOENT ||
+			    (!status && (ext.e_flags & EZFS_EXT_SHARED)))
+				ezfs_release_reservation(inode->i_sb, 1);
+			mutex_unlock(ezfs_map_lock(inode));
+			clear_buffer_delay(bh);
+		}
+		block_start += bh->b_size;
+		lblk++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+out:
+	block_invalidatepage(page, offset, length);
 }
 
 static void
@@ -103,400 +496,5811 @@ sector_t
 ezfs_bmap(struct address_space *map_space, sector_t blk)
 {
 	pr_debug("EZFS: Mapping block %llu in address space\n", blk);
-	return generic_block_bmap(map_space, blk, ezfs_get_block);
+
+	/* Compressed data has no block of its own. */
+	if (ezfs_compressed(map_space->host))
+		return 0;
+
+	/* Delayed blocks have no address until they are written back. */
+	if (mapping_tagged(map_space, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(map_space);
+	return iomap_bmap(map_space, blk, &ezfs_iomap_ops);
 }
 
-void
-setup_inode(struct inode *inode, struct inode *parent, umode_t mode,
-	    struct ezfs_inode *ez_inode_data, int dbn)
+/* Metadata journal. Metadata buffers are not written in place while they
+ * are changing: ezfs_journal_dirty() adds them to the running transaction
+ * instead. A commit copies them, writes the copies to the log and makes
+ * that durable with one flush and a FUA commit block, however many
+ * operations joined the transaction. The copies go to their home
+ * locations only when the log fills up or the filesystem is unmounted,
+ * and the log then starts over.
+ */
+
+static void
+ezfs_journal_end_io(struct bio *bio)
 {
-	inode->i_mode = mode;
-	inode->i_uid = current_fsuid();
-	inode->i_gid = current_fsgid();
-	inode->i_blocks = 0;
-	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-	inode->i_private = ez_inode_data;
-	ez_inode_data->dbn = dbn;
+	struct ezfs_jio *io = bio->bi_private;
+
+	if (bio->bi_status)
+		io->error = blk_status_to_errno(bio->bi_status);
+	bio_put(bio);
+	if (atomic_dec_and_test(&io->pending))
+		complete(&io->done);
 }
 
-static struct buffer_head *
-get_ezfs_buffer_head(struct super_block *sb)
+static void
+ezfs_jio_init(struct ezfs_jio *io)
 {
-	struct ezfs_sb_buffer_heads *sb_heads = sb->s_fs_info;
+	atomic_set(&io->pending, 1);
+	io->error = 0;
+	init_completion(&io->done);
+}
 
-	return check_buffer_head(sb_heads ? sb_heads->i_store_bh : NULL,
-				 "Inode store buffer head");
+/* Writes @page to block @blk. This bypasses the buffer cache, so the
+ * buffer for @blk can go on changing.
+ */
+static void
+ezfs_jio_submit(struct ezfs_jio *io, struct super_block *sb,
+		struct page *page, uint64_t blk, unsigned int op_flags)
+{
+	struct bio *bio = bio_alloc(GFP_NOFS, 1);
+
+	bio_set_dev(bio, sb->s_bdev);
+	bio->bi_iter.bi_sector = blk * (EZFS_BLOCK_SIZE >> 9);
+	bio->bi_opf = REQ_OP_WRITE | op_flags;
+	bio->bi_end_io = ezfs_journal_end_io;
+	bio->bi_private = io;
+	bio_add_page(bio, page, EZFS_BLOCK_SIZE, 0);
+	atomic_inc(&io->pending);
+	submit_bio(bio);
 }
 
-static struct ezfs_inode *
-get_ezfs_inode(struct inode *inode)
+static int
+ezfs_jio_wait(struct ezfs_jio *io)
 {
-	return (struct ezfs_inode *) check_buffer_head(inode ? inode->i_private : NULL,
-												"Inode private data");
+	if (!atomic_dec_and_test(&io->pending))
+		wait_for_completion(&io->done);
+	return io->error;
 }
 
-void
-update_parent_directory_times(struct inode *parent)
+/* Reads or writes journal block @blk synchronously. */
+static int
+ezfs_journal_rw(struct ezfs_journal *j, struct page *page, uint64_t blk,
+		unsigned int opf)
 {
-	parent->i_mtime = parent->i_ctime = current_time(parent);
+	struct bio *bio = bio_alloc(GFP_NOFS, 1);
+	int ret;
 
-	mark_inode_dirty(parent);
+	bio_set_dev(bio, j->sb->s_bdev);
+	bio->bi_iter.bi_sector = (j->first + blk) * (EZFS_BLOCK_SIZE >> 9);
+	bio->bi_opf = opf;
+	bio_add_page(bio, page, EZFS_BLOCK_SIZE, 0);
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+	return ret;
 }
 
-void
-update_directory_inode(struct inode *dir, bool directory_flag,
-		       struct buffer_head *inode_bh,
-		       struct ezfs_super_block *sb_data, int inode_idx,
-		       int data_blk_idx)
+/* Records that the log starts over at block 1 with @sequence. */
+static int
+ezfs_journal_write_super(struct ezfs_journal *j, uint64_t sequence)
 {
-	if (directory_flag)
-		inc_nlink(dir);
+	struct ezfs_journal_super *jsb = page_address(j->scratch);
 
-	dir->i_size += sizeof(struct ezfs_dir_entry);
-	mark_buffer_dirty(inode_bh);
+	memset(jsb, 0, EZFS_BLOCK_SIZE);
+	jsb->magic = EZFS_JOURNAL_MAGIC;
+	jsb->sequence = sequence;
+	return ezfs_journal_rw(j, j->scratch, 0,
+			       REQ_OP_WRITE | REQ_SYNC | REQ_FUA);
 }
 
 static void
-update_inode_metadata(struct inode *inode, struct inode *dir)
+ezfs_jblock_free(struct ezfs_jblock *jb)
 {
-	inode->i_ctime = dir->i_ctime = dir->i_mtime = current_time(inode);
-	drop_nlink(inode);
-	mark_inode_dirty(inode);
-	mark_inode_dirty(dir);
+	if (jb->copy)
+		__free_page(jb->copy);
+	brelse(jb->bh);
+	kfree(jb);
 }
 
-void
-release_inode_resources(struct ezfs_super_block *ezfs_sb,
-			struct ezfs_inode *ezfs_inode, int blocks)
+/* Writes every committed block home, after which the log is empty again
+ * and the metadata blocks freed before the last commit can be reused.
+ * Called with commit_mutex held.
+ */
+static int
+ezfs_journal_checkpoint(struct ezfs_journal *j)
 {
-	int data_blk_num = ezfs_inode->dbn;
-	int i;
-
-	for (i = 0; i < blocks; i++) {
-		CLEARBIT(ezfs_sb->free_data_blocks,
-			 data_blk_num - EZFS_ROOT_DATABLOCK_NUMBER + i);
-	}
-}
+	struct ezfs_deferred_free *df, *next_df;
+	struct ezfs_jblock *jb, *next;
+	struct blk_plug plug;
+	struct ezfs_jio io;
+	int ret;
 
-void
-ezfs_evict_inode(struct inode *inode)
-{
-	struct ezfs_sb_buffer_heads *sb_heads = inode->i_sb->s_fs_info;
-	struct buffer_head *sb_bh =
-	    check_buffer_head(sb_heads ? sb_heads->sb_bh : NULL,
-			      "Superblock buffer head");
-	struct ezfs_super_block *ezfs_sb = get_ezfs_superblock(inode->i_sb);
-	struct ezfs_inode *ezfs_inode = get_ezfs_inode(inode);
-	int blocks = inode->i_blocks / 8;
+	if (j->head == 1 && list_empty(&j->checkpoint) &&
+	    list_empty(&j->committed_frees))
+		return 0;
 
-	if (!inode->i_nlink) {
-		CLEARBIT(ezfs_sb->free_inodes,
-			 inode->i_ino - EZFS_ROOT_INODE_NUMBER);
-		release_inode_resources(ezfs_sb, ezfs_inode, blocks);
-		mark_buffer_dirty(sb_bh);
+	ezfs_jio_init(&io);
+	blk_start_plug(&plug);
+	list_for_each_entry(jb, &j->checkpoint, list)
+		ezfs_jio_submit(&io, j->sb, jb->copy, jb->bh->b_blocknr, 0);
+	blk_finish_plug(&plug);
+	ret = ezfs_jio_wait(&io);
+	if (!ret)
+		ret = blkdev_issue_flush(j->sb->s_bdev, GFP_NOFS);
+	if (!ret)
+		ret = ezfs_journal_write_super(j, j->committed + 1);
+	if (ret) {
+		/* Everything is still in the log for replay. */
+		pr_err("EZFS: journal checkpoint failed: %d\n", ret);
+		return ret;
 	}
 
-	truncate_inode_pages_final(&inode->i_data);
-	clear_inode(inode);
+	j->head = 1;
+	list_for_each_entry_safe(jb, next, &j->checkpoint, list) {
+		jb->bh->b_private = NULL;
+		list_del(&jb->list);
+		ezfs_jblock_free(jb);
+	}
+	list_for_each_entry_safe(df, next_df, &j->committed_frees, list) {
+		list_del(&df->list);
+		ezfs_release_data_blocks(j->sb, df->start, df->count);
+		kfree(df);
+	}
+	j->nr_deferred = 0;
+	return 0;
 }
 
-int
-ezfs_update_inode_from_vfs(struct ezfs_inode *ez_inode, struct inode *vfs_inode)
+/* Moves the blocks of a committed transaction to the checkpoint list,
+ * where each home block keeps only its latest copy.
+ */
+static void
+ezfs_journal_add_checkpoint(struct ezfs_journal *j, struct list_head *txn)
 {
-	ez_inode->mode = vfs_inode->i_mode;
-	ez_inode->file_size = vfs_inode->i_size;
-	ez_inode->nlink = vfs_inode->i_nlink;
-	ez_inode->i_atime = vfs_inode->i_atime;
-	ez_inode->i_mtime = vfs_inode->i_mtime;
-	ez_inode->i_ctime = vfs_inode->i_ctime;
-	ez_inode->uid = vfs_inode->i_uid.val;
-	ez_inode->gid = vfs_inode->i_gid.val;
-	ez_inode->nblocks = vfs_inode->i_blocks / 8;
+	struct ezfs_jblock *jb, *next, *old;
 
-	return 0;
+	list_for_each_entry_safe(jb, next, txn, list) {
+		old = jb->bh->b_private;
+		if (old) {
+			list_del(&old->list);
+			ezfs_jblock_free(old);
+		}
+		jb->bh->b_private = jb;
+		list_move_tail(&jb->list, &j->checkpoint);
+	}
 }
 
-static struct inode *
-ezfs_iget(struct super_block *sb, int inode_number)
+/* Writes the @n blocks of @txn to the log as transaction @sequence. */
+static int
+ezfs_journal_write_txn(struct ezfs_journal *j, struct list_head *txn,
+		       unsigned int n, uint64_t sequence)
 {
-	struct inode *vfs_inode = iget_locked(sb, inode_number);
+	struct ezfs_journal_commit_block *commit;
+	struct ezfs_journal_desc *desc;
+	struct page *page, *next_page;
+	uint64_t start = j->head;
+	unsigned int left, count, i;
+	struct ezfs_jblock *jb;
+	struct blk_plug plug;
+	struct ezfs_jio io;
+	uint32_t crc = ~0U;
+	LIST_HEAD(descs);
+	int ret;
 
-	if (vfs_inode && (vfs_inode->i_state & I_NEW)) {
-		struct ezfs_inode *internal_inode =
-		    (struct ezfs_inode *) get_ezfs_buffer_head(sb)->b_data +
-		    inode_number - EZFS_ROOT_INODE_NUMBER;
+	/* Fill in the descriptors first; each goes out ahead of the blocks
+	 * it lists.
+	 */
+	jb = list_first_entry(txn, struct ezfs_jblock, list);
+	for (left = n; left; left -= count) {
+		count = min_t(unsigned int, left, EZFS_JOURNAL_DESC_BLOCKS);
+		page = alloc_page(GFP_NOFS | __GFP_NOFAIL);
+		list_add_tail(&page->lru, &descs);
+		desc = page_address(page);
+		memset(desc, 0, EZFS_BLOCK_SIZE);
+		desc->h.magic = EZFS_JOURNAL_MAGIC;
+		desc->h.type = EZFS_JOURNAL_DESCRIPTOR;
+		desc->h.sequence = sequence;
+		desc->count = count;
+		for (i = 0; i < count; i++) {
+			desc->blocknr[i] = jb->bh->b_blocknr;
+			jb = list_next_entry(jb, list);
+		}
+	}
 
-		vfs_inode->i_private = internal_inode;
-		vfs_inode->i_mode = internal_inode->mode;
-		vfs_inode->i_op = &ezfs_inode_ops;
-		vfs_inode->i_sb = sb;
-		vfs_inode->i_fop =
-			(vfs_inode->i_mode & S_IFDIR) ? &ezfs_dir_ops : &ezfs_file_ops;
-		vfs_inode->i_mapping->a_ops = &ezfs_aops;
-		vfs_inode->i_size = internal_inode->file_size;
-		vfs_inode->i_blocks = internal_inode->nblocks * 8;
-		set_nlink(vfs_inode, internal_inode->nlink);
-		vfs_inode->i_atime = internal_inode->i_atime;
-		vfs_inode->i_mtime = internal_inode->i_mtime;
-		vfs_inode->i_ctime = internal_inode->i_ctime;
-		i_uid_write(vfs_inode, internal_inode->uid);
-		i_gid_write(vfs_inode, internal_inode->gid);
-		unlock_new_inode(vfs_inode);
+	ezfs_jio_init(&io);
+	blk_start_plug(&plug);
+	jb = list_first_entry(txn, struct ezfs_jblock, list);
+	list_for_each_entry(page, &descs, lru) {
+		desc = page_address(page);
+		crc = crc32_le(crc, (void *) desc, EZFS_BLOCK_SIZE);
+		ezfs_jio_submit(&io, j->sb, page, j->first + j->head++, 0);
+		for (i = 0; i < desc->count; i++) {
+			crc = crc32_le(crc, page_address(jb->copy),
+				       EZFS_BLOCK_SIZE);
+			ezfs_jio_submit(&io, j->sb, jb->copy,
+					j->first + j->head++, 0);
+			jb = list_next_entry(jb, list);
+		}
 	}
+	blk_finish_plug(&plug);
+	ret = ezfs_jio_wait(&io);
 
-	return vfs_inode;
+	list_for_each_entry_safe(page, next_page, &descs, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	if (ret)
+		return ret;
+
+	/* The flush makes the blocks above durable before the commit block
+	 * that vouches for them.
+	 */
+	page = alloc_page(GFP_NOFS | __GFP_NOFAIL);
+	commit = page_address(page);
+	memset(commit, 0, EZFS_BLOCK_SIZE);
+	commit->h.magic = EZFS_JOURNAL_MAGIC;
+	commit->h.type = EZFS_JOURNAL_COMMIT;
+	commit->h.sequence = sequence;
+	commit->nr_blocks = j->head - start;
+	commit->checksum = crc;
+	ret = ezfs_journal_rw(j, page, j->head++,
+			      REQ_OP_WRITE | REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+	__free_page(page);
+	return ret;
 }
 
+/* Closes the running transaction and commits it. Called with commit_mutex
+ * held. Once a commit has failed, the journal takes no more: every later
+ * commit returns the same error, and nothing is written home that is not
+ * in the log.
+ */
 static int
-ezfs_move_block(unsigned long base_offset, unsigned long src_offset,
-		unsigned long dest_offset, struct super_block *sb,
-		struct address_space *map)
+ezfs_journal_do_commit(struct ezfs_journal *j)
 {
-	struct buffer_head *src_bh, *dest_bh;
-	struct page *src_page;
-	void *src_data;
-
-	src_offset += EZFS_ROOT_DATABLOCK_NUMBER;
-	dest_offset += EZFS_ROOT_DATABLOCK_NUMBER;
-
-	dest_bh = sb_getblk(sb, dest_offset);
-	if (!dest_bh)
-		return -EIO;
+	struct ezfs_deferred_free *df, *next_df;
+	struct ezfs_jblock *jb, *next;
+	unsigned int n, need;
+	uint64_t sequence;
+	LIST_HEAD(frees);
+	LIST_HEAD(txn);
+	int ret = 0;
+
+	if (j->error)
+		return j->error;
+
+	spin_lock(&j->lock);
+	if (list_empty(&j->running) && list_empty(&j->running_frees)) {
+		spin_unlock(&j->lock);
+		return 0;
+	}
+	spin_unlock(&j->lock);
+
+	/* Wait for the operations in progress, and keep new ones out while
+	 * the transaction is copied.
+	 */
+	down_write(&j->updates);
+	spin_lock(&j->lock);
+	list_splice_init(&j->running, &txn);
+	list_splice_init(&j->running_frees, &frees);
+	n = j->nr_running;
+	j->nr_running = 0;
+	sequence = j->sequence;
+	if (n)
+		j->sequence++;
+	spin_unlock(&j->lock);
+
+	/* A buffer changed after its bit is cleared joins the next
+	 * transaction, so the copy never misses a change.
+	 */
+	list_for_each_entry(jb, &txn, list) {
+		spin_lock(&j->lock);
+		clear_buffer_ezfs_journal(jb->bh);
+		spin_unlock(&j->lock);
+		jb->copy = alloc_page(GFP_NOFS | __GFP_NOFAIL);
+		lock_buffer(jb->bh);
+		memcpy(page_address(jb->copy), jb->bh->b_data,
+		       EZFS_BLOCK_SIZE);
+		unlock_buffer(jb->bh);
+	}
+	up_write(&j->updates);
+
+	if (n) {
+		need = n + DIV_ROUND_UP(n, EZFS_JOURNAL_DESC_BLOCKS) + 1;
+		if (need > j->len - 1) {
+			/* Handles reserve room and operations work in steps
+			 * that fit it, so this is a bug. Writing the blocks
+			 * home without the log would not be atomic.
+			 */
+			WARN_ONCE(1, "EZFS: %u block transaction does not fit the journal\n",
+				  n);
+			ret = -ENOSPC;
+		} else if (j->head + need > j->len) {
+			ret = ezfs_journal_checkpoint(j);
+		}
+		if (!ret)
+			ret = ezfs_journal_write_txn(j, &txn, n, sequence);
+		if (!ret) {
+			j->committed = sequence;
+			ezfs_journal_add_checkpoint(j, &txn);
+		}
+	}
 
-	src_page = find_get_page(map, src_offset - base_offset);
-	if (src_page) {
-		src_data = kmap_atomic(src_page);
-		memcpy(dest_bh->b_data, src_data, dest_bh->b_size);
-		kunmap_atomic(src_data);
-		put_page(src_page);
-	} else {
-		src_bh = sb_bread(sb, src_offset);
-		if (!src_bh) {
-			brelse(dest_bh);
-			return -EIO;
+	if (ret) {
+		/* The transaction never made it to the log. Its blocks
+		 * stay as they are in memory, and its frees are leaked.
+		 */
+		list_for_each_entry_safe(jb, next, &txn, list) {
+			list_del(&jb->list);
+			ezfs_jblock_free(jb);
+		}
+		list_for_each_entry_safe(df, next_df, &frees, list) {
+			list_del(&df->list);
+			kfree(df);
 		}
+		goto abort;
+	}
+
+	list_for_each_entry(df, &frees, list)
+		j->nr_deferred += df->count;
+	list_splice_tail(&frees, &j->committed_frees);
+	if (j->nr_deferred >= EZFS_JOURNAL_DEFER_MAX)
+		ret = ezfs_journal_checkpoint(j);
+	if (!ret)
+		return 0;
+abort:
+	pr_err("EZFS: journal commit failed, journal aborted: %d\n", ret);
+	j->error = ret;
+	return ret;
+}
 
-		memcpy(dest_bh->b_data, src_bh->b_data, src_bh->b_size);
-		brelse(src_bh);
+/* Waits until transaction @sequence is committed, committing the running
+ * one if nobody has yet. Callers that queue up behind a commit in progress
+ * often find theirs was in it, or get the error it failed with. Inside a
+ * handle the running transaction cannot close, so the commit is only
+ * kicked off.
+ */
+static int
+ezfs_journal_commit_seq(struct ezfs_journal *j, uint64_t sequence)
+{
+	struct ezfs_handle *handle = current->journal_info;
+	int ret = 0;
 
+	if (READ_ONCE(j->committed) >= sequence)
+		return 0;
+	if (handle && handle->journal == j) {
+		mod_delayed_work(system_wq, &j->commit_work, 0);
+		return READ_ONCE(j->error);
 	}
 
-	mark_buffer_dirty(dest_bh);
-	brelse(dest_bh);
+	mutex_lock(&j->commit_mutex);
+	if (j->committed < sequence)
+		ret = ezfs_journal_do_commit(j);
+	mutex_unlock(&j->commit_mutex);
+	return ret;
+}
+
+/* Commits everything dirtied so far and waits for it. */
+static int
+ezfs_journal_commit(struct ezfs_journal *j)
+{
+	return ezfs_journal_commit_seq(j, U64_MAX);
+}
 
-	pr_info("EZFS: Moved block from %lu to %lu\n", src_offset, dest_offset);
+/* The sequence number of the running transaction. */
+static uint64_t
+ezfs_journal_running_seq(struct ezfs_journal *j)
+{
+	uint64_t sequence;
 
-	return 0;
+	spin_lock(&j->lock);
+	sequence = j->sequence;
+	spin_unlock(&j->lock);
+	return sequence;
 }
 
-static int
-ezfs_get_block(struct inode *inode, sector_t block,
-	       struct buffer_head *bh_result, int create)
+static void
+ezfs_journal_commit_work(struct work_struct *work)
 {
-	struct super_block *sb = inode->i_sb;
-	struct ezfs_sb_buffer_heads *sb_heads = sb->s_fs_info;
-	struct buffer_head *sb_buffer_head =
-	    check_buffer_head(sb_heads ? sb_heads->sb_bh : NULL,
-			      "Superblock buffer head");
-	struct ezfs_super_block *sb_data =
-	    (struct ezfs_super_block *) check_buffer_head(sb_buffer_head,
-							  "Superblock buffer")->
-	    b_data;
-	struct ezfs_inode *inode_data =
-		(struct ezfs_inode *) check_buffer_head(inode ? inode->i_private : NULL,
-												"Inode private data");
+	struct ezfs_journal *j =
+	    container_of(to_delayed_work(work), struct ezfs_journal,
+			 commit_work);
 
-	unsigned long *bitmap = (unsigned long *) sb_data->free_data_blocks;
-	int status = 0, physical_addr =
-	    0, idx, current_block_no, total_blocks, start_index;
-	int expanded_block_count, block_idx, searching_block, new_start_index;
-	int i;
+	ezfs_journal_commit(j);
+}
 
-	current_block_no = inode_data->dbn;
-	total_blocks = inode->i_blocks / 8;
+/* Marks the metadata buffer @bh dirty. With a journal, it joins the running
+ * transaction instead and is written out by the commit.
+ */
+static void
+ezfs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+	struct ezfs_journal *j = ((struct ezfs_sb_info *) sb->s_fs_info)->journal;
+	struct ezfs_jblock *jb;
+	unsigned int n;
+	bool queued;
+
+	if (!j) {
+		mark_buffer_dirty(bh);
+		return;
+	}
 
-	if (total_blocks)
-		physical_addr = current_block_no + block;
+	spin_lock(&j->lock);
+	queued = buffer_ezfs_journal(bh);
+	spin_unlock(&j->lock);
+	if (queued)
+		return;
+
+	jb = kmalloc(sizeof(*jb), GFP_NOFS | __GFP_NOFAIL);
+	spin_lock(&j->lock);
+	if (buffer_ezfs_journal(bh)) {
+		spin_unlock(&j->lock);
+		kfree(jb);
+		return;
+	}
+	set_buffer_ezfs_journal(bh);
+	get_bh(bh);
+	jb->bh = bh;
+	jb->copy = NULL;
+	list_add_tail(&jb->list, &j->running);
+	n = ++j->nr_running;
+	spin_unlock(&j->lock);
+
+	if (n == 1)
+		queue_delayed_work(system_wq, &j->commit_work,
+				   EZFS_JOURNAL_INTERVAL);
+	else if (n == j->max_running)
+		mod_delayed_work(system_wq, &j->commit_work, 0);
+}
 
-	if (total_blocks && block < total_blocks) {
-		map_bh(bh_result, sb, physical_addr);
-		return 0;
+/* Frees metadata blocks. Their old contents may still be in the log, where
+ * replay would find them, so with a journal they are not handed out again
+ * before the next checkpoint.
+ */
+static void
+ezfs_free_meta_blocks(struct super_block *sb, uint64_t pblk, uint64_t count)
+{
+	struct ezfs_journal *j = ((struct ezfs_sb_info *) sb->s_fs_info)->journal;
+	struct ezfs_deferred_free *df;
+
+	if (!j) {
+		ezfs_release_data_blocks(sb, pblk, count);
+		return;
 	}
 
-	if (!create)
-		return 0;
+	df = kmalloc(sizeof(*df), GFP_NOFS | __GFP_NOFAIL);
+	df->start = pblk;
+	df->count = count;
+	spin_lock(&j->lock);
+	list_add_tail(&df->list, &j->running_frees);
+	spin_unlock(&j->lock);
+}
+
+/* Starts an operation whose metadata changes must commit together. Handles
+ * nest; only the outermost one holds the journal, and reserves room in the
+ * running transaction for EZFS_JOURNAL_CREDITS blocks.
+ */
+static void
+ezfs_journal_start(struct super_block *sb, struct ezfs_handle *handle)
+{
+	struct ezfs_journal *j = ((struct ezfs_sb_info *) sb->s_fs_info)->journal;
+	struct ezfs_handle *outer = current->journal_info;
+	bool room;
+
+	handle->journal = j;
+	handle->sync = false;
+	handle->nested = j && outer && outer->journal == j;
+	if (!j || handle->nested)
+		return;
+
+	/* Blocks already in the transaction may be dirtied again and count
+	 * twice, which only errs on the safe side. An aborted journal never
+	 * empties; the changes stay in memory.
+	 */
+	for (;;) {
+		down_read(&j->updates);
+		spin_lock(&j->lock);
+		room = j->nr_running + j->nr_reserved + EZFS_JOURNAL_CREDITS <=
+		    j->max_running || READ_ONCE(j->error);
+		if (room)
+			j->nr_reserved += EZFS_JOURNAL_CREDITS;
+		spin_unlock(&j->lock);
+		if (room)
+			break;
+		up_read(&j->updates);
+
+		/* Close the transaction, or if only the operations in
+		 * progress hold its room, wait for them.
+		 */
+		if (READ_ONCE(j->nr_running)) {
+			ezfs_journal_commit(j);
+		} else {
+			down_write(&j->updates);
+			up_write(&j->updates);
+		}
+	}
+	handle->nofs_flags = memalloc_nofs_save();
+	current->journal_info = handle;
+}
 
-	current_block_no = inode_data->dbn;
-	total_blocks = inode->i_blocks / 8;
-	if (total_blocks)
-		physical_addr = current_block_no + block;
+/* Ends @handle. If it was made synchronous, waits until its changes are
+ * committed.
+ */
+static int
+ezfs_journal_stop(struct ezfs_handle *handle)
+{
+	struct ezfs_journal *j = handle->journal;
+	struct ezfs_handle *outer;
 
-	if (total_blocks && block < total_blocks) {
-		map_bh(bh_result, sb, physical_addr);
+	if (!j)
+		return 0;
+	if (handle->nested) {
+		outer = current->journal_info;
+		outer->sync |= handle->sync;
 		return 0;
 	}
 
-	if (!create)
-		return 0;
+	current->journal_info = NULL;
+	memalloc_nofs_restore(handle->nofs_flags);
+	spin_lock(&j->lock);
+	j->nr_reserved -= EZFS_JOURNAL_CREDITS;
+	spin_unlock(&j->lock);
+	up_read(&j->updates);
+	return handle->sync ? ezfs_journal_commit(j) : 0;
+}
 
-	if (physical_addr >= EZFS_ROOT_DATABLOCK_NUMBER + EZFS_MAX_DATA_BLKS)
-		return -ENOSPC;
+/* Checks the transaction @sequence at log block *pos and, if @apply is
+ * set, copies its blocks home. On success *pos is moved past it. -ENOENT
+ * means the log ends before the transaction does.
+ */
+static int
+ezfs_journal_replay_txn(struct ezfs_journal *j, uint64_t *pos,
+			struct page *desc_page, struct page *page, bool apply)
+{
+	struct super_block *sb = j->sb;
+	struct ezfs_journal_desc *desc = page_address(desc_page);
+	struct ezfs_journal_commit_block *commit;
+	uint64_t dev_blks =
+	    i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+	uint64_t blk = *pos, home;
+	struct buffer_head *bh;
+	uint32_t crc = ~0U;
+	unsigned int i;
+	int ret;
 
-	mutex_lock(sb_data->ezfs_lock);
+	for (;;) {
+		if (blk >= j->len)
+			return -ENOENT;
+		ret = ezfs_journal_rw(j, desc_page, blk++, REQ_OP_READ);
+		if (ret)
+			return ret;
+		if (desc->h.magic != EZFS_JOURNAL_MAGIC ||
+		    desc->h.sequence != j->sequence)
+			return -ENOENT;
+		if (desc->h.type == EZFS_JOURNAL_COMMIT)
+			break;
+		if (desc->h.type != EZFS_JOURNAL_DESCRIPTOR ||
+		    desc->count > EZFS_JOURNAL_DESC_BLOCKS ||
+		    blk + desc->count >= j->len)
+			return -ENOENT;
+
+		crc = crc32_le(crc, (void *) desc, EZFS_BLOCK_SIZE);
+		for (i = 0; i < desc->count; i++) {
+			home = desc->blocknr[i];
+			if (home == EZFS_SUPERBLOCK_DATABLOCK_NUMBER ||
+			    home >= dev_blks ||
+			    (home >= j->first && home < j->first + j->len))
+				return -EUCLEAN;
+			ret = ezfs_journal_rw(j, page, blk++, REQ_OP_READ);
+			if (ret)
+				return ret;
+			crc = crc32_le(crc, page_address(page),
+				       EZFS_BLOCK_SIZE);
+			if (!apply)
+				continue;
+
+			bh = sb_getblk(sb, home);
+			if (!bh)
+				return -EIO;
+			lock_buffer(bh);
+			memcpy(bh->b_data, page_address(page), EZFS_BLOCK_SIZE);
+			set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+			mark_buffer_dirty(bh);
+			brelse(bh);
+		}
+	}
+
+	commit = (struct ezfs_journal_commit_block *) desc;
+	if (commit->nr_blocks != blk - 1 - *pos || commit->checksum != crc)
+		return -ENOENT;
+	*pos = blk;
+	return 0;
+}
+
+/* Copies home every transaction that made it to the log complete, in
+ * order, and empties the log.
+ */
+static int
+ezfs_journal_replay(struct ezfs_journal *j)
+{
+	uint64_t pos = 1, next;
+	unsigned int nr = 0;
+	struct page *page;
+	int ret;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+	for (;;) {
+		/* Nothing is copied home before the whole transaction has
+		 * been checked.
+		 */
+		next = pos;
+		ret = ezfs_journal_replay_txn(j, &next, j->scratch, page,
+					      false);
+		if (!ret)
+			ret = ezfs_journal_replay_txn(j, &pos, j->scratch, page,
+						      true);
+		if (ret)
+			break;
+		j->sequence++;
+		nr++;
+	}
+	__free_page(page);
+	if (ret != -ENOENT) {
+		pr_err("EZFS: journal replay failed: %d\n", ret);
+		return ret;
+	}
+	if (!nr)
+		return 0;
+
+	pr_info("EZFS: replayed %u journal transactions\n", nr);
+	ret = sync_blockdev(j->sb->s_bdev);
+	if (!ret)
+		ret = blkdev_issue_flush(j->sb->s_bdev, GFP_KERNEL);
+	if (!ret)
+		ret = ezfs_journal_write_super(j, j->sequence);
+	return ret;
+}
+
+/* Sets up the journal @ezfs_sb describes, if any, and replays it. This
+ * comes before any other metadata is read.
+ */
+static int
+ezfs_journal_load(struct super_block *sb, struct ezfs_super_block *ezfs_sb)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	struct ezfs_journal_super *jsb;
+	struct ezfs_journal *j;
+	int ret;
+
+	if (!ezfs_sb->journal_len)
+		return 0;
+
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (!j)
+		return -ENOMEM;
+	j->scratch = alloc_page(GFP_KERNEL);
+	if (!j->scratch) {
+		kfree(j);
+		return -ENOMEM;
+	}
+	j->sb = sb;
+	j->first = ezfs_sb->journal_blk;
+	j->len = ezfs_sb->journal_len;
+	j->max_running = (j->len - 1) / 2;
+	init_rwsem(&j->updates);
+	mutex_init(&j->commit_mutex);
+	spin_lock_init(&j->lock);
+	INIT_LIST_HEAD(&j->running);
+	INIT_LIST_HEAD(&j->running_frees);
+	INIT_LIST_HEAD(&j->checkpoint);
+	INIT_LIST_HEAD(&j->committed_frees);
+	INIT_DELAYED_WORK(&j->commit_work, ezfs_journal_commit_work);
+	j->head = 1;
+	sbi->journal = j;
+
+	ret = ezfs_journal_rw(j, j->scratch, 0, REQ_OP_READ);
+	if (ret)
+		return ret;
+	jsb = page_address(j->scratch);
+	if (jsb->magic != EZFS_JOURNAL_MAGIC) {
+		pr_err("EZFS: bad journal superblock\n");
+		return -EUCLEAN;
+	}
+	j->sequence = jsb->sequence;
+
+	ret = ezfs_journal_replay(j);
+	j->committed = j->sequence - 1;
+	return ret;
+}
+
+/* Commits and checkpoints everything at unmount. Releasing the deferred
+ * blocks dirties bitmaps, which takes another round.
+ */
+static void
+ezfs_journal_shutdown(struct ezfs_journal *j)
+{
+	cancel_delayed_work_sync(&j->commit_work);
+	mutex_lock(&j->commit_mutex);
+	do {
+		if (ezfs_journal_do_commit(j) || ezfs_journal_checkpoint(j))
+			break;
+	} while (!list_empty(&j->running));
+	mutex_unlock(&j->commit_mutex);
+}
+
+static void
+ezfs_journal_free(struct ezfs_journal *j)
+{
+	struct ezfs_deferred_free *df, *next_df;
+	struct ezfs_jblock *jb, *next;
+
+	cancel_delayed_work_sync(&j->commit_work);
+	list_for_each_entry_safe(jb, next, &j->running, list) {
+		clear_buffer_ezfs_journal(jb->bh);
+		ezfs_jblock_free(jb);
+	}
+	list_for_each_entry_safe(jb, next, &j->checkpoint, list) {
+		jb->bh->b_private = NULL;
+		ezfs_jblock_free(jb);
+	}
+	list_splice(&j->running_frees, &j->committed_frees);
+	list_for_each_entry_safe(df, next_df, &j->committed_frees, list)
+		kfree(df);
+	__free_page(j->scratch);
+	kfree(j);
+}
+
+void
+update_parent_directory_times(struct inode *parent)
+{
+	parent->i_mtime = parent->i_ctime = current_time(parent);
+
+	mark_inode_dirty(parent);
+}
+
+void
+update_directory_inode(struct inode *dir, bool directory_flag,
+		       struct buffer_head *inode_bh,
+		       struct ezfs_super_block *sb_data, int inode_idx,
+		       int data_blk_idx)
+{
+	if (directory_flag)
+		inc_nlink(dir);
+
+	dir->i_size += sizeof(struct ezfs_dir_entry);
+	ezfs_journal_dirty(dir->i_sb, inode_bh);
+}
+
+static void
+update_inode_metadata(struct inode *inode, struct inode *dir)
+{
+	inode->i_ctime = dir->i_ctime = dir->i_mtime = current_time(inode);
+	drop_nlink(inode);
+	mark_inode_dirty(inode);
+	mark_inode_dirty(dir);
+}
+
+/* Takes a free inode number. The search starts in the inode bitmap block
+ * where the last one succeeded.
+ */
+static long
+ezfs_alloc_ino(struct super_block *sb)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	uint64_t nblocks = DIV_ROUND_UP(sbi->nr_inodes, EZFS_BITS_PER_BLOCK);
+	uint64_t b, i, bits, bit;
+	struct buffer_head *bh = NULL;
+	long ino = -ENOSPC;
+
+	spin_lock(&sbi->alloc_lock);
+	for (i = 0; i < nblocks; i++) {
+		b = (sbi->ino_hint + i) % nblocks;
+		bits = min_t(uint64_t, EZFS_BITS_PER_BLOCK,
+			     sbi->nr_inodes - b * EZFS_BITS_PER_BLOCK);
+		bh = sbi->inode_bitmap[b];
+		bit = find_first_zero_bit((unsigned long *) bh->b_data, bits);
+		if (bit < bits) {
+			__set_bit(bit, (unsigned long *) bh->b_data);
+			sbi->ino_hint = b;
+			ino = b * EZFS_BITS_PER_BLOCK + bit +
+			      EZFS_ROOT_INODE_NUMBER;
+			break;
+		}
+	}
+	spin_unlock(&sbi->alloc_lock);
+
+	if (ino < 0) {
+		pr_err("No free inodes\n");
+	} else {
+		percpu_counter_dec(&sbi->free_inodes);
+		ezfs_journal_dirty(sb, bh);
+	}
+	return ino;
+}
+
+static void
+ezfs_free_ino(struct super_block *sb, unsigned long ino)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	unsigned long idx = ino - EZFS_ROOT_INODE_NUMBER;
+	struct buffer_head *bh = sbi->inode_bitmap[idx / EZFS_BITS_PER_BLOCK];
+
+	spin_lock(&sbi->alloc_lock);
+	__clear_bit(idx % EZFS_BITS_PER_BLOCK, (unsigned long *) bh->b_data);
+	spin_unlock(&sbi->alloc_lock);
+	percpu_counter_inc(&sbi->free_inodes);
+	ezfs_journal_dirty(sb, bh);
+}
+
+/* Free data space is indexed in memory, per allocation group, by two
+ * rbtrees over the same free extents: one ordered by first block for goal
+ * lookups and merging, one by length for best-fit allocation. The on-disk
+ * bitmap is only written to persist the result. Block numbers here are data
+ * bitmap indices. Callers hold the group's lock.
+ */
+static void
+ezfs_free_space_link(struct ezfs_group *grp, struct ezfs_free_extent *fe)
+{
+	struct rb_node **p = &grp->free_by_start.rb_node, *parent = NULL;
+	struct ezfs_free_extent *cur;
+
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct ezfs_free_extent, by_start);
+		p = fe->start < cur->start ? &parent->rb_left : &parent->rb_right;
+	}
+	rb_link_node(&fe->by_start, parent, p);
+	rb_insert_color(&fe->by_start, &grp->free_by_start);
+
+	p = &grp->free_by_len.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct ezfs_free_extent, by_len);
+		if (fe->len < cur->len ||
+		    (fe->len == cur->len && fe->start < cur->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&fe->by_len, parent, p);
+	rb_insert_color(&fe->by_len, &grp->free_by_len);
+}
+
+static void
+ezfs_free_space_unlink(struct ezfs_group *grp, struct ezfs_free_extent *fe)
+{
+	rb_erase(&fe->by_start, &grp->free_by_start);
+	rb_erase(&fe->by_len, &grp->free_by_len);
+}
+
+/* The free extent with the highest start at or before @blk. */
+static struct ezfs_free_extent *
+ezfs_free_space_find(struct ezfs_group *grp, uint64_t blk)
+{
+	struct rb_node *n = grp->free_by_start.rb_node;
+	struct ezfs_free_extent *cur, *best = NULL;
+
+	while (n) {
+		cur = rb_entry(n, struct ezfs_free_extent, by_start);
+		if (cur->start <= blk) {
+			best = cur;
+			n = n->rb_right;
+		} else {
+			n = n->rb_left;
+		}
+	}
+	return best;
+}
+
+/* The smallest free extent of at least @len blocks, or the largest one if
+ * none is that long.
+ */
+static struct ezfs_free_extent *
+ezfs_free_space_best_fit(struct ezfs_group *grp, uint64_t len)
+{
+	struct rb_node *n = grp->free_by_len.rb_node;
+	struct ezfs_free_extent *cur, *best = NULL;
+
+	while (n) {
+		cur = rb_entry(n, struct ezfs_free_extent, by_len);
+		if (cur->len >= len) {
+			best = cur;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	if (!best && (n = rb_last(&grp->free_by_len)))
+		best = rb_entry(n, struct ezfs_free_extent, by_len);
+	return best;
+}
+
+/* Carves [start, start + len) out of the free extent @fe. */
+static void
+ezfs_free_space_take(struct ezfs_group *grp, struct ezfs_free_extent *fe,
+		     uint64_t start, uint64_t len)
+{
+	uint64_t head_len = start - fe->start;
+	uint64_t tail_len = fe->start + fe->len - (start + len);
+	struct ezfs_free_extent *tail;
+
+	ezfs_free_space_unlink(grp, fe);
+	if (head_len && tail_len) {
+		tail = kmalloc(sizeof(*tail), GFP_NOFS | __GFP_NOFAIL);
+		tail->start = start + len;
+		tail->len = tail_len;
+		ezfs_free_space_link(grp, tail);
+	}
+
+	if (head_len) {
+		fe->len = head_len;
+	} else if (tail_len) {
+		fe->start = start + len;
+		fe->len = tail_len;
+	} else {
+		kfree(fe);
+		return;
+	}
+	ezfs_free_space_link(grp, fe);
+}
+
+/* Returns [start, start + len) to the index, merging it with the free
+ * extents on either side.
+ */
+static void
+ezfs_free_space_add(struct ezfs_group *grp, uint64_t start, uint64_t len)
+{
+	struct ezfs_free_extent *prev, *next = NULL, *fe = NULL;
+	struct rb_node *n;
+
+	prev = ezfs_free_space_find(grp, start);
+	n = prev ? rb_next(&prev->by_start) : rb_first(&grp->free_by_start);
+	if (n)
+		next = rb_entry(n, struct ezfs_free_extent, by_start);
+
+	if (WARN_ON(prev && prev->start + prev->len > start) ||
+	    WARN_ON(next && start + len > next->start))
+		return;
+
+	if (prev && prev->start + prev->len == start) {
+		ezfs_free_space_unlink(grp, prev);
+		start = prev->start;
+		len += prev->len;
+		fe = prev;
+	}
+	if (next && start + len == next->start) {
+		ezfs_free_space_unlink(grp, next);
+		len += next->len;
+		if (fe)
+			kfree(next);
+		else
+			fe = next;
+	}
+	if (!fe)
+		fe = kmalloc(sizeof(*fe), GFP_NOFS | __GFP_NOFAIL);
+
+	fe->start = start;
+	fe->len = len;
+	ezfs_free_space_link(grp, fe);
+}
+
+static void
+ezfs_destroy_free_space(struct ezfs_sb_info *sbi)
+{
+	struct ezfs_free_extent *fe, *tmp;
+	unsigned int g;
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		rbtree_postorder_for_each_entry_safe(fe, tmp,
+			&sbi->groups[g].free_by_start, by_start)
+			kfree(fe);
+		brelse(sbi->groups[g].bitmap_bh);
+		brelse(sbi->groups[g].desc_bh);
+	}
+	kfree(sbi->groups);
+	sbi->groups = NULL;
+	sbi->nr_groups = 0;
+}
+
+static inline struct ezfs_group *
+ezfs_group_of(struct ezfs_sb_info *sbi, uint64_t blk)
+{
+	return &sbi->groups[blk / EZFS_BLOCKS_PER_GROUP];
+}
+
+/* The allocation group that @inode's blocks go to. */
+static unsigned int
+ezfs_inode_group(struct inode *inode)
+{
+	struct ezfs_sb_info *sbi = inode->i_sb->s_fs_info;
+
+	return EZFS_I(inode)->group % sbi->nr_groups;
+}
+
+static void
+ezfs_group_count_dir(struct inode *dir, int delta)
+{
+	struct ezfs_sb_info *sbi = dir->i_sb->s_fs_info;
+	struct ezfs_group *grp = &sbi->groups[ezfs_inode_group(dir)];
+
+	mutex_lock(&grp->lock);
+	grp->desc->ndirs += delta;
+	mutex_unlock(&grp->lock);
+	ezfs_journal_dirty(dir->i_sb, grp->desc_bh);
+}
+
+/* Splits the data area into allocation groups and builds their free space
+ * index from the data bitmap at mount time. The bitmap and descriptor
+ * blocks stay in memory, each group holding a reference to its own.
+ */
+static int
+ezfs_build_free_space(struct super_block *sb)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	struct ezfs_super_block *ezfs_sb = get_ezfs_superblock(sb);
+	struct buffer_head *bitmap_bh = NULL, *desc_bh = NULL;
+	unsigned long off, start, end, limit;
+	struct ezfs_free_extent *fe;
+	struct ezfs_group *grp;
+	unsigned int g;
+
+	BUILD_BUG_ON(EZFS_BITS_PER_BLOCK % EZFS_BLOCKS_PER_GROUP);
+	if (!sbi->nr_data_blocks)
+		return -EINVAL;
+
+	g = DIV_ROUND_UP(sbi->nr_data_blocks, EZFS_BLOCKS_PER_GROUP);
+	sbi->groups = kcalloc(g, sizeof(*sbi->groups), GFP_KERNEL);
+	if (!sbi->groups)
+		return -ENOMEM;
+	sbi->nr_groups = g;
+	sbi->free_blocks = 0;
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		mutex_init(&grp->lock);
+		grp->start = (uint64_t) g * EZFS_BLOCKS_PER_GROUP;
+		grp->len = min_t(uint64_t, EZFS_BLOCKS_PER_GROUP,
+				 sbi->nr_data_blocks - grp->start);
+		grp->free_by_start = RB_ROOT;
+		grp->free_by_len = RB_ROOT;
+
+		/* Neighbouring groups share bitmap and descriptor blocks. */
+		if (grp->start % EZFS_BITS_PER_BLOCK == 0)
+			bitmap_bh = sb_bread(sb, ezfs_sb->data_bitmap_blk +
+					     grp->start / EZFS_BITS_PER_BLOCK);
+		else
+			get_bh(bitmap_bh);
+		grp->bitmap_bh = bitmap_bh;
+		if (g % EZFS_DESCS_PER_BLOCK == 0)
+			desc_bh = sb_bread(sb, ezfs_sb->group_desc_blk +
+					   g / EZFS_DESCS_PER_BLOCK);
+		else
+			get_bh(desc_bh);
+		grp->desc_bh = desc_bh;
+		if (!bitmap_bh || !desc_bh) {
+			ezfs_destroy_free_space(sbi);
+			return -EIO;
+		}
+		grp->desc = (struct ezfs_group_desc *) desc_bh->b_data +
+			    g % EZFS_DESCS_PER_BLOCK;
+
+		/* The group's bits in its bitmap block are [off, limit). */
+		off = grp->start % EZFS_BITS_PER_BLOCK;
+		limit = off + grp->len;
+		end = off;
+		while ((start = find_next_zero_bit(
+				(unsigned long *) bitmap_bh->b_data, limit,
+				end)) < limit) {
+			end = find_next_bit((unsigned long *) bitmap_bh->b_data,
+					    limit, start);
+			fe = kmalloc(sizeof(*fe), GFP_KERNEL);
+			if (!fe) {
+				ezfs_destroy_free_space(sbi);
+				return -ENOMEM;
+			}
+			fe->start = grp->start + start - off;
+			fe->len = end - start;
+			ezfs_free_space_link(grp, fe);
+			grp->free_blocks += fe->len;
+		}
+		sbi->free_blocks += grp->free_blocks;
+	}
+
+	return 0;
+}
+
+/* Returns [pblk, pblk + count) to the groups it spans. The data bitmap only
+ * tracks blocks from data_start on. The caller accounts for the blocks in
+ * free_blocks.
+ */
+static void
+ezfs_group_free(struct super_block *sb, uint64_t pblk, uint64_t count)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	uint64_t start = pblk - sbi->data_start;
+	uint64_t end = start + count, n;
+	struct ezfs_group *grp;
+
+	if (WARN_ON(pblk < sbi->data_start || end > sbi->nr_data_blocks))
+		return;
+
+	for (; start < end; start += n) {
+		grp = ezfs_group_of(sbi, start);
+		n = min(end, grp->start + grp->len) - start;
+
+		mutex_lock(&grp->lock);
+		bitmap_clear((unsigned long *) grp->bitmap_bh->b_data,
+			     start % EZFS_BITS_PER_BLOCK, n);
+		ezfs_free_space_add(grp, start, n);
+		grp->free_blocks += n;
+		mutex_unlock(&grp->lock);
+		ezfs_journal_dirty(sb, grp->bitmap_bh);
+	}
+}
+
+static void
+ezfs_free_data_blocks(struct super_block *sb, uint64_t pblk, uint64_t count)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+
+	ezfs_group_free(sb, pblk, count);
+	spin_lock(&sbi->alloc_lock);
+	sbi->free_blocks += count;
+	spin_unlock(&sbi->alloc_lock);
+}
+
+/* Reads the refcount table block that covers data block @pblk, and where
+ * in it @pblk's count is.
+ */
+static struct buffer_head *
+ezfs_ref_bread(struct super_block *sb, uint64_t pblk, unsigned int *idx)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	uint64_t n = pblk - sbi->data_start;
+
+	*idx = n % EZFS_REFS_PER_BLOCK;
+	return sb_bread(sb, sbi->refcount_start + n / EZFS_REFS_PER_BLOCK);
+}
+
+/* Adds an owner to each of the @count blocks at @pblk. Nothing changes if
+ * one of them already has as many as it can count.
+ */
+static int
+ezfs_ref_get(struct super_block *sb, uint64_t pblk, uint64_t count)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+	unsigned int idx, n, i;
+	uint64_t done;
+	uint16_t *refs;
+	int ret = 0;
+
+	mutex_lock(&sbi->refcount_lock);
+	for (done = 0; done < count && !ret; done += n) {
+		bh = ezfs_ref_bread(sb, pblk + done, &idx);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		refs = (uint16_t *) bh->b_data;
+		n = min_t(uint64_t, count - done, EZFS_REFS_PER_BLOCK - idx);
+		for (i = 0; i < n && !ret; i++) {
+			if (refs[idx + i] == EZFS_REF_MAX)
+				ret = -EMLINK;
+		}
+		brelse(bh);
+	}
+	for (done = 0; done < count && !ret; done += n) {
+		bh = ezfs_ref_bread(sb, pblk + done, &idx);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		refs = (uint16_t *) bh->b_data;
+		n = min_t(uint64_t, count - done, EZFS_REFS_PER_BLOCK - idx);
+		for (i = 0; i < n; i++)
+			refs[idx + i]++;
+		ezfs_journal_dirty(sb, bh);
+		brelse(bh);
+	}
+	mutex_unlock(&sbi->refcount_lock);
+	return ret;
+}
+
+/* Drops an owner from each of the @count blocks at @pblk. The blocks that
+ * had no other owner are handed to @free.
+ */
+static void
+ezfs_ref_put(struct super_block *sb, uint64_t pblk, uint64_t count,
+	     void (*free)(struct super_block *, uint64_t, uint64_t))
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	uint64_t done, run = 0;
+	struct buffer_head *bh;
+	unsigned int idx, n, i;
+	uint16_t *refs;
+
+	mutex_lock(&sbi->refcount_lock);
+	for (done = 0; done < count; done += n) {
+		bh = ezfs_ref_bread(sb, pblk + done, &idx);
+		n = min_t(uint64_t, count - done, EZFS_REFS_PER_BLOCK - idx);
+		if (!bh) {
+			/* Better to leak the blocks than free shared ones. */
+			pr_err_ratelimited("EZFS: cannot read the refcount of block %llu\n",
+					   pblk + done);
+			if (run)
+				free(sb, pblk + done - run, run);
+			run = 0;
+			continue;
+		}
+		refs = (uint16_t *) bh->b_data;
+		for (i = 0; i < n; i++) {
+			if (!refs[idx + i]) {
+				run++;
+				continue;
+			}
+			refs[idx + i]--;
+			if (run)
+				free(sb, pblk + done + i - run, run);
+			run = 0;
+		}
+		ezfs_journal_dirty(sb, bh);
+		brelse(bh);
+	}
+	if (run)
+		free(sb, pblk + count - run, run);
+	mutex_unlock(&sbi->refcount_lock);
+}
+
+/* How many of the @count blocks at @pblk are, like the first one, shared
+ * or not, as *shared says.
+ */
+static long
+ezfs_ref_run(struct super_block *sb, uint64_t pblk, uint64_t count,
+	     bool *shared)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+	unsigned int idx, n, i;
+	uint64_t done;
+	uint16_t *refs;
+
+	mutex_lock(&sbi->refcount_lock);
+	for (done = 0; done < count; done += n) {
+		bh = ezfs_ref_bread(sb, pblk + done, &idx);
+		if (!bh) {
+			mutex_unlock(&sbi->refcount_lock);
+			return -EIO;
+		}
+		refs = (uint16_t *) bh->b_data;
+		if (!done)
+			*shared = refs[idx] != 0;
+		n = min_t(uint64_t, count - done, EZFS_REFS_PER_BLOCK - idx);
+		for (i = 0; i < n; i++) {
+			if ((refs[idx + i] != 0) != *shared)
+				break;
+		}
+		brelse(bh);
+		if (i < n) {
+			done += i;
+			break;
+		}
+	}
+	mutex_unlock(&sbi->refcount_lock);
+	return done;
+}
+
+/* Frees data blocks that were in use. With the "discard" mount option they
+ * are queued for ezfs_discard_flush() instead, and only reach the allocator
+ * once the device has been told about them, so that a discard can never
+ * hit a block that was handed out again.
+ */
+static void
+ezfs_release_data_blocks(struct super_block *sb, uint64_t pblk,
+			 uint64_t count)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	struct ezfs_deferred_free *df, *last;
+	uint64_t n;
+
+	if (!READ_ONCE(sbi->opt_discard)) {
+		ezfs_free_data_blocks(sb, pblk, count);
+		return;
+	}
+
+	df = kmalloc(sizeof(*df), GFP_NOFS | __GFP_NOFAIL);
+	spin_lock(&sbi->discard_lock);
+	last = list_last_entry_or_null(&sbi->discard_list,
+				       struct ezfs_deferred_free, list);
+	if (last && last->start + last->count == pblk) {
+		/* A file being truncated frees its runs in order. */
+		last->count += count;
+	} else {
+		df->start = pblk;
+		df->count = count;
+		list_add_tail(&df->list, &sbi->discard_list);
+		df = NULL;
+	}
+	n = sbi->nr_discard += count;
+	spin_unlock(&sbi->discard_lock);
+	kfree(df);
+
+	if (n == count)
+		queue_delayed_work(system_wq, &sbi->discard_work,
+				   EZFS_DISCARD_INTERVAL);
+	else if (n >= EZFS_DISCARD_BATCH)
+		mod_delayed_work(system_wq, &sbi->discard_work, 0);
+}
+
+static int
+ezfs_discard_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+	uint64_t x = list_entry(a, struct ezfs_deferred_free, list)->start;
+	uint64_t y = list_entry(b, struct ezfs_deferred_free, list)->start;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Discards the ranges queued so far and hands them to the allocator. They
+ * are sorted and merged first, and go out as one chain of bios. With a
+ * journal, the frees are committed before anything is discarded, so that
+ * replay cannot bring back a block whose contents are gone.
+ */
+static void
+ezfs_discard_flush(struct super_block *sb)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	struct ezfs_deferred_free *df, *next, *prev = NULL;
+	unsigned int shift = sb->s_blocksize_bits - 9;
+	struct bio *bio = NULL;
+	struct blk_plug plug;
+	LIST_HEAD(ranges);
+	int ret = 0, err;
+
+	spin_lock(&sbi->discard_lock);
+	list_splice_init(&sbi->discard_list, &ranges);
+	sbi->nr_discard = 0;
+	spin_unlock(&sbi->discard_lock);
+	if (list_empty(&ranges))
+		return;
+
+	if (sbi->journal)
+		ret = ezfs_journal_commit(sbi->journal);
+
+	list_sort(NULL, &ranges, ezfs_discard_cmp);
+	list_for_each_entry_safe(df, next, &ranges, list) {
+		if (prev && prev->start + prev->count == df->start) {
+			prev->count += df->count;
+			list_del(&df->list);
+			kfree(df);
+		} else {
+			prev = df;
+		}
+	}
+
+	if (!ret) {
+		blk_start_plug(&plug);
+		list_for_each_entry(df, &ranges, list) {
+			ret = __blkdev_issue_discard(sb->s_bdev,
+						     df->start << shift,
+						     df->count << shift,
+						     GFP_NOFS, 0, &bio);
+			if (ret)
+				break;
+		}
+		if (bio) {
+			err = submit_bio_wait(bio);
+			bio_put(bio);
+			if (!ret)
+				ret = err;
+		}
+		blk_finish_plug(&plug);
+	}
+	if (ret && ret != -EOPNOTSUPP)
+		pr_warn_ratelimited("EZFS: discard failed: %d\n", ret);
+
+	/* The blocks are free whether or not the device heard about it. */
+	list_for_each_entry_safe(df, next, &ranges, list) {
+		ezfs_free_data_blocks(sb, df->start, df->count);
+		kfree(df);
+	}
+}
+
+static void
+ezfs_discard_work(struct work_struct *work)
+{
+	struct ezfs_sb_info *sbi =
+	    container_of(to_delayed_work(work), struct ezfs_sb_info,
+			 discard_work);
+
+	ezfs_discard_flush(sbi->sb);
+}
+
+/* The first free extent of @grp with at least @minlen blocks in
+ * [*start, end). *start and *len are set to that part of it.
+ */
+static struct ezfs_free_extent *
+ezfs_trim_next(struct ezfs_group *grp, uint64_t *start, uint64_t end,
+	       uint64_t minlen, uint64_t *len)
+{
+	struct ezfs_free_extent *fe;
+	uint64_t blk = *start;
+	struct rb_node *n;
+
+	fe = ezfs_free_space_find(grp, blk);
+	n = fe ? &fe->by_start : rb_first(&grp->free_by_start);
+	for (; n; n = rb_next(n)) {
+		fe = rb_entry(n, struct ezfs_free_extent, by_start);
+		*start = max(fe->start, blk);
+		if (*start >= end)
+			break;
+		if (fe->start + fe->len <= *start)
+			continue;
+		*len = min(fe->start + fe->len, end) - *start;
+		if (*len >= minlen)
+			return fe;
+	}
+	return NULL;
+}
+
+/* Discards the free extents of @grp that lie in data blocks [first, last)
+ * and are at least @minlen blocks long. Like the blocks queued for
+ * ezfs_discard_flush(), each one is kept from the allocator while the
+ * device works on it: it leaves the free space index, the group is
+ * unlocked for the discard, and it goes back afterwards. Blocks that
+ * delayed allocations have reserved are not taken.
+ */
+static int
+ezfs_trim_group(struct super_block *sb, struct ezfs_group *grp,
+		uint64_t first, uint64_t last, uint64_t minlen,
+		uint64_t *trimmed)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	uint64_t blk = max(first, grp->start);
+	uint64_t end = min(last, grp->start + grp->len);
+	struct ezfs_free_extent *fe;
+	uint64_t len;
+	bool taken;
+	int ret = 0;
+
+	mutex_lock(&grp->lock);
+	while ((fe = ezfs_trim_next(grp, &blk, end, minlen, &len))) {
+		spin_lock(&sbi->alloc_lock);
+		taken = sbi->free_blocks >= sbi->reserved_blocks + len;
+		if (taken)
+			sbi->free_blocks -= len;
+		spin_unlock(&sbi->alloc_lock);
+		if (!taken) {
+			blk += len;
+			continue;
+		}
+		ezfs_free_space_take(grp, fe, blk, len);
+		grp->free_blocks -= len;
+		mutex_unlock(&grp->lock);
+
+		ret = sb_issue_discard(sb, sbi->data_start + blk, len,
+				       GFP_NOFS, 0);
+
+		mutex_lock(&grp->lock);
+		ezfs_free_space_add(grp, blk, len);
+		grp->free_blocks += len;
+		spin_lock(&sbi->alloc_lock);
+		sbi->free_blocks += len;
+		spin_unlock(&sbi->alloc_lock);
+		if (ret)
+			break;
+		*trimmed += len;
+		blk += len;
+	}
+	mutex_unlock(&grp->lock);
+	return ret;
+}
+
+/* FITRIM: discards the free runs of the data area inside @range, a byte
+ * range of the device, and returns the number of bytes discarded in it.
+ */
+static int
+ezfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	uint64_t first, last, minlen, trimmed = 0;
+	unsigned int g;
+	int ret = 0;
+
+	first = range->start / EZFS_BLOCK_SIZE;
+	last = range->len > U64_MAX - range->start ? U64_MAX :
+	    (range->start + range->len) / EZFS_BLOCK_SIZE;
+	minlen = max_t(uint64_t, 1,
+		       DIV_ROUND_UP(range->minlen, EZFS_BLOCK_SIZE));
+	if (first >= sbi->data_start + sbi->nr_data_blocks ||
+	    minlen > EZFS_BLOCKS_PER_GROUP)
+		return -EINVAL;
+	first = first > sbi->data_start ? first - sbi->data_start : 0;
+	last = min(last - min(last, sbi->data_start), sbi->nr_data_blocks);
+
+	/* Frees that are not committed yet could still be undone by replay. */
+	if (sbi->journal) {
+		ret = ezfs_journal_commit(sbi->journal);
+		if (ret)
+			return ret;
+	}
+
+	for (g = first / EZFS_BLOCKS_PER_GROUP;
+	     g < sbi->nr_groups && sbi->groups[g].start < last; g++) {
+		ret = ezfs_trim_group(sb, &sbi->groups[g], first, last, minlen,
+				      &trimmed);
+		if (ret)
+			break;
+		if (fatal_signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+
+	range->len = trimmed * EZFS_BLOCK_SIZE;
+	return ret;
+}
+
+/* Takes back blocks that ezfs_alloc_data_run() handed out against a
+ * reservation which is still needed.
+ */
+static void
+ezfs_unalloc_reserved(struct super_block *sb, uint64_t pblk, uint64_t count)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+
+	ezfs_group_free(sb, pblk, count);
+	spin_lock(&sbi->alloc_lock);
+	sbi->free_blocks += count;
+	sbi->reserved_blocks += count;
+	spin_unlock(&sbi->alloc_lock);
+}
+
+/* Takes a run of up to *len free blocks from @grp. The run starts at @goal
+ * if that block is in the group and free; otherwise it comes from the
+ * best-fitting free extent. Returns the data bitmap index of the run.
+ */
+static long
+ezfs_group_alloc(struct ezfs_group *grp, uint64_t goal, uint64_t *len)
+{
+	struct ezfs_free_extent *fe = NULL;
+	uint64_t start = goal;
+	long ret = -ENOSPC;
+
+	mutex_lock(&grp->lock);
+	if (goal >= grp->start && goal < grp->start + grp->len) {
+		fe = ezfs_free_space_find(grp, goal);
+		if (fe && fe->start + fe->len <= goal)
+			fe = NULL;
+	}
+	if (!fe) {
+		fe = ezfs_free_space_best_fit(grp, *len);
+		if (!fe)
+			goto out;
+		start = fe->start;
+	}
+
+	*len = min(*len, fe->start + fe->len - start);
+	ezfs_free_space_take(grp, fe, start, *len);
+	bitmap_set((unsigned long *) grp->bitmap_bh->b_data,
+		   start % EZFS_BITS_PER_BLOCK, *len);
+	grp->free_blocks -= *len;
+	ret = start;
+out:
+	mutex_unlock(&grp->lock);
+	return ret;
+}
+
+/* Allocates a run of up to *len free data blocks. The run starts at @goal if
+ * that block is free, so that a growing file stays physically contiguous;
+ * otherwise it comes from the goal's group if possible, so that a file stays
+ * near its directory. The run may be shorter than asked for; its length is
+ * returned in *len. At least @margin free blocks that nobody has reserved
+ * must be left over. If @reserved is set, the blocks were reserved by
+ * delayed allocation and the reservation is used up by the blocks actually
+ * allocated.
+ */
+static long
+ezfs_alloc_data_run(struct super_block *sb, uint64_t goal, uint64_t *len,
+		    uint64_t margin, bool reserved)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	uint64_t want = *len, claim, got = 0, need;
+	unsigned int first = 0, pass, i;
+	struct ezfs_group *grp;
+	long ret = -ENOSPC;
+
+	/* Claim the blocks up front, so that the groups can be searched
+	 * without holding alloc_lock.
+	 */
+	spin_lock(&sbi->alloc_lock);
+	if (reserved) {
+		WARN_ON(sbi->reserved_blocks < want);
+		sbi->reserved_blocks -= min(sbi->reserved_blocks, want);
+	}
+	claim = sbi->free_blocks -
+		min(sbi->free_blocks, sbi->reserved_blocks + margin);
+	claim = min(claim, want);
+	sbi->free_blocks -= claim;
+	spin_unlock(&sbi->alloc_lock);
+
+	goal -= min(goal, sbi->data_start);
+	if (goal < sbi->nr_data_blocks)
+		first = goal / EZFS_BLOCKS_PER_GROUP;
+
+	/* The goal's group first, then the groups after it: at first only
+	 * those with room for the whole run, then any with a free block.
+	 */
+	for (pass = 0; claim && pass < 2 && ret < 0; pass++) {
+		for (i = 0; i < sbi->nr_groups; i++) {
+			grp = &sbi->groups[(first + i) % sbi->nr_groups];
+			need = pass || !i ? 1 : claim;
+			if (READ_ONCE(grp->free_blocks) < need)
+				continue;
+			got = claim;
+			ret = ezfs_group_alloc(grp, goal, &got);
+			if (ret >= 0) {
+				ezfs_journal_dirty(sb, grp->bitmap_bh);
+				break;
+			}
+		}
+	}
+	if (ret < 0)
+		got = 0;
+
+	spin_lock(&sbi->alloc_lock);
+	sbi->free_blocks += claim - got;
+	if (reserved)
+		sbi->reserved_blocks += want - got;
+	spin_unlock(&sbi->alloc_lock);
+
+	*len = got;
+	return ret < 0 ? ret : ret + sbi->data_start;
+}
+
+static long
+ezfs_alloc_data_block(struct super_block *sb, uint64_t goal, uint64_t margin)
+{
+	uint64_t len = 1;
+
+	return ezfs_alloc_data_run(sb, goal, &len, margin, false);
+}
+
+/* Picks the group for a new directory, after the Orlov allocator. Top-level
+ * directories are spread out over the groups with the most free space and
+ * the fewest directories. Deeper ones stay with their parent unless its
+ * group is running short of space or already holds more than its share of
+ * directories; then the next group that does not is used.
+ */
+static unsigned int
+ezfs_orlov_group(struct inode *parent)
+{
+	struct ezfs_sb_info *sbi = parent->i_sb->s_fs_info;
+	unsigned int ngroups = sbi->nr_groups, start, g, i;
+	unsigned int ndirs, avedirs = 0, best = 0, best_dirs = UINT_MAX;
+	uint64_t free, avefree, best_free = 0;
+
+	for (g = 0; g < ngroups; g++)
+		avedirs += READ_ONCE(sbi->groups[g].desc->ndirs);
+	avedirs = DIV_ROUND_UP(avedirs, ngroups);
+	avefree = READ_ONCE(sbi->free_blocks) / ngroups;
+
+	if (parent->i_ino == EZFS_ROOT_INODE_NUMBER) {
+		start = prandom_u32_max(ngroups);
+		for (i = 0; i < ngroups; i++) {
+			g = (start + i) % ngroups;
+			free = READ_ONCE(sbi->groups[g].free_blocks);
+			ndirs = READ_ONCE(sbi->groups[g].desc->ndirs);
+			if (free < avefree || ndirs >= best_dirs)
+				continue;
+			best = g;
+			best_dirs = ndirs;
+		}
+		if (best_dirs != UINT_MAX)
+			return best;
+	} else {
+		start = ezfs_inode_group(parent);
+		for (i = 0; i < ngroups; i++) {
+			g = (start + i) % ngroups;
+			free = READ_ONCE(sbi->groups[g].free_blocks);
+			ndirs = READ_ONCE(sbi->groups[g].desc->ndirs);
+			if (ndirs <= avedirs &&
+			    free + EZFS_BLOCKS_PER_GROUP / 4 >= avefree)
+				return g;
+		}
+	}
+
+	/* Nothing fits the pattern: take the group with the most room. */
+	for (g = 0; g < ngroups; g++) {
+		free = READ_ONCE(sbi->groups[g].free_blocks);
+		if (free > best_free) {
+			best = g;
+			best_free = free;
+		}
+	}
+	return best;
+}
+
+/* Delayed allocation: a buffered write only promises that @count blocks will
+ * be there at writeback time. EZFS_META_RESERVE blocks are held back from
+ * these promises for the extent blocks writeback may need.
+ */
+static int
+ezfs_reserve_blocks(struct super_block *sb, uint64_t count)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	bool flushed = false;
+	int ret = 0;
+
+retry:
+	spin_lock(&sbi->alloc_lock);
+	if (sbi->free_blocks <
+	    sbi->reserved_blocks + count + EZFS_META_RESERVE)
+		ret = -ENOSPC;
+	else
+		sbi->reserved_blocks += count;
+	spin_unlock(&sbi->alloc_lock);
+
+	/* Blocks waiting to be discarded are free too. Never called inside
+	 * a journal handle, which the discard worker may have to commit.
+	 */
+	if (ret && !flushed && READ_ONCE(sbi->nr_discard)) {
+		flush_delayed_work(&sbi->discard_work);
+		flushed = true;
+		ret = 0;
+		goto retry;
+	}
+
+	return ret;
+}
+
+static void
+ezfs_release_reservation(struct super_block *sb, uint64_t count)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+
+	spin_lock(&sbi->alloc_lock);
+	WARN_ON(sbi->reserved_blocks < count);
+	sbi->reserved_blocks -= min(sbi->reserved_blocks, count);
+	spin_unlock(&sbi->alloc_lock);
+}
+
+/* Serializes changes to @inode's extent list, and the allocations that go
+ * with them.
+ */
+static struct mutex *
+ezfs_map_lock(struct inode *inode)
+{
+	return &EZFS_I(inode)->map_lock;
+}
+
+/* Makes room for @n slots in the decoded extent list. */
+static int
+ezfs_map_reserve(struct ezfs_inode_info *ei, unsigned int n)
+{
+	struct ezfs_extent *map;
+	unsigned int *order;
+	unsigned int cap;
+
+	if (n <= ei->map_cap)
+		return 0;
+	cap = max(n, 2 * ei->map_cap);
+	map = kmalloc_array(cap, sizeof(*map), GFP_NOFS);
+	order = kmalloc_array(cap, sizeof(*order), GFP_NOFS);
+	if (!map || !order) {
+		kfree(map);
+		kfree(order);
+		return -ENOMEM;
+	}
+	memcpy(map, ei->map, ei->nextents * sizeof(*map));
+	memcpy(order, ei->order, ei->nextents * sizeof(*order));
+	if (ei->map != ei->inline_map) {
+		kfree(ei->map);
+		kfree(ei->order);
+	}
+	ei->map = map;
+	ei->order = order;
+	ei->map_cap = cap;
+	return 0;
+}
+
+static int
+ezfs_order_cmp(const void *a, const void *b, const void *priv)
+{
+	const struct ezfs_extent *map = priv;
+	uint32_t x = map[*(const unsigned int *) a].e_lblk;
+	uint32_t y = map[*(const unsigned int *) b].e_lblk;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Decodes the extent list of @raw, spill chain included, into @inode. */
+static int
+ezfs_load_extent_map(struct inode *inode, const struct ezfs_inode *raw)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_extent_block *eb;
+	struct buffer_head *bh;
+	uint64_t blk = raw->extent_blk;
+	unsigned int i, n = raw->nextents;
+	int ret;
+
+	ret = ezfs_map_reserve(ei, n);
+	if (ret)
+		return ret;
+	memcpy(ei->map, raw->extents,
+	       min_t(unsigned int, n, EZFS_INLINE_EXTENTS) *
+	       sizeof(struct ezfs_extent));
+	for (i = EZFS_INLINE_EXTENTS; i < n; i += EZFS_EXTENTS_PER_BLOCK) {
+		if (!blk)
+			return -EUCLEAN;
+		bh = sb_bread(inode->i_sb, blk);
+		if (!bh)
+			return -EIO;
+		eb = (struct ezfs_extent_block *) bh->b_data;
+		memcpy(&ei->map[i], eb->extents,
+		       min_t(unsigned int, n - i, EZFS_EXTENTS_PER_BLOCK) *
+		       sizeof(struct ezfs_extent));
+		blk = eb->next;
+		brelse(bh);
+	}
+
+	for (i = 0; i < n; i++)
+		ei->order[i] = i;
+	sort_r(ei->order, n, sizeof(*ei->order), ezfs_order_cmp, NULL, ei->map);
+	ei->nextents = n;
+	ei->extent_blk = raw->extent_blk;
+	return 0;
+}
+
+/* Returns a pointer to the on-disk copy of slot @idx, which must be past
+ * the inline ones. *bhp is set to the extent block's buffer head, which the
+ * caller must brelse().
+ */
+static struct ezfs_extent *
+ezfs_extent_slot(struct inode *inode, unsigned int idx,
+		 struct buffer_head **bhp)
+{
+	struct ezfs_extent_block *eb;
+	struct buffer_head *bh;
+	uint64_t blk = EZFS_I(inode)->extent_blk;
+	unsigned int hops;
+
+	idx -= EZFS_INLINE_EXTENTS;
+	for (hops = idx / EZFS_EXTENTS_PER_BLOCK;; hops--) {
+		if (!blk)
+			return ERR_PTR(-EUCLEAN);
+		bh = sb_bread(inode->i_sb, blk);
+		if (!bh)
+			return ERR_PTR(-EIO);
+		eb = (struct ezfs_extent_block *) bh->b_data;
+		if (!hops)
+			break;
+		blk = eb->next;
+		brelse(bh);
+	}
+
+	*bhp = bh;
+	return &eb->extents[idx % EZFS_EXTENTS_PER_BLOCK];
+}
+
+/* Stores @ext in slot @idx of the extent list. Inline slots reach the disk
+ * with the inode; spilled ones are written to their extent block now.
+ */
+static int
+ezfs_extent_set(struct inode *inode, unsigned int idx,
+		const struct ezfs_extent *ext)
+{
+	struct ezfs_extent *slot;
+	struct buffer_head *bh;
+
+	if (idx >= EZFS_INLINE_EXTENTS) {
+		slot = ezfs_extent_slot(inode, idx, &bh);
+		if (IS_ERR(slot))
+			return PTR_ERR(slot);
+		*slot = *ext;
+		ezfs_journal_dirty(inode->i_sb, bh);
+		brelse(bh);
+	}
+	EZFS_I(inode)->map[idx] = *ext;
+	return 0;
+}
+
+/* The position in ->order of the first extent that starts past @lblk. */
+static unsigned int
+ezfs_extent_bsearch(struct ezfs_inode_info *ei, sector_t lblk)
+{
+	unsigned int lo = 0, hi = ei->nextents, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ei->map[ei->order[mid]].e_lblk <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Finds the extent covering logical block @lblk. On success the extent is
+ * copied to @ext and its slot number stored in @idx. Otherwise -ENOENT is
+ * returned and, if @next is given, it is set to the first mapped logical
+ * block past @lblk, or EZFS_MAX_LBLK if there is none. Caller holds the
+ * inode's map lock.
+ */
+static int
+ezfs_extent_find(struct inode *inode, sector_t lblk, struct ezfs_extent *ext,
+		 unsigned int *idx, sector_t *next)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	unsigned int pos = ezfs_extent_bsearch(ei, lblk);
+	struct ezfs_extent *cur;
+
+	if (pos) {
+		cur = &ei->map[ei->order[pos - 1]];
+		if (lblk < cur->e_lblk + cur->e_len) {
+			*ext = *cur;
+			*idx = ei->order[pos - 1];
+			return 0;
+		}
+	}
+
+	if (next)
+		*next = pos < ei->nextents ? ei->map[ei->order[pos]].e_lblk :
+					     EZFS_MAX_LBLK;
+	return -ENOENT;
+}
+
+static inline int
+ezfs_extent_lookup(struct inode *inode, sector_t lblk,
+		   struct ezfs_extent *ext, unsigned int *idx)
+{
+	return ezfs_extent_find(inode, lblk, ext, idx, NULL);
+}
+
+/* The first block of @inode's allocation group. */
+static uint64_t
+ezfs_group_goal(struct inode *inode)
+{
+	struct ezfs_sb_info *sbi = inode->i_sb->s_fs_info;
+
+	return sbi->groups[ezfs_inode_group(inode)].start + sbi->data_start;
+}
+
+/* Where we would like logical block @lblk to go on disk: right after the
+ * physical block backing @lblk - 1, so that appends extend the last run.
+ * Anything else goes to the inode's group.
+ */
+static uint64_t
+ezfs_extent_goal(struct inode *inode, sector_t lblk)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_extent ext;
+	unsigned int idx;
+
+	if (!lblk)
+		return ezfs_group_goal(inode);
+	if (lblk == ei->next_lblk && ei->next_pblk)
+		return ei->next_pblk;
+	if (!ezfs_extent_lookup(inode, lblk - 1, &ext, &idx))
+		return ext.e_pblk + lblk - ext.e_lblk;
+	return ezfs_group_goal(inode);
+}
+
+/* Adds @new as the last slot of the extent list, spilling into a fresh
+ * extent block when the current ones are full. Caller holds the inode's map
+ * lock.
+ */
+static int
+ezfs_extent_insert(struct inode *inode, const struct ezfs_extent *new)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_extent *slot;
+	struct buffer_head *bh, *new_bh;
+	unsigned int n = ei->nextents, pos;
+	long eblk;
+	int ret;
+
+	ret = ezfs_map_reserve(ei, n + 1);
+	if (ret)
+		return ret;
+
+	/* A new extent block is needed when @n is the first slot of one. */
+	if (n >= EZFS_INLINE_EXTENTS &&
+	    (n - EZFS_INLINE_EXTENTS) % EZFS_EXTENTS_PER_BLOCK == 0) {
+		/* Keep it out of the way of the data run that is growing,
+		 * but in the inode's group.
+		 */
+		eblk = ezfs_alloc_data_block(sb, ezfs_group_goal(inode), 0);
+		if (eblk < 0)
+			return eblk;
+		new_bh = sb_getblk(sb, eblk);
+		if (!new_bh) {
+			ezfs_free_data_blocks(sb, eblk, 1);
+			return -EIO;
+		}
+		lock_buffer(new_bh);
+		memset(new_bh->b_data, 0, EZFS_BLOCK_SIZE);
+		set_buffer_uptodate(new_bh);
+		unlock_buffer(new_bh);
+		ezfs_journal_dirty(sb, new_bh);
+		brelse(new_bh);
+
+		if (n == EZFS_INLINE_EXTENTS) {
+			ei->extent_blk = eblk;
+		} else {
+			/* Link it behind the last block of the chain. */
+			slot = ezfs_extent_slot(inode, n - 1, &bh);
+			if (IS_ERR(slot)) {
+				ezfs_free_meta_blocks(sb, eblk, 1);
+				return PTR_ERR(slot);
+			}
+			((struct ezfs_extent_block *) bh->b_data)->next = eblk;
+			ezfs_journal_dirty(sb, bh);
+			brelse(bh);
+		}
+		inode->i_blocks += EZFS_BLOCK_SECTORS;
+	}
+
+	ret = ezfs_extent_set(inode, n, new);
+	if (ret)
+		return ret;
+	pos = ezfs_extent_bsearch(ei, new->e_lblk);
+	memmove(&ei->order[pos + 1], &ei->order[pos],
+		(n - pos) * sizeof(*ei->order));
+	ei->order[pos] = n;
+	ei->nextents = n + 1;
+	return 0;
+}
+
+/* Takes slot @idx out of the extent list. The last slot moves into it, as
+ * the list is kept dense on disk. Caller holds the inode's map lock.
+ */
+static int
+ezfs_extent_drop(struct inode *inode, unsigned int idx)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	unsigned int last = ei->nextents - 1, pos, last_pos;
+	int ret;
+
+	/* Starts are unique, so each slot is found by its own. */
+	pos = ezfs_extent_bsearch(ei, ei->map[idx].e_lblk) - 1;
+	last_pos = ezfs_extent_bsearch(ei, ei->map[last].e_lblk) - 1;
+	if (idx != last) {
+		ret = ezfs_extent_set(inode, idx, &ei->map[last]);
+		if (ret)
+			return ret;
+		ei->order[last_pos] = idx;
+	}
+	memmove(&ei->order[pos], &ei->order[pos + 1],
+		(last - pos) * sizeof(*ei->order));
+	ei->nextents = last;
+	return 0;
+}
+
+/* Records that the @len logical blocks starting at @lblk now live at physical
+ * blocks @pblk onwards. The extent ending right before @lblk is grown if
+ * @pblk continues its run and its flags match, otherwise a new extent is
+ * added. Caller holds the inode's map lock.
+ */
+static int
+ezfs_extent_append(struct inode *inode, sector_t lblk, uint64_t pblk,
+		   uint32_t len, uint16_t flags)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_extent ext;
+	unsigned int idx;
+	int ret;
+
+	if (lblk && !ezfs_extent_lookup(inode, lblk - 1, &ext, &idx) &&
+	    ext.e_lblk + ext.e_len == lblk &&
+	    ext.e_pblk + ext.e_len == pblk && ext.e_flags == flags &&
+	    ext.e_len + len <= EZFS_MAX_EXTENT_LEN) {
+		ext.e_len += len;
+		ret = ezfs_extent_set(inode, idx, &ext);
+	} else {
+		ext.e_lblk = lblk;
+		ext.e_len = len;
+		ext.e_flags = flags;
+		ext.e_pblk = pblk;
+		ret = ezfs_extent_insert(inode, &ext);
+	}
+	if (ret)
+		return ret;
+
+	ei->next_lblk = lblk + len;
+	ei->next_pblk = pblk + len;
+	return 0;
+}
+
+/* Unmaps logical blocks [from, to). Their disk blocks are freed if @release
+ * is set; otherwise the caller is about to map them again. Extent blocks
+ * that end up empty are freed. Caller holds the inode's map lock.
+ */
+static int
+ezfs_remove_extents(struct inode *inode, sector_t from, sector_t to,
+		    bool release)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_extent cur, tail;
+	struct buffer_head *bh, *last_bh;
+	struct ezfs_extent_block *eb;
+	unsigned int i, keep_blocks;
+	uint64_t blk, next, *link;
+	sector_t lblk, start, end;
+	int ret;
+
+	for (lblk = from; lblk < to; lblk = end) {
+		if (ezfs_extent_find(inode, lblk, &cur, &i, &end))
+			continue;
+		start = cur.e_lblk;
+		end = start + cur.e_len;
+
+		/* A compressed cluster only goes as a whole. */
+		if (cur.e_flags & EZFS_EXT_COMPRESSED) {
+			if (WARN_ON_ONCE(start < from || end > to))
+				return -EIO;
+			if (release)
+				ezfs_release_data_blocks(sb, cur.e_pblk,
+							 ezfs_extent_phys(&cur));
+			inode->i_blocks -= (blkcnt_t) ezfs_extent_phys(&cur) *
+			    EZFS_BLOCK_SECTORS;
+			goto remove;
+		}
+
+		if (start < from && end > to) {
+			/* Keep the head in place, the tail gets a new slot. */
+			tail = cur;
+			tail.e_lblk = to;
+			tail.e_len = end - to;
+			tail.e_pblk += to - start;
+			ret = ezfs_extent_insert(inode, &tail);
+			if (ret)
+				return ret;
+		}
+
+		/* A directory's blocks are metadata. */
+		if (release && S_ISDIR(inode->i_mode))
+			ezfs_free_meta_blocks(sb,
+					      cur.e_pblk + max(start, from) - start,
+					      min(end, to) - max(start, from));
+		else if (release && (cur.e_flags & EZFS_EXT_SHARED))
+			ezfs_ref_put(sb, cur.e_pblk + max(start, from) - start,
+				     min(end, to) - max(start, from),
+				     ezfs_release_data_blocks);
+		else if (release)
+			ezfs_release_data_blocks(sb,
+						 cur.e_pblk + max(start, from) -
+						 start,
+						 min(end, to) - max(start, from));
+		inode->i_blocks -= (blkcnt_t) (min(end, to) -
+					       max(start, from)) *
+		    EZFS_BLOCK_SECTORS;
+
+		if (start < from || end > to) {
+			/* Trim whichever end sticks out of the range. */
+			if (start < from) {
+				cur.e_len = from - start;
+			} else {
+				cur.e_pblk += to - start;
+				cur.e_lblk = to;
+				cur.e_len = end - to;
+			}
+			ret = ezfs_extent_set(inode, i, &cur);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+remove:
+		ret = ezfs_extent_drop(inode, i);
+		if (ret)
+			return ret;
+	}
+
+	/* Release the tail of the extent block chain that is now empty. */
+	keep_blocks = ei->nextents > EZFS_INLINE_EXTENTS ?
+	    DIV_ROUND_UP(ei->nextents - EZFS_INLINE_EXTENTS,
+			 EZFS_EXTENTS_PER_BLOCK) : 0;
+	link = &ei->extent_blk;
+	last_bh = NULL;
+	for (blk = *link; blk; blk = next) {
+		bh = sb_bread(sb, blk);
+		if (!bh) {
+			brelse(last_bh);
+			return -EIO;
+		}
+		eb = (struct ezfs_extent_block *) bh->b_data;
+		next = eb->next;
+		if (keep_blocks) {
+			keep_blocks--;
+			brelse(last_bh);
+			last_bh = bh;
+			link = &eb->next;
+			continue;
+		}
+		*link = 0;
+		if (last_bh)
+			ezfs_journal_dirty(sb, last_bh);
+		bforget(bh);
+		ezfs_free_meta_blocks(sb, blk, 1);
+		inode->i_blocks -= EZFS_BLOCK_SECTORS;
+	}
+	brelse(last_bh);
+
+	return 0;
+}
+
+/* Frees every block mapped at or past logical block @from. */
+static int
+ezfs_truncate_extents(struct inode *inode, sector_t from)
+{
+	return ezfs_remove_extents(inode, from, EZFS_MAX_LBLK, true);
+}
+
+/* Turns [lblk, lblk + len), which lies inside the unwritten extent @ext,
+ * into written blocks. The range is cut out of @ext and mapped again as a
+ * written extent, which merges with a written neighbour in front of it.
+ * Caller holds the inode's map lock.
+ */
+static int
+ezfs_extent_convert(struct inode *inode, const struct ezfs_extent *ext,
+		    sector_t lblk, uint32_t len)
+{
+	uint64_t pblk = ext->e_pblk + lblk - ext->e_lblk;
+	int ret;
+
+	ret = ezfs_remove_extents(inode, lblk, lblk + len, false);
+	if (!ret)
+		ret = ezfs_extent_append(inode, lblk, pblk, len, 0);
+	if (!ret)
+		inode->i_blocks += (blkcnt_t) len * EZFS_BLOCK_SECTORS;
+	return ret;
+}
+
+/* Gives [lblk, lblk + len), which lies inside the shared extent @ext,
+ * blocks of its own before it is written. Blocks that are still shared are
+ * moved to new ones; their contents are not copied, as the caller is about
+ * to write all of them. Blocks whose other owners are gone are only no
+ * longer marked shared. The old blocks are let go of once the new map is
+ * committed. If @reserved, the blocks were reserved by
+ * ezfs_get_block_delay(), and the reservation is used up either way.
+ * Caller holds the inode's map lock.
+ */
+static int
+ezfs_extent_unshare(struct inode *inode, const struct ezfs_extent *ext,
+		    sector_t lblk, uint32_t len, bool reserved)
+{
+	struct super_block *sb = inode->i_sb;
+	uint64_t old = ext->e_pblk + lblk - ext->e_lblk, got;
+	bool shared;
+	long pblk;
+	int ret;
+
+	while (len) {
+		pblk = ezfs_ref_run(sb, old, len, &shared);
+		if (pblk < 0)
+			return pblk;
+		got = pblk;
+		if (shared) {
+			pblk = ezfs_alloc_data_run(sb,
+						   ezfs_extent_goal(inode, lblk),
+						   &got, reserved ? 0 :
+						   EZFS_META_RESERVE, reserved);
+			if (pblk < 0)
+				return pblk;
+		} else {
+			pblk = old;
+		}
+
+		ret = ezfs_remove_extents(inode, lblk, lblk + got, false);
+		if (!ret)
+			ret = ezfs_extent_append(inode, lblk, pblk, got, 0);
+		if (ret) {
+			if (shared && reserved)
+				ezfs_unalloc_reserved(sb, pblk, got);
+			else if (shared)
+				ezfs_free_data_blocks(sb, pblk, got);
+			return ret;
+		}
+		inode->i_blocks += (blkcnt_t) got * EZFS_BLOCK_SECTORS;
+		if (shared)
+			ezfs_ref_put(sb, old, got, ezfs_free_meta_blocks);
+		else if (reserved)
+			ezfs_release_reservation(sb, got);
+
+		lblk += got;
+		old += got;
+		len -= got;
+	}
+	return 0;
+}
+
+/* Whether any block of [pos, pos + len) may be shared. */
+static bool
+ezfs_range_shared(struct inode *inode, loff_t pos, loff_t len)
+{
+	sector_t lblk = pos >> inode->i_blkbits, next;
+	sector_t last = DIV_ROUND_UP(pos + len, EZFS_BLOCK_SIZE);
+	struct ezfs_extent ext;
+	bool shared = false;
+	unsigned int idx;
+
+	mutex_lock(ezfs_map_lock(inode));
+	for (; lblk < last && !shared; lblk = next) {
+		if (ezfs_extent_find(inode, lblk, &ext, &idx, &next))
+			continue;
+		next = ext.e_lblk + ext.e_len;
+		shared = ext.e_flags & EZFS_EXT_SHARED;
+	}
+	mutex_unlock(ezfs_map_lock(inode));
+	return shared;
+}
+
+/* Allocates an unwritten extent for the first hole in [*lblk, to), as long
+ * a run as the free space gives, and moves *lblk past it. *lblk reaches @to
+ * once no hole is left. Blocks that are already mapped are left alone.
+ * Caller holds the inode's map lock.
+ */
+static int
+ezfs_prealloc_extent(struct inode *inode, sector_t *lblk, sector_t to)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_extent ext;
+	unsigned int idx;
+	sector_t hole_end;
+	uint64_t got;
+	long pblk;
+	int ret;
+
+	while (*lblk < to) {
+		if (!ezfs_extent_find(inode, *lblk, &ext, &idx, &hole_end)) {
+			*lblk = ext.e_lblk + ext.e_len;
+			continue;
+		}
+
+		got = min_t(uint64_t, min(hole_end, to) - *lblk,
+			    EZFS_MAX_EXTENT_LEN);
+		pblk = ezfs_alloc_data_run(sb, ezfs_extent_goal(inode, *lblk),
+					   &got, EZFS_META_RESERVE, false);
+		if (pblk < 0)
+			return pblk;
+
+		ret = ezfs_extent_append(inode, *lblk, pblk, got,
+					 EZFS_EXT_UNWRITTEN);
+		if (ret) {
+			ezfs_free_data_blocks(sb, pblk, got);
+			return ret;
+		}
+		inode->i_blocks += got * EZFS_BLOCK_SECTORS;
+		*lblk += got;
+		break;
+	}
+
+	return 0;
+}
+
+/* Unmaps and frees [from, to) from the end backwards, a transaction for
+ * each extent or EZFS_JOURNAL_STEP_BLOCKS blocks of one, so that freeing a
+ * large or fragmented range never overflows the journal. Each step commits
+ * with the inode record. A crash part way leaves the front of the range
+ * mapped. Takes its own handles and the map lock.
+ */
+static int
+ezfs_punch_extents(struct inode *inode, sector_t from, sector_t to)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_handle handle;
+	struct ezfs_extent *last;
+	sector_t start, end;
+	unsigned int pos;
+	int ret, err;
+
+	while (from < to) {
+		ezfs_journal_start(inode->i_sb, &handle);
+		mutex_lock(ezfs_map_lock(inode));
+		start = from;
+		pos = ezfs_extent_bsearch(ei, to - 1);
+		if (pos) {
+			last = &ei->map[ei->order[pos - 1]];
+			end = min_t(sector_t, to, last->e_lblk + last->e_len);
+		} else {
+			last = NULL;
+			end = 0;
+		}
+		if (end > from) {
+			start = max_t(sector_t, from, last->e_lblk);
+			/* A compressed cluster only goes as a whole. */
+			if (end - start > EZFS_JOURNAL_STEP_BLOCKS &&
+			    !(last->e_flags & EZFS_EXT_COMPRESSED))
+				start = end - EZFS_JOURNAL_STEP_BLOCKS;
+		}
+		ret = ezfs_remove_extents(inode, start, to, true);
+		mutex_unlock(ezfs_map_lock(inode));
+		mark_inode_dirty(inode);
+		ezfs_journal_inode(inode);
+		err = ezfs_journal_stop(&handle);
+		if (ret || err)
+			return ret ? ret : err;
+		to = start;
+		cond_resched();
+	}
+	return 0;
+}
+
+int
+release_inode_resources(struct inode *inode)
+{
+	return ezfs_punch_extents(inode, 0, EZFS_MAX_LBLK);
+}
+
+/* Directory blocks are mapped through the directory's extents, like the
+ * blocks of a regular file.
+ */
+static struct buffer_head *
+ezfs_dir_bread(struct inode *dir, sector_t lblk)
+{
+	struct ezfs_extent ext;
+	unsigned int idx;
+	int ret;
+
+	ret = ezfs_extent_lookup(dir, lblk, &ext, &idx);
+	if (ret)
+		return ERR_PTR(ret == -ENOENT ? -EUCLEAN : ret);
+	return read_directory_block(dir->i_sb,
+				    ext.e_pblk + lblk - ext.e_lblk);
+}
+
+/* Grows @dir by one zeroed block. Its logical block number is returned in
+ * *lblk.
+ */
+static struct buffer_head *
+ezfs_dir_append_block(struct inode *dir, sector_t *lblk)
+{
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *bh = NULL;
+	long pblk;
+	int ret;
+
+	*lblk = dir->i_size >> dir->i_blkbits;
+	mutex_lock(ezfs_map_lock(dir));
+	pblk = ezfs_alloc_data_block(sb, ezfs_extent_goal(dir, *lblk),
+				     EZFS_META_RESERVE);
+	if (pblk < 0) {
+		ret = pblk;
+		goto out;
+	}
+	ret = ezfs_extent_append(dir, *lblk, pblk, 1, 0);
+	if (ret) {
+		ezfs_free_data_blocks(sb, pblk, 1);
+		goto out;
+	}
+	dir->i_blocks += EZFS_BLOCK_SECTORS;
+
+	bh = sb_getblk(sb, pblk);
+	if (!bh) {
+		ezfs_truncate_extents(dir, *lblk);
+		ret = -EIO;
+		goto out;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, EZFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ezfs_journal_dirty(sb, bh);
+	i_size_write(dir, dir->i_size + EZFS_BLOCK_SIZE);
+out:
+	mutex_unlock(ezfs_map_lock(dir));
+	mark_inode_dirty(dir);
+	return ret ? ERR_PTR(ret) : bh;
+}
+
+static inline bool
+ezfs_dx_is_node(struct buffer_head *bh)
+{
+	return ((struct ezfs_dx_node *) bh->b_data)->marker == EZFS_DX_NODE;
+}
+
+static uint32_t
+ezfs_dx_hash(const char *name, unsigned int len)
+{
+	return jhash(name, len, EZFS_DX_HASH_SEED);
+}
+
+static uint32_t
+ezfs_dx_entry_hash(const struct ezfs_dir_entry *de)
+{
+	return ezfs_dx_hash(de->filename,
+			    strnlen(de->filename, EZFS_FILENAME_BUF_SIZE));
+}
+
+static bool
+ezfs_name_match(const struct ezfs_dir_entry *de, const struct qstr *name)
+{
+	return de->active == 1 && name->len <= EZFS_MAX_FILENAME_LENGTH &&
+	    strncmp(de->filename, name->name, name->len) == 0 &&
+	    de->filename[name->len] == '\0';
+}
+
+/* One index node on the way from the root down to a leaf. */
+struct ezfs_dx_frame {
+	struct buffer_head *bh;
+	struct ezfs_dx_node *node;
+	unsigned int at; /* the entry that was followed */
+};
+
+static void
+ezfs_dx_release(struct ezfs_dx_frame *frames, unsigned int nframes)
+{
+	while (nframes--)
+		brelse(frames[nframes].bh);
+}
+
+/* The last entry of @node whose hash is not above @hash. entries[0] covers
+ * everything below entries[1], whatever its own hash.
+ */
+static unsigned int
+ezfs_dx_search(const struct ezfs_dx_node *node, uint32_t hash)
+{
+	unsigned int lo = 1, hi = node->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (node->entries[mid].hash <= hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/* Walks the index from @root_bh down to the leaf that covers @hash and
+ * returns the leaf's logical block. The index nodes on the way, root first,
+ * are left in @frames for the caller to release; @root_bh is handed over to
+ * them even on failure.
+ */
+static long
+ezfs_dx_probe(struct inode *dir, struct buffer_head *root_bh, uint32_t hash,
+	      struct ezfs_dx_frame *frames, unsigned int *nframes)
+{
+	struct buffer_head *bh = root_bh;
+	struct ezfs_dx_node *node;
+	unsigned int levels = 0, i;
+	long ret;
+
+	*nframes = 0;
+	for (i = 0;; i++) {
+		node = (struct ezfs_dx_node *) bh->b_data;
+		if (i == 0)
+			levels = node->levels;
+		if (node->marker != EZFS_DX_NODE || !node->count ||
+		    node->count > EZFS_DX_ENTRIES ||
+		    levels > EZFS_DX_MAX_LEVELS) {
+			pr_err("EZFS: corrupt index in directory %lu\n",
+			       dir->i_ino);
+			brelse(bh);
+			ret = -EUCLEAN;
+			goto fail;
+		}
+		frames[i].bh = bh;
+		frames[i].node = node;
+		frames[i].at = ezfs_dx_search(node, hash);
+		*nframes = i + 1;
+		if (i == levels)
+			return node->entries[frames[i].at].lblk;
+
+		bh = ezfs_dir_bread(dir, node->entries[frames[i].at].lblk);
+		if (IS_ERR(bh)) {
+			ret = PTR_ERR(bh);
+			goto fail;
+		}
+	}
+
+fail:
+	ezfs_dx_release(frames, *nframes);
+	*nframes = 0;
+	return ret;
+}
+
+/* Looks up @name in @dir. If it is there, the block holding its entry is
+ * returned and *res points at the entry; otherwise NULL is returned.
+ */
+static struct buffer_head *
+ezfs_find_entry(struct inode *dir, const struct qstr *name,
+		struct ezfs_dir_entry **res)
+{
+	struct ezfs_dx_frame frames[EZFS_DX_MAX_LEVELS + 1];
+	struct ezfs_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned int nframes, i;
+	long lblk;
+
+	bh = ezfs_dir_bread(dir, 0);
+	if (IS_ERR(bh) || !ezfs_dx_is_node(bh))
+		goto scan;
+
+	lblk = ezfs_dx_probe(dir, bh, ezfs_dx_hash(name->name, name->len),
+			     frames, &nframes);
+	if (lblk < 0)
+		return ERR_PTR(lblk);
+	ezfs_dx_release(frames, nframes);
+	bh = ezfs_dir_bread(dir, lblk);
+
+scan:
+	if (IS_ERR(bh))
+		return bh;
+	de = (struct ezfs_dir_entry *) bh->b_data;
+	for (i = 0; i < EZFS_MAX_CHILDREN; i++, de++) {
+		if (ezfs_name_match(de, name)) {
+			*res = de;
+			return bh;
+		}
+	}
+	brelse(bh);
+	return NULL;
+}
+
+/* Puts @name into a free slot of the leaf @bh, or fails with -ENOSPC. */
+static int
+ezfs_leaf_add(struct inode *dir, struct buffer_head *bh,
+	      const struct qstr *name, uint64_t ino)
+{
+	struct ezfs_dir_entry *de = (struct ezfs_dir_entry *) bh->b_data;
+	unsigned int i;
+
+	for (i = 0; i < EZFS_MAX_CHILDREN; i++, de++) {
+		if (de->active)
+			continue;
+		memset(de, 0, sizeof(*de));
+		memcpy(de->filename, name->name, name->len);
+		de->active = 1;
+		de->inode_no = ino;
+		ezfs_journal_dirty(dir->i_sb, bh);
+		return 0;
+	}
+	return -ENOSPC;
+}
+
+static int
+ezfs_cmp_hash(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Moves the entries of the full leaf @bh with the upper half of the hashes
+ * to the empty leaf @new_bh. Returns the lowest hash that moved, which is
+ * where the new leaf starts in the index.
+ */
+static long
+ezfs_dx_split_leaf(struct inode *dir, struct buffer_head *bh,
+		   struct buffer_head *new_bh)
+{
+	struct ezfs_dir_entry *de = (struct ezfs_dir_entry *) bh->b_data;
+	struct ezfs_dir_entry *to = (struct ezfs_dir_entry *) new_bh->b_data;
+	uint32_t hashes[EZFS_MAX_CHILDREN], sorted[EZFS_MAX_CHILDREN], split;
+	unsigned int i;
+
+	for (i = 0; i < EZFS_MAX_CHILDREN; i++)
+		sorted[i] = hashes[i] = ezfs_dx_entry_hash(&de[i]);
+	sort(sorted, EZFS_MAX_CHILDREN, sizeof(sorted[0]), ezfs_cmp_hash,
+	     NULL);
+
+	/* Split at the median, but never so that nothing stays behind. */
+	for (i = EZFS_MAX_CHILDREN / 2; i < EZFS_MAX_CHILDREN; i++) {
+		if (sorted[i] != sorted[0])
+			break;
+	}
+	if (i == EZFS_MAX_CHILDREN)
+		return -ENOSPC;
+	split = sorted[i];
+
+	for (i = 0; i < EZFS_MAX_CHILDREN; i++) {
+		if (hashes[i] < split)
+			continue;
+		*to++ = de[i];
+		memset(&de[i], 0, sizeof(de[i]));
+	}
+	ezfs_journal_dirty(dir->i_sb, bh);
+	ezfs_journal_dirty(dir->i_sb, new_bh);
+	return split;
+}
+
+/* Adds an entry for @lblk, whose lowest hash is @hash, right after the one
+ * @frame followed. The node must have room for it.
+ */
+static void
+ezfs_dx_insert(struct inode *dir, struct ezfs_dx_frame *frame, uint32_t hash,
+	       uint32_t lblk)
+{
+	struct ezfs_dx_node *node = frame->node;
+	unsigned int at = frame->at + 1;
+
+	memmove(&node->entries[at + 1], &node->entries[at],
+		(node->count - at) * sizeof(node->entries[0]));
+	node->entries[at].hash = hash;
+	node->entries[at].lblk = lblk;
+	node->count++;
+	ezfs_journal_dirty(dir->i_sb, frame->bh);
+}
+
+/* Makes room for one more entry in the index node right above the leaf
+ * @frames leads to. A full root grows a level; a full node below the root is
+ * split in two. @frames is updated to follow the same leaf.
+ */
+static int
+ezfs_dx_make_room(struct inode *dir, struct ezfs_dx_frame *frames,
+		  unsigned int *nframes)
+{
+	struct ezfs_dx_frame *root = &frames[0], *parent;
+	struct ezfs_dx_node *node;
+	struct buffer_head *bh;
+	unsigned int half;
+	sector_t lblk;
+
+	parent = &frames[*nframes - 1];
+	if (parent->node->count < EZFS_DX_ENTRIES)
+		return 0;
+
+	if (parent == root) {
+		/* Push all of the root's entries down into a new node. */
+		if (root->node->levels >= EZFS_DX_MAX_LEVELS)
+			return -ENOSPC;
+		bh = ezfs_dir_append_block(dir, &lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		node = (struct ezfs_dx_node *) bh->b_data;
+		memcpy(node, root->node, EZFS_BLOCK_SIZE);
+		node->levels = 0;
+		ezfs_journal_dirty(dir->i_sb, bh);
+
+		root->node->levels++;
+		root->node->count = 1;
+		root->node->entries[0].hash = 0;
+		root->node->entries[0].lblk = lblk;
+		ezfs_journal_dirty(dir->i_sb, root->bh);
+
+		parent = &frames[1];
+		parent->bh = bh;
+		parent->node = node;
+		parent->at = root->at;
+		root->at = 0;
+		*nframes = 2;
+	}
+
+	/* Move the upper half of the node into a new sibling. */
+	if (root->node->count >= EZFS_DX_ENTRIES)
+		return -ENOSPC;
+	bh = ezfs_dir_append_block(dir, &lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	node = (struct ezfs_dx_node *) bh->b_data;
+	half = parent->node->count / 2;
+	node->marker = EZFS_DX_NODE;
+	node->count = parent->node->count - half;
+	memcpy(node->entries, &parent->node->entries[half],
+	       node->count * sizeof(node->entries[0]));
+	parent->node->count = half;
+	ezfs_journal_dirty(dir->i_sb, parent->bh);
+	ezfs_journal_dirty(dir->i_sb, bh);
+	ezfs_dx_insert(dir, root, node->entries[0].hash, lblk);
+
+	if (parent->at >= half) {
+		brelse(parent->bh);
+		parent->bh = bh;
+		parent->node = node;
+		parent->at -= half;
+	} else {
+		brelse(bh);
+	}
+	return 0;
+}
+
+/* Turns the full single-block directory @dir into an indexed one. Its
+ * entries are split across two new leaves and block 0, @root_bh, becomes
+ * the root of the index.
+ */
+static int
+ezfs_dx_make_indexed(struct inode *dir, struct buffer_head *root_bh)
+{
+	struct buffer_head *lo_bh, *hi_bh = NULL;
+	struct ezfs_dx_node *root;
+	sector_t lo, hi;
+	long split;
+
+	lo_bh = ezfs_dir_append_block(dir, &lo);
+	if (IS_ERR(lo_bh))
+		return PTR_ERR(lo_bh);
+	hi_bh = ezfs_dir_append_block(dir, &hi);
+	if (IS_ERR(hi_bh)) {
+		split = PTR_ERR(hi_bh);
+		hi_bh = NULL;
+		goto undo;
+	}
+
+	memcpy(lo_bh->b_data, root_bh->b_data, EZFS_BLOCK_SIZE);
+	split = ezfs_dx_split_leaf(dir, lo_bh, hi_bh);
+	if (split < 0)
+		goto undo;
+
+	root = (struct ezfs_dx_node *) root_bh->b_data;
+	memset(root, 0, EZFS_BLOCK_SIZE);
+	root->marker = EZFS_DX_NODE;
+	root->count = 2;
+	root->entries[0].lblk = lo;
+	root->entries[1].hash = split;
+	root->entries[1].lblk = hi;
+	ezfs_journal_dirty(dir->i_sb, root_bh);
+	brelse(lo_bh);
+	brelse(hi_bh);
+	return 0;
+
+undo:
+	/* Drop the new blocks again, so the directory stays linear. */
+	bforget(lo_bh);
+	if (hi_bh)
+		bforget(hi_bh);
+	mutex_lock(ezfs_map_lock(dir));
+	ezfs_truncate_extents(dir, lo);
+	mutex_unlock(ezfs_map_lock(dir));
+	i_size_write(dir, EZFS_BLOCK_SIZE);
+	mark_inode_dirty(dir);
+	return split;
+}
+
+/* Adds an entry mapping @name to inode @ino to @dir. The caller has checked
+ * that @name is not there yet.
+ */
+static int
+ezfs_add_entry(struct inode *dir, const struct qstr *name, uint64_t ino)
+{
+	struct ezfs_dx_frame frames[EZFS_DX_MAX_LEVELS + 1];
+	uint32_t hash = ezfs_dx_hash(name->name, name->len);
+	struct buffer_head *root_bh, *bh, *new_bh;
+	unsigned int nframes;
+	sector_t new_lblk;
+	long lblk, split;
+	int ret;
+
+	root_bh = ezfs_dir_bread(dir, 0);
+	if (IS_ERR(root_bh))
+		return PTR_ERR(root_bh);
+
+	if (!ezfs_dx_is_node(root_bh)) {
+		ret = ezfs_leaf_add(dir, root_bh, name, ino);
+		if (ret != -ENOSPC) {
+			brelse(root_bh);
+			return ret;
+		}
+		ret = ezfs_dx_make_indexed(dir, root_bh);
+		if (ret) {
+			brelse(root_bh);
+			return ret;
+		}
+	}
+
+	lblk = ezfs_dx_probe(dir, root_bh, hash, frames, &nframes);
+	if (lblk < 0)
+		return lblk;
+	bh = ezfs_dir_bread(dir, lblk);
+	if (IS_ERR(bh)) {
+		ezfs_dx_release(frames, nframes);
+		return PTR_ERR(bh);
+	}
+
+	ret = ezfs_leaf_add(dir, bh, name, ino);
+	if (ret != -ENOSPC)
+		goto out;
+
+	/* The leaf is full: split it and index the new half. */
+	ret = ezfs_dx_make_room(dir, frames, &nframes);
+	if (ret)
+		goto out;
+	new_bh = ezfs_dir_append_block(dir, &new_lblk);
+	if (IS_ERR(new_bh)) {
+		ret = PTR_ERR(new_bh);
+		goto out;
+	}
+	split = ezfs_dx_split_leaf(dir, bh, new_bh);
+	if (split < 0) {
+		/* The empty block stays behind as an unindexed leaf. */
+		ret = split;
+	} else {
+		ezfs_dx_insert(dir, &frames[nframes - 1], split, new_lblk);
+		ret = ezfs_leaf_add(dir, hash < split ? bh : new_bh, name,
+				    ino);
+	}
+	brelse(new_bh);
+
+out:
+	brelse(bh);
+	ezfs_dx_release(frames, nframes);
+	return ret;
+}
+
+/* Clears the entry for @name in @dir. */
+static int
+ezfs_delete_entry(struct inode *dir, const struct qstr *name)
+{
+	struct ezfs_dir_entry *de;
+	struct buffer_head *bh;
+
+	bh = ezfs_find_entry(dir, name, &de);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	if (!bh)
+		return -ENOENT;
+
+	memset(de, 0, sizeof(*de));
+	ezfs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+	return 0;
+}
+
+/* Returns 1 if no leaf of @dir holds an active entry, 0 if one does. */
+static int
+ezfs_dir_empty(struct inode *dir)
+{
+	sector_t lblk, nblocks = dir->i_size >> dir->i_blkbits;
+	struct ezfs_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned int i;
+
+	for (lblk = 0; lblk < nblocks; lblk++) {
+		bh = ezfs_dir_bread(dir, lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		/* Index nodes hold hashes where entries would be. */
+		if (ezfs_dx_is_node(bh)) {
+			brelse(bh);
+			continue;
+		}
+		de = (struct ezfs_dir_entry *) bh->b_data;
+		for (i = 0; i < EZFS_MAX_CHILDREN; i++) {
+			if (de[i].active == 1)
+				break;
+		}
+		brelse(bh);
+		if (i < EZFS_MAX_CHILDREN)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Name cache: a hash table per directory that remembers what lookups found,
+ * including names that are not there (ino 0), so that repeated lookups do
+ * not go through the directory blocks again. create and unlink keep it up
+ * to date. The tables hang off the directory's ezfs_inode_info, and all
+ * entries sit on one LRU that the shrinker trims.
+ */
+static struct ezfs_dir_cache *
+ezfs_get_dir_cache(struct inode *dir, bool create)
+{
+	struct ezfs_inode_info *ei = EZFS_I(dir);
+	struct ezfs_dir_cache *cache, *old;
+
+	cache = READ_ONCE(ei->dir_cache);
+	if (cache || !create)
+		return cache;
+
+	cache = kzalloc(sizeof(*cache), GFP_NOFS);
+	if (!cache)
+		return NULL;
+	hash_init(cache->names);
+	old = cmpxchg(&ei->dir_cache, NULL, cache);
+	if (old) {
+		kfree(cache);
+		return old;
+	}
+	return cache;
+}
+
+static struct ezfs_name_entry *
+ezfs_name_cache_find(struct ezfs_dir_cache *cache, const struct qstr *name,
+		     uint32_t hash)
+{
+	struct ezfs_name_entry *ne;
+
+	hash_for_each_possible(cache->names, ne, node, hash) {
+		if (ne->hash == hash && ne->len == name->len &&
+		    !memcmp(ne->name, name->name, name->len))
+			return ne;
+	}
+	return NULL;
+}
+
+static void
+ezfs_name_cache_free(struct ezfs_sb_info *sbi,
+		     struct ezfs_name_entry *ne)
+{
+	hash_del(&ne->node);
+	list_del(&ne->lru);
+	sbi->nr_names--;
+	kfree(ne);
+}
+
+/* Returns 0 and the cached inode number of @name in *ino (0 if the name is
+ * known not to exist), or -ENOENT if @name is not cached.
+ */
+static int
+ezfs_name_cache_lookup(struct inode *dir, const struct qstr *name,
+		       uint64_t *ino)
+{
+	struct ezfs_sb_info *sbi = dir->i_sb->s_fs_info;
+	struct ezfs_dir_cache *cache = ezfs_get_dir_cache(dir, false);
+	struct ezfs_name_entry *ne;
+	int ret = -ENOENT;
+
+	if (!cache)
+		return ret;
+
+	spin_lock(&sbi->name_lock);
+	ne = ezfs_name_cache_find(cache, name,
+				  ezfs_dx_hash(name->name, name->len));
+	if (ne) {
+		*ino = ne->ino;
+		list_move(&ne->lru, &sbi->name_lru);
+		ret = 0;
+	}
+	spin_unlock(&sbi->name_lock);
+	return ret;
+}
+
+/* Records that @name in @dir maps to @ino, or does not exist if @ino is 0.
+ * The cache is only a hint, so running out of memory is not an error.
+ */
+static void
+ezfs_name_cache_set(struct inode *dir, const struct qstr *name, uint64_t ino)
+{
+	struct ezfs_sb_info *sbi = dir->i_sb->s_fs_info;
+	struct ezfs_dir_cache *cache = ezfs_get_dir_cache(dir, true);
+	uint32_t hash = ezfs_dx_hash(name->name, name->len);
+	struct ezfs_name_entry *ne, *new;
+
+	if (!cache)
+		return;
+
+	new = kmalloc(struct_size(new, name, name->len), GFP_NOFS);
+	spin_lock(&sbi->name_lock);
+	ne = ezfs_name_cache_find(cache, name, hash);
+	if (ne) {
+		ne->ino = ino;
+		list_move(&ne->lru, &sbi->name_lru);
+	} else if (new) {
+		new->ino = ino;
+		new->hash = hash;
+		new->len = name->len;
+		memcpy(new->name, name->name, name->len);
+		hash_add(cache->names, &new->node, hash);
+		list_add(&new->lru, &sbi->name_lru);
+		sbi->nr_names++;
+		new = NULL;
+	}
+	spin_unlock(&sbi->name_lock);
+	kfree(new);
+}
+
+/* Forgets everything cached for @dir, which is being evicted. */
+static void
+ezfs_name_cache_drop_dir(struct inode *dir)
+{
+	struct ezfs_sb_info *sbi = dir->i_sb->s_fs_info;
+	struct ezfs_dir_cache *cache;
+	struct ezfs_name_entry *ne;
+	struct hlist_node *tmp;
+	int bkt;
+
+	cache = xchg(&EZFS_I(dir)->dir_cache, NULL);
+	if (!cache)
+		return;
+
+	spin_lock(&sbi->name_lock);
+	hash_for_each_safe(cache->names, bkt, tmp, ne, node)
+		ezfs_name_cache_free(sbi, ne);
+	spin_unlock(&sbi->name_lock);
+	kfree(cache);
+}
+
+static unsigned long
+ezfs_name_cache_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct ezfs_sb_info *sbi =
+	    container_of(shrink, struct ezfs_sb_info, name_shrinker);
+
+	return READ_ONCE(sbi->nr_names);
+}
+
+/* Frees the least recently used entries. The per-directory tables stay
+ * around, empty, until their directory is evicted.
+ */
+static unsigned long
+ezfs_name_cache_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct ezfs_sb_info *sbi =
+	    container_of(shrink, struct ezfs_sb_info, name_shrinker);
+	unsigned long freed = 0;
+
+	spin_lock(&sbi->name_lock);
+	while (freed < sc->nr_to_scan && !list_empty(&sbi->name_lru)) {
+		ezfs_name_cache_free(sbi,
+				     list_last_entry(&sbi->name_lru,
+						     struct ezfs_name_entry,
+						     lru));
+		freed++;
+	}
+	spin_unlock(&sbi->name_lock);
+	return freed;
+}
+
+void
+ezfs_evict_inode(struct inode *inode)
+{
+	struct ezfs_handle handle;
+
+	/* This waits for writeback and drops delayed buffers, so no write
+	 * of ours is in flight to the blocks freed below.
+	 */
+	truncate_inode_pages_final(&inode->i_data);
+	flush_work(&EZFS_I(inode)->io_work);
+	ezfs_release_clusters(inode, 0);
+
+	/* The inode number can be handed out again only once its blocks
+	 * are gone. Should that fail, both stay in use.
+	 */
+	if (!inode->i_nlink && !release_inode_resources(inode)) {
+		ezfs_journal_start(inode->i_sb, &handle);
+		if (S_ISDIR(inode->i_mode))
+			ezfs_group_count_dir(inode, -1);
+		ezfs_free_ino(inode->i_sb, inode->i_ino);
+		ezfs_journal_stop(&handle);
+	}
+
+	if (S_ISDIR(inode->i_mode))
+		ezfs_name_cache_drop_dir(inode);
+	clear_inode(inode);
+}
+
+static struct kmem_cache *ezfs_inode_cachep;
+
+struct inode *
+ezfs_alloc_inode(struct super_block *sb)
+{
+	struct ezfs_inode_info *ei;
+
+	ei = kmem_cache_alloc(ezfs_inode_cachep, GFP_KERNEL);
+	if (!ei)
+		return NULL;
+	ei->nextents = 0;
+	ei->map_cap = EZFS_INLINE_EXTENTS;
+	ei->map = ei->inline_map;
+	ei->order = ei->inline_order;
+	ei->extent_blk = 0;
+	ei->group = 0;
+	ei->next_lblk = 0;
+	ei->next_pblk = 0;
+	ei->dir_cache = NULL;
+	ei->sync_seq = 0;
+	ei->datasync_seq = 0;
+	ei->state = 0;
+	return &ei->vfs_inode;
+}
+
+void
+ezfs_free_inode(struct inode *inode)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+
+	if (ei->map != ei->inline_map) {
+		kfree(ei->map);
+		kfree(ei->order);
+	}
+	kmem_cache_free(ezfs_inode_cachep, ei);
+}
+
+static void
+ezfs_inode_init_once(void *obj)
+{
+	struct ezfs_inode_info *ei = obj;
+
+	mutex_init(&ei->map_lock);
+	spin_lock_init(&ei->io_lock);
+	ei->io_done = NULL;
+	xa_init(&ei->cluster_resv);
+	INIT_WORK(&ei->io_work, ezfs_end_io_work);
+	inode_init_once(&ei->vfs_inode);
+}
+
+/* Reads the inode table block that holds inode @ino. *raw is set to the
+ * inode's slot in it.
+ */
+static struct buffer_head *
+ezfs_inode_bread(struct super_block *sb, unsigned long ino,
+		 struct ezfs_inode **raw)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	unsigned long idx = ino - EZFS_ROOT_INODE_NUMBER;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, sbi->inode_table_start + idx / EZFS_INODES_PER_BLOCK);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	*raw = (struct ezfs_inode *) bh->b_data + idx % EZFS_INODES_PER_BLOCK;
+	return bh;
+}
+
+static struct inode *
+ezfs_iget(struct super_block *sb, unsigned long inode_number)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	struct ezfs_inode *raw;
+	struct buffer_head *bh;
+	struct inode *vfs_inode;
+	int ret;
+
+	if (inode_number < EZFS_ROOT_INODE_NUMBER ||
+	    inode_number - EZFS_ROOT_INODE_NUMBER >= sbi->nr_inodes) {
+		pr_err("EZFS: bad inode number %lu\n", inode_number);
+		return ERR_PTR(-EUCLEAN);
+	}
+
+	vfs_inode = iget_locked(sb, inode_number);
+	if (!vfs_inode)
+		return ERR_PTR(-ENOMEM);
+
+	if (vfs_inode->i_state & I_NEW) {
+		bh = ezfs_inode_bread(sb, inode_number, &raw);
+		if (IS_ERR(bh)) {
+			iget_failed(vfs_inode);
+			return ERR_CAST(bh);
+		}
+		if ((raw->flags & EZFS_INODE_INLINE_DATA) &&
+		    (!S_ISREG(raw->mode) || raw->nextents ||
+		     raw->file_size > EZFS_INLINE_DATA_SIZE))
+			ret = -EUCLEAN;
+		else
+			ret = ezfs_load_extent_map(vfs_inode, raw);
+		if (ret) {
+			pr_err("EZFS: cannot read the data map of inode %lu: %d\n",
+			       inode_number, ret);
+			brelse(bh);
+			iget_failed(vfs_inode);
+			return ERR_PTR(ret);
+		}
+
+		EZFS_I(vfs_inode)->group = raw->group;
+		if (raw->flags & EZFS_INODE_INLINE_DATA)
+			set_bit(EZFS_STATE_INLINE_DATA,
+				&EZFS_I(vfs_inode)->state);
+		if (raw->flags & EZFS_INODE_COMPRESS)
+			set_bit(EZFS_STATE_COMPRESS, &EZFS_I(vfs_inode)->state);
+		vfs_inode->i_mode = raw->mode;
+		vfs_inode->i_op = &ezfs_inode_ops;
+		vfs_inode->i_sb = sb;
+		vfs_inode->i_fop =
+			(vfs_inode->i_mode & S_IFDIR) ? &ezfs_dir_ops : &ezfs_file_ops;
+		vfs_inode->i_mapping->a_ops = &ezfs_aops;
+		vfs_inode->i_size = raw->file_size;
+		vfs_inode->i_blocks = raw->nblocks * EZFS_BLOCK_SECTORS;
+		set_nlink(vfs_inode, raw->nlink);
+		vfs_inode->i_atime = ezfs_decode_time(&raw->i_atime);
+		vfs_inode->i_mtime = ezfs_decode_time(&raw->i_mtime);
+		vfs_inode->i_ctime = ezfs_decode_time(&raw->i_ctime);
+		i_uid_write(vfs_inode, raw->uid);
+		i_gid_write(vfs_inode, raw->gid);
+		brelse(bh);
+		unlock_new_inode(vfs_inode);
+	}
+
+	return vfs_inode;
+}
+
+/* Copies logical block @lblk of @inode from disk block @src to disk block
+ * @dest. The data is read through the file's page cache: the block device
+ * cache may still hold what @src contained back when it was metadata. The
+ * copy is only dirtied; the caller writes it out.
+ */
+static int
+ezfs_move_block(struct inode *inode, sector_t lblk, uint64_t src,
+		uint64_t dest)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *dest_bh;
+	struct page *src_page;
+	void *src_data;
+
+	src_page = read_mapping_page(inode->i_mapping, lblk, NULL);
+	if (IS_ERR(src_page))
+		return PTR_ERR(src_page);
+
+	dest_bh = sb_getblk(sb, dest);
+	if (!dest_bh) {
+		put_page(src_page);
+		return -EIO;
+	}
+
+	lock_buffer(dest_bh);
+	src_data = kmap_atomic(src_page);
+	memcpy(dest_bh->b_data, src_data, dest_bh->b_size);
+	kunmap_atomic(src_data);
+	put_page(src_page);
+	set_buffer_uptodate(dest_bh);
+	unlock_buffer(dest_bh);
+
+	mark_buffer_dirty(dest_bh);
+	brelse(dest_bh);
+
+	pr_debug("EZFS: Moved block from %llu to %llu\n", src, dest);
+
+	return 0;
+}
+
+static int
+ezfs_extent_cmp(const void *a, const void *b)
+{
+	const struct ezfs_extent *x = a, *y = b;
+
+	return x->e_lblk < y->e_lblk ? -1 : x->e_lblk > y->e_lblk;
+}
+
+/* Moves the @nr logically adjacent written extents in @exts, @total blocks
+ * in all, into one run of disk blocks and maps it with a single extent.
+ * The data reaches its new home before the map changes, and the old blocks
+ * are freed as metadata, so that they are not reused before the new map is
+ * committed. Extents that are already physically contiguous are only
+ * merged. Returns the number of blocks copied. Caller holds the inode lock.
+ */
+static int
+ezfs_defrag_run(struct inode *inode, const struct ezfs_extent *exts,
+		unsigned int nr, uint32_t total)
+{
+	struct super_block *sb = inode->i_sb;
+	struct address_space *bdev_mapping = sb->s_bdev->bd_inode->i_mapping;
+	sector_t lblk = exts[0].e_lblk, off = 0;
+	struct ezfs_extent cur;
+	struct ezfs_handle handle;
+	uint64_t got = total;
+	bool contiguous = true;
+	unsigned int i, idx;
+	uint32_t b;
+	long dest;
+	int ret, err;
+
+	for (i = 1; i < nr; i++) {
+		if (exts[i].e_pblk != exts[i - 1].e_pblk + exts[i - 1].e_len)
+			contiguous = false;
+	}
+
+	if (contiguous) {
+		dest = exts[0].e_pblk;
+	} else {
+		/* Cached pages may carry buffers mapped to the old blocks. */
+		ret = invalidate_inode_pages2_range(inode->i_mapping, lblk,
+						    lblk + total - 1);
+		if (ret)
+			return ret;
+
+		dest = ezfs_alloc_data_run(sb, ezfs_group_goal(inode), &got,
+					   EZFS_META_RESERVE, false);
+		if (dest < 0)
+			return dest;
+		if (got < total) {
+			/* A shorter run would not be any better. */
+			ezfs_free_data_blocks(sb, dest, got);
+			return -ENOSPC;
+		}
+
+		for (i = 0; i < nr; i++) {
+			for (b = 0; b < exts[i].e_len; b++, off++) {
+				ret = ezfs_move_block(inode, lblk + off,
+						      exts[i].e_pblk + b,
+						      dest + off);
+				if (ret)
+					goto out_free;
+			}
+		}
+		ret = filemap_write_and_wait_range(bdev_mapping,
+						   (loff_t) dest * EZFS_BLOCK_SIZE,
+						   (loff_t) (dest + total) *
+						   EZFS_BLOCK_SIZE - 1);
+		if (ret)
+			goto out_free;
+	}
+
+	ezfs_journal_start(sb, &handle);
+	mutex_lock(ezfs_map_lock(inode));
+
+	/* Give up if the map changed under us, e.g. through a shared
+	 * mapping that became writable after we looked.
+	 */
+	ret = 0;
+	for (i = 0; i < nr && !ret; i++) {
+		if (ezfs_extent_lookup(inode, exts[i].e_lblk, &cur, &idx) ||
+		    memcmp(&cur, &exts[i], sizeof(cur)))
+			ret = -EAGAIN;
+	}
+	if (!ret && mapping_writably_mapped(inode->i_mapping))
+		ret = -EAGAIN;
+	if (ret) {
+		mutex_unlock(ezfs_map_lock(inode));
+		ezfs_journal_stop(&handle);
+		goto out_free;
+	}
+
+	/* Whole extents go, so nothing is split and nothing is allocated.
+	 * The first one then grows over the rest.
+	 */
+	ret = ezfs_remove_extents(inode, exts[1].e_lblk, lblk + total, false);
+	if (!ret)
+		ret = ezfs_extent_lookup(inode, lblk, &cur, &idx);
+	if (!ret) {
+		cur.e_pblk = dest;
+		cur.e_len = total;
+		ret = ezfs_extent_set(inode, idx, &cur);
+		inode->i_blocks += (blkcnt_t) (total - exts[0].e_len) *
+		    EZFS_BLOCK_SECTORS;
+	}
+	mutex_unlock(ezfs_map_lock(inode));
+
+	if (!ret && !contiguous) {
+		for (i = 0; i < nr; i++)
+			ezfs_free_meta_blocks(sb, exts[i].e_pblk,
+					      exts[i].e_len);
+	}
+	ezfs_journal_inode(inode);
+	err = ezfs_journal_stop(&handle);
+	if (ret || err)
+		return ret ? ret : err;
+	return contiguous ? 0 : total;
+
+out_free:
+	if (!contiguous)
+		ezfs_free_data_blocks(sb, dest, total);
+	return ret;
+}
+
+/* Rewrites the fragmented parts of @inode that lie inside logical blocks
+ * [first, last) as contiguous runs, and adds what was done to @stats.
+ * Caller holds the inode lock.
+ */
+static int
+ezfs_defrag_inode(struct inode *inode, sector_t first, sector_t last,
+		  struct ezfs_defrag_stats *stats)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_extent *exts;
+	unsigned int i, j, n, done = 0;
+	uint32_t total;
+	int ret;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	stats->files_scanned++;
+	/* Compressed clusters move whenever they are written anyway. */
+	if (ezfs_has_inline_data(inode) || ezfs_compressed(inode))
+		return 0;
+	/* Stores through a shared mapping would race with the copy. */
+	if (mapping_writably_mapped(inode->i_mapping))
+		return 0;
+
+	inode_dio_wait(inode);
+	/* Delayed blocks get their place on disk first. */
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		return ret;
+
+	mutex_lock(ezfs_map_lock(inode));
+	exts = kmalloc_array(max(ei->nextents, 1U), sizeof(*exts), GFP_NOFS);
+	if (!exts) {
+		mutex_unlock(ezfs_map_lock(inode));
+		return -ENOMEM;
+	}
+	n = 0;
+	for (i = 0; i < ei->nextents; i++) {
+		if (ei->map[i].e_flags || ei->map[i].e_lblk < first ||
+		    ei->map[i].e_lblk + ei->map[i].e_len > last)
+			continue;
+		exts[n++] = ei->map[i];
+	}
+	mutex_unlock(ezfs_map_lock(inode));
+	sort(exts, n, sizeof(exts[0]), ezfs_extent_cmp, NULL);
+
+	for (i = 0; i < n; i = j) {
+		total = exts[i].e_len;
+		for (j = i + 1; j < n; j++) {
+			if (exts[j].e_lblk != exts[j - 1].e_lblk +
+			    exts[j - 1].e_len ||
+			    total + exts[j].e_len > EZFS_MAX_EXTENT_LEN ||
+			    j - i == EZFS_DEFRAG_RUN_EXTENTS)
+				break;
+			total += exts[j].e_len;
+		}
+		if (j - i < 2)
+			continue;
+
+		ret = ezfs_defrag_run(inode, &exts[i], j - i, total);
+		if (ret == -ENOSPC || ret == -EAGAIN || ret == -EBUSY) {
+			stats->runs_skipped++;
+			ret = 0;
+			continue;
+		}
+		if (ret < 0)
+			break;
+		stats->extents_merged += j - i - 1;
+		stats->blocks_moved += ret;
+		ret = 0;
+		done++;
+
+		/* Leave the disk to others for a moment. */
+		if (msleep_interruptible(EZFS_DEFRAG_PAUSE_MS)) {
+			ret = -EINTR;
+			break;
+		}
+	}
+	kfree(exts);
+
+	if (done)
+		stats->files_defragged++;
+	return ret;
+}
+
+static void
+ezfs_defrag_account(struct ezfs_sb_info *sbi,
+		    const struct ezfs_defrag_stats *stats)
+{
+	spin_lock(&sbi->defrag_lock);
+	sbi->defrag_stats.files_scanned += stats->files_scanned;
+	sbi->defrag_stats.files_defragged += stats->files_defragged;
+	sbi->defrag_stats.extents_merged += stats->extents_merged;
+	sbi->defrag_stats.blocks_moved += stats->blocks_moved;
+	sbi->defrag_stats.runs_skipped += stats->runs_skipped;
+	spin_unlock(&sbi->defrag_lock);
+}
+
+/* Looks at the next @budget inode numbers. Only inodes that are in the
+ * inode cache are touched: one that is not may be half created, and a
+ * cold file is not worth the I/O. Busy files are skipped.
+ */
+static void
+ezfs_defrag_scan(struct super_block *sb, unsigned int budget)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	struct ezfs_defrag_stats stats = { 0 };
+	struct inode *inode;
+	uint64_t idx;
+
+	for (; budget && !kthread_should_stop(); budget--) {
+		idx = sbi->defrag_cursor++ % sbi->nr_inodes;
+		if (!test_bit(idx % EZFS_BITS_PER_BLOCK,
+			      (unsigned long *)
+			      sbi->inode_bitmap[idx / EZFS_BITS_PER_BLOCK]->b_data))
+			continue;
+		inode = ilookup(sb, idx + EZFS_ROOT_INODE_NUMBER);
+		if (!inode)
+			continue;
+		if (S_ISREG(inode->i_mode) && inode->i_nlink &&
+		    sb_start_write_trylock(sb)) {
+			if (inode_trylock(inode)) {
+				ezfs_defrag_inode(inode, 0, EZFS_MAX_LBLK,
+						  &stats);
+				inode_unlock(inode);
+			}
+			sb_end_write(sb);
+		}
+		iput(inode);
+		cond_resched();
+	}
+	ezfs_defrag_account(sbi, &stats);
+}
+
+/* Background defragmentation, started by the "defrag" mount option. It
+ * runs at the lowest priority and wakes up only now and then.
+ */
+static int
+ezfs_defrag_thread(void *data)
+{
+	struct super_block *sb = data;
+
+	set_user_nice(current, MAX_NICE);
+	set_freezable();
+	while (!kthread_should_stop()) {
+		ezfs_defrag_scan(sb, EZFS_DEFRAG_BATCH);
+		freezable_schedule_timeout_interruptible(EZFS_DEFRAG_INTERVAL);
+	}
+	return 0;
+}
+
+static int
+ezfs_ioc_defrag(struct file *file, struct ezfs_defrag_range __user *arg)
+{
+	struct inode *inode = file_inode(file);
+	struct ezfs_defrag_stats stats = { 0 };
+	struct ezfs_defrag_range range;
+	sector_t first, last = EZFS_MAX_LBLK;
+	int ret;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+	first = min_t(u64, range.start / EZFS_BLOCK_SIZE, EZFS_MAX_LBLK);
+	if (range.len && range.len <= U64_MAX - range.start)
+		last = min_t(u64, DIV_ROUND_UP(range.start + range.len,
+					       EZFS_BLOCK_SIZE), EZFS_MAX_LBLK);
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+	inode_lock(inode);
+	ret = ezfs_defrag_inode(inode, first, last, &stats);
+	inode_unlock(inode);
+	mnt_drop_write_file(file);
+	ezfs_defrag_account(inode->i_sb->s_fs_info, &stats);
+
+	range.blocks_moved = stats.blocks_moved;
+	range.extents_merged = stats.extents_merged;
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+	return ret;
+}
+
+static int
+ezfs_ioc_trim(struct file *file, struct fstrim_range __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	struct fstrim_range range;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!blk_queue_discard(q))
+		return -EOPNOTSUPP;
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	range.minlen = max_t(u64, range.minlen,
+			     q->limits.discard_granularity);
+	ret = ezfs_trim_fs(sb, &range);
+	if (ret)
+		return ret;
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
+
+/* FS_COMPR_FL is the only flag there is. A regular file can only change
+ * it while it is empty; new files inherit it from their directory.
+ */
+static int
+ezfs_ioc_setflags(struct file *file, unsigned int __user *arg)
+{
+	struct inode *inode = file_inode(file);
+	struct ezfs_handle handle;
+	unsigned int flags, oldflags;
+	int ret;
+
+	if (get_user(flags, arg))
+		return -EFAULT;
+	if (flags & ~FS_COMPR_FL)
+		return -EOPNOTSUPP;
+	if (!inode_owner_or_capable(inode))
+		return -EPERM;
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	inode_lock(inode);
+	oldflags = ezfs_compressed(inode) ? FS_COMPR_FL : 0;
+	ret = vfs_ioc_setflags_prepare(inode, oldflags, flags);
+	if (ret || flags == oldflags)
+		goto out;
+	if (S_ISREG(inode->i_mode) &&
+	    (i_size_read(inode) || EZFS_I(inode)->nextents)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ezfs_journal_start(inode->i_sb, &handle);
+	mutex_lock(ezfs_map_lock(inode));
+	if (flags & FS_COMPR_FL)
+		set_bit(EZFS_STATE_COMPRESS, &EZFS_I(inode)->state);
+	else
+		clear_bit(EZFS_STATE_COMPRESS, &EZFS_I(inode)->state);
+	mutex_unlock(ezfs_map_lock(inode));
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	ezfs_journal_inode(inode);
+	ret = ezfs_journal_stop(&handle);
+out:
+	inode_unlock(inode);
+	mnt_drop_write_file(file);
+	return ret;
+}
+
+long
+ezfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct ezfs_sb_info *sbi = file_inode(file)->i_sb->s_fs_info;
+	struct ezfs_defrag_stats stats;
+
+	switch (cmd) {
+	case FS_IOC_GETFLAGS:
+		return put_user(ezfs_compressed(file_inode(file)) ?
+				FS_COMPR_FL : 0, (int __user *) arg);
+	case FS_IOC_SETFLAGS:
+		return ezfs_ioc_setflags(file, (void __user *) arg);
+	case FITRIM:
+		return ezfs_ioc_trim(file, (void __user *) arg);
+	case EZFS_IOC_DEFRAG:
+		return ezfs_ioc_defrag(file, (void __user *) arg);
+	case EZFS_IOC_DEFRAG_STATS:
+		spin_lock(&sbi->defrag_lock);
+		stats = sbi->defrag_stats;
+		spin_unlock(&sbi->defrag_lock);
+		if (copy_to_user((void __user *) arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Maps @block for I/O, allocating it if @create is set. Buffers that were
+ * only reserved by ezfs_get_block_delay() are still BH_Delay here; their
+ * block was either allocated by ezfs_writepages() already or is allocated
+ * now against the reservation. Unwritten blocks read as holes; writing one
+ * marks its buffer, so that ezfs_end_buffer_write() converts the block once
+ * the data is on disk. Shared blocks are only ever written whole, from
+ * writeback, and move first.
+ */
+static int
+ezfs_get_block(struct inode *inode, sector_t block,
+	       struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	bool delayed = buffer_delay(bh_result);
+	struct ezfs_handle handle;
+	struct ezfs_extent ext;
+	unsigned int idx;
+	uint64_t len = 1;
+	long physical_addr;
+	int status, err;
+
+	if (create)
+		ezfs_journal_start(sb, &handle);
+	mutex_lock(ezfs_map_lock(inode));
+
+	status = ezfs_extent_lookup(inode, block, &ext, &idx);
+	if (!status && WARN_ON_ONCE(ext.e_flags & EZFS_EXT_COMPRESSED)) {
+		status = -EIO;
+		goto unlock_and_exit;
+	}
+	if (!status) {
+		if (ext.e_flags & EZFS_EXT_UNWRITTEN) {
+			if (!create)
+				goto unlock_and_exit;
+			set_buffer_ezfs_unwritten(bh_result);
+			set_buffer_new(bh_result);
+		} else if ((ext.e_flags & EZFS_EXT_SHARED) && create) {
+			status = ezfs_extent_unshare(inode, &ext, block, 1,
+						     delayed);
+			if (!status)
+				status = ezfs_extent_lookup(inode, block, &ext,
+							    &idx);
+			if (status)
+				goto unlock_and_exit;
+			set_buffer_new(bh_result);
+			mark_inode_dirty(inode);
+		}
+		map_bh(bh_result, sb, ext.e_pblk + block - ext.e_lblk);
+		goto unlock_and_exit;
+	}
+	if (status != -ENOENT)
+		goto unlock_and_exit;
+	status = 0;
+	if (!create)
+		goto unlock_and_exit;
+
+	physical_addr =
+	    ezfs_alloc_data_run(sb, ezfs_extent_goal(inode, block), &len,
+				delayed ? 0 : EZFS_META_RESERVE, delayed);
+	if (physical_addr < 0) {
+		status = physical_addr;
+		goto unlock_and_exit;
+	}
+
+	status = ezfs_extent_append(inode, block, physical_addr, 1, 0);
+	if (status) {
+		if (delayed)
+			ezfs_unalloc_reserved(sb, physical_addr, 1);
+		else
+			ezfs_free_data_blocks(sb, physical_addr, 1);
+		goto unlock_and_exit;
+	}
+
+	inode->i_blocks += EZFS_BLOCK_SECTORS;
+	map_bh(bh_result, sb, physical_addr);
+	set_buffer_new(bh_result);
+	mark_inode_dirty(inode);
+
+unlock_and_exit:
+	mutex_unlock(ezfs_map_lock(inode));
+	if (create) {
+		ezfs_journal_inode(inode);
+		err = ezfs_journal_stop(&handle);
+		if (!status)
+			status = err;
+	}
+	return status;
+}
+
+/* Describes the extent or hole around @pos to iomap, so that reads of a
+ * contiguous run go out as one bio. Unwritten extents read as zeros.
+ * Delayed blocks are not in the extent list yet, but their pages are
+ * uptodate in the page cache and never read.
+ *
+ * Direct writes get the holes in their range allocated as unwritten
+ * extents, which ezfs_dio_write_end_io() converts once the data is on
+ * disk.
+ */
+static int
+ezfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+		 unsigned int flags, struct iomap *iomap, struct iomap *srcmap)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t lblk = pos >> blkbits, next, hole;
+	struct ezfs_handle handle;
+	struct ezfs_extent ext;
+	struct ezfs_inode *raw;
+	struct buffer_head *bh;
+	unsigned int idx;
+	int ret, err;
+
+	/* Only reads of page 0, under its lock, and reports like fiemap
+	 * see inline data: direct I/O on an inline file goes through the
+	 * page cache and every write path moves the data out first.
+	 */
+	if (ezfs_has_inline_data(inode)) {
+		if (WARN_ON_ONCE(flags & IOMAP_WRITE))
+			return -EIO;
+		bh = ezfs_inode_bread(inode->i_sb, inode->i_ino, &raw);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		iomap->type = IOMAP_INLINE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = 0;
+		iomap->length = EZFS_BLOCK_SIZE;
+		iomap->flags = 0;
+		iomap->inline_data = raw->inline_data;
+		iomap->private = bh;
+		return 0;
+	}
+
+	mutex_lock(ezfs_map_lock(inode));
+	ret = ezfs_extent_find(inode, lblk, &ext, &idx, &next);
+	mutex_unlock(ezfs_map_lock(inode));
+	if (ret == -ENOENT && (flags & IOMAP_WRITE)) {
+		/* One run; iomap comes back for the rest. The hole is looked
+		 * up again, as the handle comes before the map lock.
+		 */
+		ezfs_journal_start(inode->i_sb, &handle);
+		mutex_lock(ezfs_map_lock(inode));
+		ret = ezfs_extent_find(inode, lblk, &ext, &idx, &next);
+		if (ret == -ENOENT) {
+			hole = lblk;
+			next = min_t(sector_t, next,
+				     DIV_ROUND_UP(pos + length,
+						  EZFS_BLOCK_SIZE));
+			ret = ezfs_prealloc_extent(inode, &hole, next);
+			mark_inode_dirty(inode);
+			if (!ret)
+				ret = ezfs_extent_find(inode, lblk, &ext,
+						       &idx, &next);
+		}
+		mutex_unlock(ezfs_map_lock(inode));
+		ezfs_journal_inode(inode);
+		err = ezfs_journal_stop(&handle);
+		if (!ret)
+			ret = err;
+	}
+	if (ret && ret != -ENOENT)
+		return ret;
+	/* Direct writes to shared blocks go through the page cache. */
+	if (!ret && (flags & IOMAP_WRITE) &&
+	    WARN_ON_ONCE(ext.e_flags & EZFS_EXT_SHARED))
+		return -EIO;
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t) lblk << blkbits;
+	iomap->flags = 0;
+	if (ret) {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->length = (loff_t) (next - lblk) << blkbits;
+	} else {
+		iomap->type = (ext.e_flags & EZFS_EXT_UNWRITTEN) ?
+		    IOMAP_UNWRITTEN : IOMAP_MAPPED;
+		/* Only reports see a compressed cluster: where it starts. */
+		if (ext.e_flags & EZFS_EXT_COMPRESSED)
+			lblk = ext.e_lblk;
+		iomap->offset = (loff_t) lblk << blkbits;
+		if (ext.e_flags & EZFS_EXT_SHARED)
+			iomap->flags |= IOMAP_F_SHARED;
+		iomap->addr =
+		    (loff_t) (ext.e_pblk + lblk - ext.e_lblk) << blkbits;
+		iomap->length =
+		    (loff_t) (ext.e_lblk + ext.e_len - lblk) << blkbits;
+	}
+	return 0;
+}
+
+static int
+ezfs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+	       ssize_t written, unsigned int flags, struct iomap *iomap)
+{
+	if (iomap->type == IOMAP_INLINE)
+		brelse(iomap->private);
+	return 0;
+}
+
+/* get_block for buffered writes. Blocks that are not mapped yet only get a
+ * reservation; they are marked BH_Delay and pointed at an invalid block
+ * until writeback allocates them. Unwritten blocks already have a home but
+ * are marked BH_Delay too, so that writeback maps them through
+ * ezfs_get_block(), which has them converted once written. So are shared
+ * blocks, which are read in first since the write may not cover them, and
+ * reserve the block they move to. Every block of a compressed file is
+ * delayed, as its cluster moves when it is written.
+ */
+static int
+ezfs_get_block_delay(struct inode *inode, sector_t block,
+		     struct buffer_head *bh_result, int create)
+{
+	struct ezfs_extent ext;
+	unsigned int idx;
+	int status;
+
+	mutex_lock(ezfs_map_lock(inode));
+	status = ezfs_extent_lookup(inode, block, &ext, &idx);
+	mutex_unlock(ezfs_map_lock(inode));
+	if (ezfs_compressed(inode) && (!status || status == -ENOENT)) {
+		map_bh(bh_result, inode->i_sb, EZFS_DELAYED_BLOCK);
+		if (status)
+			set_buffer_new(bh_result);
+		set_buffer_delay(bh_result);
+		return 0;
+	}
+	if (!status) {
+		map_bh(bh_result, inode->i_sb, ext.e_pblk + block - ext.e_lblk);
+		if (ext.e_flags & EZFS_EXT_UNWRITTEN) {
+			set_buffer_new(bh_result);
+			set_buffer_delay(bh_result);
+		} else if (ext.e_flags & EZFS_EXT_SHARED) {
+			/* Writeback moves it to a block of its own. */
+			status = ezfs_reserve_blocks(inode->i_sb, 1);
+			if (status)
+				return status;
+			if (!buffer_uptodate(bh_result)) {
+				ll_rw_block(REQ_OP_READ, 0, 1, &bh_result);
+				wait_on_buffer(bh_result);
+				if (!buffer_uptodate(bh_result)) {
+					ezfs_release_reservation(inode->i_sb,
+								 1);
+					return -EIO;
+				}
+			}
+			set_buffer_delay(bh_result);
+		}
+		return 0;
+	}
+	if (status != -ENOENT)
+		return status;
+
+	status = ezfs_reserve_blocks(inode->i_sb, 1);
+	if (status)
+		return status;
+
+	map_bh(bh_result, inode->i_sb, EZFS_DELAYED_BLOCK);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+/* Allocates the delayed run of @len blocks at @lblk in as few extents as the
+ * free space allows. Their reservation is consumed as they are allocated.
+ * Blocks of the run that sit in unwritten extents are left to
+ * ezfs_get_block(), as they are only converted once written. Each extent
+ * is its own operation, and so is each EZFS_JOURNAL_STEP_BLOCKS blocks
+ * that move out of a shared extent.
+ */
+static int
+ezfs_alloc_delayed_run(struct inode *inode, sector_t lblk, uint64_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_handle handle;
+	struct ezfs_extent ext;
+	unsigned int idx;
+	sector_t hole_end;
+	uint64_t got, goal;
+	long pblk;
+	int status = 0, err;
+
+	while (len) {
+		ezfs_journal_start(sb, &handle);
+		mutex_lock(ezfs_map_lock(inode));
+		status = ezfs_extent_find(inode, lblk, &ext, &idx, &hole_end);
+		if (!status) {
+			/* Either preallocated, or the page went through
+			 * ezfs_writepage() since we looked at it.
+			 */
+			got = min_t(uint64_t, len, ext.e_lblk + ext.e_len - lblk);
+			if (ext.e_flags & EZFS_EXT_SHARED) {
+				got = min_t(uint64_t, got,
+					    EZFS_JOURNAL_STEP_BLOCKS);
+				status = ezfs_extent_unshare(inode, &ext, lblk,
+							     got, true);
+			}
+		} else if (status == -ENOENT) {
+			got = min_t(uint64_t,
+				    min_t(uint64_t, len, hole_end - lblk),
+				    EZFS_MAX_EXTENT_LEN);
+			goal = ezfs_extent_goal(inode, lblk);
+			pblk = ezfs_alloc_data_run(sb, goal, &got, 0, true);
+			status = pblk < 0 ? pblk :
+			    ezfs_extent_append(inode, lblk, pblk, got, 0);
+			if (!status)
+				inode->i_blocks += got * EZFS_BLOCK_SECTORS;
+			else if (pblk >= 0)
+				ezfs_unalloc_reserved(sb, pblk, got);
+		}
+		mark_inode_dirty(inode);
+		mutex_unlock(ezfs_map_lock(inode));
+		ezfs_journal_inode(inode);
+		err = ezfs_journal_stop(&handle);
+		if (!status)
+			status = err;
+		if (status)
+			break;
+		lblk += got;
+		len -= got;
+	}
+
+	return status;
+}
+
+/* A run of delayed blocks being collected by ezfs_alloc_delayed(), and
+ * the pages it lies in, which are kept locked.
+ */
+struct ezfs_delayed_run {
+	struct page **locked;
+	unsigned int nlocked;
+	sector_t start;
+	uint64_t len;
+};
+
+/* Allocates the run collected so far, then lets go of its pages. */
+static int
+ezfs_alloc_delayed_flush(struct inode *inode, struct ezfs_delayed_run *run)
+{
+	unsigned int i;
+	int status = 0;
+
+	if (run->len)
+		status = ezfs_alloc_delayed_run(inode, run->start, run->len);
+	for (i = 0; i < run->nlocked; i++) {
+		unlock_page(run->locked[i]);
+		put_page(run->locked[i]);
+	}
+	run->nlocked = 0;
+	run->len = 0;
+	return status;
+}
+
+/* Adds the delayed blocks of the locked @page that lie inside i_size to
+ * @run, allocating the run so far first wherever they do not continue it.
+ * The page joins the run's locked pages if any of its blocks did, and is
+ * unlocked otherwise.
+ */
+static int
+ezfs_alloc_delayed_page(struct inode *inode, struct page *page,
+			struct ezfs_delayed_run *run)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	struct buffer_head *bh, *head;
+	bool in_run = false;
+	sector_t lblk, eof;
+	int status = 0;
+
+	eof = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+	lblk = (sector_t) page->index << (PAGE_SHIFT - blkbits);
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_delay(bh) && lblk < eof) {
+			if (!run->len || run->start + run->len != lblk) {
+				status = ezfs_alloc_delayed_flush(inode, run);
+				if (status)
+					break;
+				run->start = lblk;
+			}
+			run->len++;
+			in_run = true;
+		}
+		lblk++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	if (in_run && !status) {
+		get_page(page);
+		run->locked[run->nlocked++] = page;
+	} else {
+		unlock_page(page);
+	}
+	return status;
+}
+
+/* Walks the dirty pages in [index, end] and allocates every run of delayed
+ * blocks in one go, so a streaming write lands in a handful of extents sized
+ * by what is actually in the page cache. The pages of a run stay locked
+ * until it is allocated, so that a truncate cannot take the blocks, and
+ * their reservations, away in between.
+ */
+static int
+ezfs_alloc_delayed(struct address_space *mapping, pgoff_t index, pgoff_t end)
+{
+	struct inode *inode = mapping->host;
+	struct ezfs_delayed_run run = { .nlocked = 0, .len = 0 };
+	struct pagevec pvec;
+	unsigned int i, nr;
+	int status = 0, err;
+
+	run.locked = kmalloc_array(EZFS_DELAYED_RUN_PAGES,
+				   sizeof(*run.locked), GFP_NOFS);
+	if (!run.locked)
+		return -ENOMEM;
+
+	pagevec_init(&pvec);
+	while (!status && index <= end) {
+		nr = pagevec_lookup_range_tag(&pvec, mapping, &index, end,
+					      PAGECACHE_TAG_DIRTY);
+		if (!nr)
+			break;
+
+		for (i = 0; i < nr && !status; i++) {
+			struct page *page = pvec.pages[i];
+
+			if (run.nlocked == EZFS_DELAYED_RUN_PAGES) {
+				status = ezfs_alloc_delayed_flush(inode, &run);
+				if (status)
+					break;
+			}
+
+			lock_page(page);
+			if (page->mapping != mapping || !PageDirty(page) ||
+			    PageWriteback(page) || !page_has_buffers(page)) {
+				unlock_page(page);
+				continue;
+			}
+			status = ezfs_alloc_delayed_page(inode, page, &run);
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+
+	if (status)
+		run.len = 0;
+	err = ezfs_alloc_delayed_flush(inode, &run);
+	kfree(run.locked);
+	return status ? status : err;
+}
+
+/* Compressed files. Their data is written back in aligned clusters of
+ * EZFS_CLUSTER_BLOCKS blocks, each to new blocks and as a whole: stored as
+ * one EZFS_EXT_COMPRESSED extent if LZ4 saves at least a block, as plain
+ * blocks otherwise. The page cache holds the data uncompressed. Blocks are
+ * only allocated at writeback. Since nobody knows how many a cluster needs
+ * before then, a dirty cluster reserves EZFS_CLUSTER_BLOCKS, and what
+ * compression saves is given back when it is written.
+ */
+
+/* Reserves blocks for the cluster that holds page @index, unless it has
+ * them already. The reservation stays until ezfs_write_cluster() allocates
+ * the cluster's blocks or the cluster is truncated.
+ */
+static int
+ezfs_reserve_cluster(struct inode *inode, pgoff_t index)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	unsigned long cluster = index / EZFS_CLUSTER_BLOCKS;
+	int ret;
+
+	if (xa_load(&ei->cluster_resv, cluster))
+		return 0;
+	ret = ezfs_reserve_blocks(inode->i_sb, EZFS_CLUSTER_BLOCKS);
+	if (ret)
+		return ret;
+	ret = xa_insert(&ei->cluster_resv, cluster, xa_mk_value(1), GFP_NOFS);
+	if (ret) {
+		/* -EBUSY if another writer got there first. */
+		ezfs_release_reservation(inode->i_sb, EZFS_CLUSTER_BLOCKS);
+		if (ret == -EBUSY)
+			ret = 0;
+	}
+	return ret;
+}
+
+/* Gives back the reservations of clusters @from and up. */
+static void
+ezfs_release_clusters(struct inode *inode, unsigned long from)
+{
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	unsigned long cluster;
+	void *entry;
+
+	xa_for_each_start(&ei->cluster_resv, cluster, entry, from) {
+		if (xa_erase(&ei->cluster_resv, cluster))
+			ezfs_release_reservation(inode->i_sb,
+						 EZFS_CLUSTER_BLOCKS);
+	}
+}
+
+/* Hands the @count blocks at @pblk, which a cluster write allocated and no
+ * longer needs, back to where they came from.
+ */
+static void
+ezfs_cluster_unalloc(struct super_block *sb, uint64_t pblk, uint64_t count,
+		     bool reserved)
+{
+	if (reserved)
+		ezfs_unalloc_reserved(sb, pblk, count);
+	else
+		ezfs_free_data_blocks(sb, pblk, count);
+}
+
+/* The last cluster decompressed, for the pages after the first to find. */
+struct ezfs_cluster_buf {
+	sector_t lblk;
+	unsigned int len;
+	char *data;
+};
+
+/* Buffers for compressing clusters during one writeback pass. */
+struct ezfs_cluster_ctx {
+	char *src;
+	char *dst;
+	void *wrkmem;
+};
+
+/* Reads or writes the @nr blocks at @pblk from or to @buf, which must be
+ * physically contiguous.
+ */
+static int
+ezfs_rw_blocks(struct super_block *sb, unsigned int op, uint64_t pblk,
+	       char *buf, unsigned int nr)
+{
+	struct bio *bio;
+	unsigned int i;
+	char *p;
+	int ret;
+
+	bio = bio_alloc(GFP_NOFS, nr);
+	bio_set_dev(bio, sb->s_bdev);
+	bio->bi_iter.bi_sector = pblk * (EZFS_BLOCK_SIZE >> 9);
+	bio->bi_opf = op;
+	for (i = 0; i < nr; i++) {
+		p = buf + i * EZFS_BLOCK_SIZE;
+		bio_add_page(bio, virt_to_page(p), EZFS_BLOCK_SIZE,
+			     offset_in_page(p));
+	}
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+	return ret;
+}
+
+static int
+ezfs_read_page_sync(struct super_block *sb, struct page *page, uint64_t pblk)
+{
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOFS, 1);
+	bio_set_dev(bio, sb->s_bdev);
+	bio->bi_iter.bi_sector = pblk * (EZFS_BLOCK_SIZE >> 9);
+	bio->bi_opf = REQ_OP_READ;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+	return ret;
+}
+
+/* Reads the compressed cluster @ext and decompresses it into @cb. */
+static int
+ezfs_decompress_cluster(struct inode *inode, const struct ezfs_extent *ext,
+			struct ezfs_cluster_buf *cb)
+{
+	unsigned int nphys = ezfs_extent_phys(ext);
+	struct ezfs_cluster_header *hdr;
+	char *cdata;
+	int ret;
+
+	cb->len = 0;
+	if (!cb->data) {
+		cb->data = kmalloc(EZFS_CLUSTER_SIZE, GFP_NOFS);
+		if (!cb->data)
+			return -ENOMEM;
+	}
+	if (!nphys || nphys >= ext->e_len ||
+	    ext->e_len > EZFS_CLUSTER_BLOCKS)
+		goto corrupt;
+
+	cdata = kmalloc(EZFS_CLUSTER_SIZE, GFP_NOFS);
+	if (!cdata)
+		return -ENOMEM;
+	ret = ezfs_rw_blocks(inode->i_sb, REQ_OP_READ, ext->e_pblk, cdata,
+			     nphys);
+	if (ret) {
+		kfree(cdata);
+		return ret;
+	}
+	hdr = (struct ezfs_cluster_header *) cdata;
+	if (hdr->algo != EZFS_COMPRESS_LZ4 ||
+	    hdr->len > nphys * EZFS_BLOCK_SIZE - sizeof(*hdr) ||
+	    LZ4_decompress_safe(cdata + sizeof(*hdr), cb->data, hdr->len,
+				EZFS_CLUSTER_SIZE) !=
+	    ext->e_len * EZFS_BLOCK_SIZE) {
+		kfree(cdata);
+		goto corrupt;
+	}
+	kfree(cdata);
+
+	cb->lblk = ext->e_lblk;
+	cb->len = ext->e_len;
+	return 0;
+
+corrupt:
+	pr_err_ratelimited("EZFS: bad compressed cluster at block %u of inode %lu\n",
+			   ext->e_lblk, inode->i_ino);
+	return -EUCLEAN;
+}
+
+/* Fills the locked page @page of a compressed file, leaving it locked. */
+static int
+ezfs_read_cluster(struct inode *inode, struct page *page,
+		  struct ezfs_cluster_buf *cb)
+{
+	sector_t lblk = page->index;
+	struct ezfs_extent ext;
+	unsigned int idx;
+	char *kaddr;
+	int ret;
+
+	BUILD_BUG_ON(EZFS_BLOCK_SIZE != PAGE_SIZE);
+
+	if (!cb->len || lblk < cb->lblk || lblk >= cb->lblk + cb->len) {
+		mutex_lock(ezfs_map_lock(inode));
+		ret = ezfs_extent_lookup(inode, lblk, &ext, &idx);
+		mutex_unlock(ezfs_map_lock(inode));
+		if (ret == -ENOENT ||
+		    (!ret && (ext.e_flags & EZFS_EXT_UNWRITTEN))) {
+			zero_user(page, 0, PAGE_SIZE);
+			goto uptodate;
+		}
+		if (ret)
+			return ret;
+		if (!(ext.e_flags & EZFS_EXT_COMPRESSED)) {
+			ret = ezfs_read_page_sync(inode->i_sb, page,
+						  ext.e_pblk + lblk - ext.e_lblk);
+			if (ret)
+				return ret;
+			goto uptodate;
+		}
+		ret = ezfs_decompress_cluster(inode, &ext, cb);
+		if (ret)
+			return ret;
+	}
+
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, cb->data + (lblk - cb->lblk) * EZFS_BLOCK_SIZE,
+	       PAGE_SIZE);
+	kunmap_atomic(kaddr);
+uptodate:
+	SetPageUptodate(page);
+	return 0;
+}
+
+static int
+ezfs_readpage_compressed(struct page *page)
+{
+	struct ezfs_cluster_buf cb = { .len = 0, .data = NULL };
+	int ret;
+
+	ret = ezfs_read_cluster(page->mapping->host, page, &cb);
+	if (ret)
+		SetPageError(page);
+	unlock_page(page);
+	kfree(cb.data);
+	return ret;
+}
+
+/* Readahead decompresses each cluster once for all of its pages. */
+static void
+ezfs_readahead_compressed(struct readahead_control *rac)
+{
+	struct ezfs_cluster_buf cb = { .len = 0, .data = NULL };
+	struct page *page;
+
+	while ((page = readahead_page(rac))) {
+		if (ezfs_read_cluster(rac->mapping->host, page, &cb))
+			SetPageError(page);
+		unlock_page(page);
+		put_page(page);
+	}
+	kfree(cb.data);
+}
+
+/* Maps the cluster at @first to the @nphys blocks at @pblk, compressed, or
+ * to the plain runs in @runs, and frees what it was mapped to before. The
+ * old blocks are freed as metadata, so that they are not reused before the
+ * new map is committed.
+ */
+static int
+ezfs_remap_cluster(struct inode *inode, sector_t first, unsigned int nr,
+		   uint64_t pblk, unsigned int nphys, bool compressed,
+		   const struct ezfs_extent *runs, unsigned int nruns)
+{
+	struct super_block *sb = inode->i_sb;
+	sector_t end = first + EZFS_CLUSTER_BLOCKS, lblk, next, stop;
+	struct ezfs_extent old[EZFS_CLUSTER_BLOCKS], ext;
+	unsigned int i, idx, nold = 0;
+	struct ezfs_handle handle;
+	int ret, err;
+
+	ezfs_journal_start(sb, &handle);
+	mutex_lock(ezfs_map_lock(inode));
+	for (lblk = first; lblk < end && nold < EZFS_CLUSTER_BLOCKS;
+	     lblk = next) {
+		if (ezfs_extent_find(inode, lblk, &ext, &idx, &next))
+			continue;
+		next = ext.e_lblk + ext.e_len;
+		old[nold] = ext;
+		if (!(ext.e_flags & EZFS_EXT_COMPRESSED)) {
+			stop = min_t(sector_t, next, end);
+			old[nold].e_pblk += lblk - ext.e_lblk;
+			old[nold].e_len = stop - lblk;
+		}
+		nold++;
+	}
+
+	ret = ezfs_remove_extents(inode, first, end, false);
+	if (ret)
+		goto out;
+	for (i = 0; i < nold; i++)
+		ezfs_free_meta_blocks(sb, old[i].e_pblk,
+				      ezfs_extent_phys(&old[i]));
+
+	if (compressed) {
+		ext.e_lblk = first;
+		ext.e_len = nr;
+		ext.e_flags = EZFS_EXT_COMPRESSED |
+		    (nphys << EZFS_EXT_PHYS_SHIFT);
+		ext.e_pblk = pblk;
+		ret = ezfs_extent_insert(inode, &ext);
+		if (!ret)
+			inode->i_blocks +=
+			    (blkcnt_t) nphys * EZFS_BLOCK_SECTORS;
+	} else {
+		for (i = 0; i < nruns && !ret; i++) {
+			ret = ezfs_extent_append(inode, runs[i].e_lblk,
+						 runs[i].e_pblk, runs[i].e_len,
+						 0);
+			if (!ret)
+				inode->i_blocks += (blkcnt_t) runs[i].e_len *
+				    EZFS_BLOCK_SECTORS;
+		}
+	}
+	if (ret) {
+		/* Leave a hole; the pages are still dirty. */
+		ezfs_remove_extents(inode, first, end, false);
+	}
+out:
+	mutex_unlock(ezfs_map_lock(inode));
+	mark_inode_dirty(inode);
+	ezfs_journal_inode(inode);
+	err = ezfs_journal_stop(&handle);
+	return ret ? ret : err;
+}
+
+/* Writes back the cluster at page @first of a compressed file. Returns the
+ * number of pages written, or an error after which the pages stay dirty.
+ */
+static int
+ezfs_write_cluster(struct inode *inode, pgoff_t first,
+		   struct ezfs_cluster_ctx *cc, struct writeback_control *wbc)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_cluster_header *hdr = (struct ezfs_cluster_header *) cc->dst;
+	struct page *pages[EZFS_CLUSTER_BLOCKS];
+	struct ezfs_extent runs[EZFS_CLUSTER_BLOCKS];
+	loff_t pos = (loff_t) first << PAGE_SHIFT;
+	loff_t i_size = i_size_read(inode);
+	unsigned int nr, i, nlocked = 0, nruns = 0, nphys, done;
+	bool dirty = false, compressed = false, reserved;
+	struct buffer_head *bh, *head;
+	uint64_t got, goal, margin, used = 0;
+	long pblk = 0;
+	int clen = 0, ret = 0;
+	char *kaddr;
+
+	/* Pages past EOF are about to be truncated. */
+	if (pos >= i_size)
+		return 0;
+	nr = min_t(loff_t, EZFS_CLUSTER_BLOCKS,
+		   DIV_ROUND_UP(i_size - pos, PAGE_SIZE));
+
+	/* Clean pages of the cluster may have been reclaimed. Bring them
+	 * back before locking any, as reading takes the page lock.
+	 */
+	for (i = 0; i < nr; i++) {
+		pages[i] = read_mapping_page(mapping, first + i, NULL);
+		if (IS_ERR(pages[i])) {
+			ret = PTR_ERR(pages[i]);
+			goto out_put;
+		}
+	}
+	for (nlocked = 0; nlocked < nr; nlocked++) {
+		lock_page(pages[nlocked]);
+		if (pages[nlocked]->mapping != mapping ||
+		    !PageUptodate(pages[nlocked])) {
+			/* Truncated meanwhile; writeback comes back. */
+			nlocked++;
+			goto out_unlock;
+		}
+		wait_on_page_writeback(pages[nlocked]);
+		if (PageDirty(pages[nlocked]))
+			dirty = true;
+	}
+	if (!dirty)
+		goto out_unlock;
+	/* The blocks come out of the cluster's reservation, if it has one. */
+	reserved = xa_erase(&EZFS_I(inode)->cluster_resv,
+			    first / EZFS_CLUSTER_BLOCKS) != NULL;
+	margin = reserved ? 0 : EZFS_META_RESERVE;
+
+	for (i = 0; i < nr; i++) {
+		clear_page_dirty_for_io(pages[i]);
+		kaddr = kmap_atomic(pages[i]);
+		memcpy(cc->src + i * PAGE_SIZE, kaddr, PAGE_SIZE);
+		kunmap_atomic(kaddr);
+	}
+	/* What lies past EOF reads back as zeros. */
+	if (i_size < pos + nr * PAGE_SIZE)
+		memset(cc->src + (i_size - pos), 0,
+		       pos + nr * PAGE_SIZE - i_size);
+
+	if (nr > 1)
+		clen = LZ4_compress_default(cc->src, cc->dst + sizeof(*hdr),
+					    nr * PAGE_SIZE,
+					    (nr - 1) * EZFS_BLOCK_SIZE -
+					    sizeof(*hdr), cc->wrkmem);
+	mutex_lock(ezfs_map_lock(inode));
+	goal = ezfs_extent_goal(inode, first);
+	mutex_unlock(ezfs_map_lock(inode));
+
+	if (clen > 0) {
+		nphys = DIV_ROUND_UP(sizeof(*hdr) + clen, EZFS_BLOCK_SIZE);
+		got = nphys;
+		pblk = ezfs_alloc_data_run(sb, goal, &got, margin, reserved);
+		if (pblk >= 0 && got < nphys)
+			ezfs_cluster_unalloc(sb, pblk, got, reserved);
+		else if (pblk >= 0)
+			compressed = true;
+	}
+
+	if (compressed) {
+		hdr->algo = EZFS_COMPRESS_LZ4;
+		hdr->__reserved = 0;
+		hdr->len = clen;
+		memset(cc->dst + sizeof(*hdr) + clen, 0,
+		       nphys * EZFS_BLOCK_SIZE - sizeof(*hdr) - clen);
+		clean_bdev_aliases(sb->s_bdev, pblk, nphys);
+		ret = ezfs_rw_blocks(sb, REQ_OP_WRITE, pblk, cc->dst, nphys);
+		if (ret)
+			ezfs_cluster_unalloc(sb, pblk, nphys, reserved);
+		else
+			used = nphys;
+	} else {
+		/* Plain blocks, in as few runs as the free space allows. */
+		nphys = nr;
+		for (done = 0; done < nr; done += got) {
+			got = nr - done;
+			pblk = ezfs_alloc_data_run(sb, goal, &got, margin,
+						   reserved);
+			if (pblk < 0) {
+				ret = pblk;
+				break;
+			}
+			runs[nruns].e_lblk = first + done;
+			runs[nruns].e_len = got;
+			runs[nruns].e_flags = 0;
+			runs[nruns].e_pblk = pblk;
+			nruns++;
+			goal = pblk + got;
+			clean_bdev_aliases(sb->s_bdev, pblk, got);
+			ret = ezfs_rw_blocks(sb, REQ_OP_WRITE, pblk,
+					     cc->src + done * EZFS_BLOCK_SIZE,
+					     got);
+			if (ret)
+				break;
+		}
+		if (ret) {
+			for (i = 0; i < nruns; i++)
+				ezfs_cluster_unalloc(sb, runs[i].e_pblk,
+						     runs[i].e_len, reserved);
+		} else {
+			used = nr;
+		}
+	}
+
+	if (!ret) {
+		ret = ezfs_remap_cluster(inode, first, nr, pblk, nphys,
+					 compressed, runs, nruns);
+		if (ret && compressed) {
+			ezfs_cluster_unalloc(sb, pblk, nphys, reserved);
+		} else if (ret) {
+			for (i = 0; i < nruns; i++)
+				ezfs_cluster_unalloc(sb, runs[i].e_pblk,
+						     runs[i].e_len, reserved);
+		}
+	}
+
+	/* Pages that stay dirty keep the whole reservation; otherwise what
+	 * the cluster did not use goes back.
+	 */
+	if (reserved && ret) {
+		if (xa_insert(&EZFS_I(inode)->cluster_resv,
+			      first / EZFS_CLUSTER_BLOCKS, xa_mk_value(1),
+			      GFP_NOFS))
+			ezfs_release_reservation(sb, EZFS_CLUSTER_BLOCKS);
+	} else if (reserved) {
+		ezfs_release_reservation(sb, EZFS_CLUSTER_BLOCKS - used);
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (ret) {
+			redirty_page_for_writepage(wbc, pages[i]);
+			continue;
+		}
+		/* The buffers no longer say where the data is. */
+		if (page_has_buffers(pages[i])) {
+			bh = head = page_buffers(pages[i]);
+			do {
+				clear_buffer_dirty(bh);
+				clear_buffer_delay(bh);
+				clear_buffer_new(bh);
+				clear_buffer_mapped(bh);
+				bh = bh->b_this_page;
+			} while (bh != head);
+			try_to_free_buffers(pages[i]);
+		}
+	}
+	if (ret)
+		mapping_set_error(mapping, ret);
+	else
+		ret = nr;
+	set_bit(EZFS_STATE_FLUSH, &EZFS_I(inode)->state);
+
+out_unlock:
+	for (i = 0; i < nlocked; i++)
+		unlock_page(pages[i]);
+	i = nr;
+out_put:
+	while (i--)
+		put_page(pages[i]);
+	return ret;
+}
+
+static int
+ezfs_writepages_compressed(struct address_space *mapping,
+			   struct writeback_control *wbc)
+{
+	struct ezfs_cluster_ctx cc;
+	pgoff_t index = 0, end = -1, cluster, last = -1;
+	struct pagevec pvec;
+	unsigned int i, nr;
+	int ret = 0, err;
+
+	if (!wbc->range_cyclic) {
+		index = wbc->range_start >> PAGE_SHIFT;
+		end = wbc->range_end >> PAGE_SHIFT;
+	}
+
+	cc.src = kmalloc(EZFS_CLUSTER_SIZE, GFP_NOFS);
+	cc.dst = kmalloc(EZFS_CLUSTER_SIZE, GFP_NOFS);
+	cc.wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_NOFS);
+	if (!cc.src || !cc.dst || !cc.wrkmem) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	pagevec_init(&pvec);
+	while (index <= end) {
+		nr = pagevec_lookup_range_tag(&pvec, mapping, &index, end,
+					      PAGECACHE_TAG_DIRTY);
+		if (!nr)
+			break;
+		for (i = 0; i < nr; i++) {
+			cluster = round_down(pvec.pages[i]->index,
+					     EZFS_CLUSTER_BLOCKS);
+			if (cluster == last)
+				continue;
+			last = cluster;
+			err = ezfs_write_cluster(mapping->host, cluster, &cc,
+						 wbc);
+			if (err < 0) {
+				if (!ret)
+					ret = err;
+				continue;
+			}
+			wbc->nr_to_write -= err;
+		}
+		pagevec_release(&pvec);
+		if (wbc->nr_to_write <= 0 && wbc->sync_mode == WB_SYNC_NONE)
+			break;
+		cond_resched();
+	}
+
+out:
+	kvfree(cc.wrkmem);
+	kfree(cc.dst);
+	kfree(cc.src);
+	return ret;
+}
+
+/* Brings the pages of the cluster that a truncate to @newsize cuts into
+ * into the page cache and marks them dirty, so that writeback stores what
+ * is left of it again. Returns the first block that has to be unmapped,
+ * which is that cluster's, with its pages locked in @pages.
+ */
+static long
+ezfs_truncate_cluster(struct inode *inode, loff_t newsize,
+		      struct page **pages, unsigned int *nr)
+{
+	sector_t keep = DIV_ROUND_UP(newsize, EZFS_BLOCK_SIZE);
+	sector_t first = round_down(keep, EZFS_CLUSTER_BLOCKS);
+	unsigned int i;
+	long err;
+
+	*nr = keep - first;
+	for (i = 0; i < *nr; i++) {
+		pages[i] = read_mapping_page(inode->i_mapping, first + i, NULL);
+		if (IS_ERR(pages[i])) {
+			err = PTR_ERR(pages[i]);
+			while (i--)
+				put_page(pages[i]);
+			*nr = 0;
+			return err;
+		}
+	}
+	for (i = 0; i < *nr; i++)
+		lock_page(pages[i]);
+	return first;
+}
+
+/* The position past the dots is the entry's slot number counted over all
+ * of the directory's blocks. Index nodes are skipped.
+ */
+int
+ezfs_iterate(struct file *file, struct dir_context *context)
+{
+	struct inode *inode = file_inode(file);
+	sector_t nblocks = inode->i_size >> inode->i_blkbits;
+	struct buffer_head *buffer_head;
+	struct ezfs_dir_entry *entry_ptr;
+	sector_t lblk;
+	int entry_index;
+
+	if (!dir_emit_dots(file, context))
+		return 0;
+
+	for (lblk = (context->pos - 2) / EZFS_MAX_CHILDREN; lblk < nblocks;
+	     lblk++) {
+		buffer_head = ezfs_dir_bread(inode, lblk);
+		if (IS_ERR(buffer_head)) {
+			pr_warn("EZFS: Failed to read directory block %llu\n",
+				(unsigned long long) lblk);
+			return PTR_ERR(buffer_head);
+		}
+
+		if (ezfs_dx_is_node(buffer_head)) {
+			brelse(buffer_head);
+			context->pos = 2 + (lblk + 1) * EZFS_MAX_CHILDREN;
+			continue;
+		}
+
+		entry_index = (context->pos - 2) % EZFS_MAX_CHILDREN;
+		entry_ptr =
+		    (struct ezfs_dir_entry *) (buffer_head->b_data) +
+		    entry_index;
+		for (; entry_index < EZFS_MAX_CHILDREN;
+		     ++entry_index, ++entry_ptr, ++context->pos) {
+			if (entry_ptr->active == 1) {
+				if (!dir_emit
+				    (context, entry_ptr->filename,
+				     strnlen(entry_ptr->filename,
+					     EZFS_FILENAME_BUF_SIZE),
+				     entry_ptr->inode_no, DT_UNKNOWN)) {
+					brelse(buffer_head);
+					return 0;
+				}
+			}
+		}
+
+		brelse(buffer_head);
+	}
+
+	return 0;
+}
+
+/* Fills the locked page 0 of @inode from its inline data. */
+static int
+ezfs_read_inline(struct inode *inode, struct page *page)
+{
+	loff_t size = i_size_read(inode);
+	struct ezfs_inode *raw;
+	struct buffer_head *bh;
+	void *kaddr;
+
+	bh = ezfs_inode_bread(inode->i_sb, inode->i_ino, &raw);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, raw->inline_data, size);
+	memset(kaddr + size, 0, PAGE_SIZE - size);
+	kunmap_atomic(kaddr);
+	brelse(bh);
+	SetPageUptodate(page);
+	return 0;
+}
+
+/* Moves the inline data of @inode out to the locked page 0, @page, as
+ * delayed blocks, after which writeback gives it a block like any other
+ * data.
+ */
+static int
+ezfs_inline_to_blocks(struct inode *inode, struct page *page)
+{
+	loff_t size = i_size_read(inode);
+	int ret;
+
+	if (!ezfs_has_inline_data(inode))
+		return 0;
+	if (!PageUptodate(page)) {
+		ret = ezfs_read_inline(inode, page);
+		if (ret)
+			return ret;
+	}
+	if (size) {
+		ret = __block_write_begin(page, 0, size, ezfs_get_block_delay);
+		if (ret)
+			return ret;
+		block_commit_write(page, 0, size);
+	}
+	clear_bit(EZFS_STATE_INLINE_DATA, &EZFS_I(inode)->state);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/* Gives @inode real blocks before a write that inline data cannot take. */
+static int
+ezfs_convert_inline(struct inode *inode)
+{
+	struct page *page;
+	int ret;
+
+	if (!ezfs_has_inline_data(inode))
+		return 0;
+	page = grab_cache_page(inode->i_mapping, 0);
+	if (!page)
+		return -ENOMEM;
+	ret = ezfs_inline_to_blocks(inode, page);
+	unlock_page(page);
+	put_page(page);
+	return ret;
+}
+
+/* Compressed files reserve nothing, but a write is refused up front if a
+ * cluster would not fit any more. A partial write first brings the page in,
+ * decompressing its cluster if need be.
+ */
+static int
+ezfs_compressed_write_begin(struct inode *inode, loff_t pos,
+			    unsigned int len, unsigned int flags,
+			    struct page **pagep)
+{
+	struct ezfs_cluster_buf cb = { .len = 0, .data = NULL };
+	struct page *page;
+	int ret;
+
+	ret = ezfs_reserve_cluster(inode, pos >> PAGE_SHIFT);
+	if (ret)
+		return ret;
+
+	page = grab_cache_page_write_begin(inode->i_mapping,
+					   pos >> PAGE_SHIFT, flags);
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page) && len != PAGE_SIZE) {
+		ret = ezfs_read_cluster(inode, page, &cb);
+		kfree(cb.data);
+	}
+	if (!ret)
+		ret = __block_write_begin(page, pos, len,
+					  ezfs_get_block_delay);
+	if (ret) {
+		unlock_page(page);
+		put_page(page);
+		return ret;
+	}
+	*pagep = page;
+	return 0;
+}
+
+/* Writes that stay within the inline area only bring page 0 up to date;
+ * ezfs_inline_write_end() copies the result into the inode. Any other
+ * write to an inline file converts it first.
+ */
+int
+ezfs_write_begin(struct file *file_desc, struct address_space *space,
+		 loff_t start_pos, unsigned int length,
+		 unsigned int write_flags, struct page **page_handle,
+		 void **fs_data)
+{
+	struct inode *inode = space->host;
+	struct page *page;
+	int op_result;
+
+	if (ezfs_has_inline_data(inode)) {
+		page = grab_cache_page_write_begin(space, 0, write_flags);
+		if (!page)
+			return -ENOMEM;
+		op_result = 0;
+		if (start_pos + length <= EZFS_INLINE_DATA_SIZE &&
+		    ezfs_has_inline_data(inode)) {
+			if (!PageUptodate(page))
+				op_result = ezfs_read_inline(inode, page);
+			if (!op_result) {
+				*page_handle = page;
+				return 0;
+			}
+		} else {
+			op_result = ezfs_inline_to_blocks(inode, page);
+		}
+		unlock_page(page);
+		put_page(page);
+		if (op_result)
+			return op_result;
+	}
+
+	if (ezfs_compressed(inode))
+		op_result = ezfs_compressed_write_begin(inode, start_pos,
+							length, write_flags,
+							page_handle);
+	else
+		op_result =
+		    block_write_begin(space, start_pos, length, write_flags,
+				      page_handle, ezfs_get_block_delay);
+
+	if (unlikely(op_result))
+		handle_write_failure(space, start_pos + length);
+
+	return op_result;
+}
+
+/* Copies the inline part of page 0 into the inode record. The page itself
+ * stays clean, as it has no block to go to.
+ */
+static int
+ezfs_inline_write_end(struct inode *inode, loff_t pos, unsigned int copied,
+		      struct page *page)
+{
+	struct ezfs_handle handle;
+	struct ezfs_inode *raw;
+	struct buffer_head *bh;
+	void *kaddr;
+	int err;
+
+	ezfs_journal_start(inode->i_sb, &handle);
+	bh = ezfs_inode_bread(inode->i_sb, inode->i_ino, &raw);
+	if (IS_ERR(bh)) {
+		/* The page no longer matches what is on disk. */
+		ezfs_journal_stop(&handle);
+		ClearPageUptodate(page);
+		unlock_page(page);
+		put_page(page);
+		return PTR_ERR(bh);
+	}
+	if (pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+
+	kaddr = kmap_atomic(page);
+	lock_buffer(bh);
+	memcpy(raw->inline_data, kaddr, inode->i_size);
+	unlock_buffer(bh);
+	kunmap_atomic(kaddr);
+	ezfs_journal_dirty(inode->i_sb, bh);
+	brelse(bh);
+	mark_inode_dirty(inode);
+	ezfs_journal_inode(inode);
+	err = ezfs_journal_stop(&handle);
+	unlock_page(page);
+	put_page(page);
+	return err ? err : copied;
+}
+
+int ezfs_write_end(struct file *file_handle, struct address_space *space,
+	loff_t start_pos, unsigned int length, unsigned int written_len,
+	struct page *page_obj, void *fs_data)
+{
+	struct inode *node = space->host;
+
+	/* Page 0 is still locked, so the inode cannot have converted. */
+	if (ezfs_has_inline_data(node))
+		return ezfs_inline_write_end(node, start_pos, written_len,
+					     page_obj);
+
+	/* This marks the inode dirty if the write grew it; shrinking is
+	 * up to ezfs_setsize().
+	 */
+	return generic_write_end(file_handle, space, start_pos, length,
+				 written_len, page_obj, fs_data);
+}
+
+/* Zeroes [pos, pos + len), which must lie inside one block, through the page
+ * cache. Holes and unwritten blocks already read back as zeros, so only
+ * written blocks are touched.
+ */
+static int
+ezfs_zero_partial_block(struct inode *inode, loff_t pos, unsigned int len)
+{
+	unsigned int offset = offset_in_page(pos);
+	struct ezfs_extent ext;
+	struct page *page;
+	unsigned int idx;
+	int ret;
+
+	mutex_lock(ezfs_map_lock(inode));
+	ret = ezfs_extent_lookup(inode, pos >> inode->i_blkbits, &ext, &idx);
+	mutex_unlock(ezfs_map_lock(inode));
+	if (ret == -ENOENT || (!ret && (ext.e_flags & EZFS_EXT_UNWRITTEN)))
+		return 0;
+	if (ret)
+		return ret;
+
+	/* The cluster is written again as a whole. */
+	if (ezfs_compressed(inode)) {
+		page = read_mapping_page(inode->i_mapping, pos >> PAGE_SHIFT,
+					 NULL);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		lock_page(page);
+		zero_user(page, offset, len);
+		set_page_dirty(page);
+		unlock_page(page);
+		put_page(page);
+		return 0;
+	}
+
+	page = grab_cache_page(inode->i_mapping, pos >> PAGE_SHIFT);
+	if (!page)
+		return -ENOMEM;
+
+	ret = __block_write_begin(page, pos, len, ezfs_get_block_delay);
+	if (!ret) {
+		zero_user(page, offset, len);
+		block_commit_write(page, offset, offset + len);
+	}
+	unlock_page(page);
+	put_page(page);
+
+	return ret;
+}
+
+/* Zeroes the partial blocks at either end of [offset, offset + len). */
+static int
+ezfs_zero_partial_blocks(struct inode *inode, loff_t offset, loff_t len)
+{
+	loff_t end = offset + len;
+	loff_t head_end = round_up(offset + 1, EZFS_BLOCK_SIZE);
+	int ret = 0;
+
+	if (offset & (EZFS_BLOCK_SIZE - 1))
+		ret = ezfs_zero_partial_block(inode, offset,
+					      min(end, head_end) - offset);
+	if (!ret && (end & (EZFS_BLOCK_SIZE - 1)) &&
+	    (!(offset & (EZFS_BLOCK_SIZE - 1)) || end > head_end))
+		ret = ezfs_zero_partial_block(inode,
+					      round_down(end, EZFS_BLOCK_SIZE),
+					      end & (EZFS_BLOCK_SIZE - 1));
+	return ret;
+}
+
+/* Resizes inline data in place, clearing the bytes between the old and
+ * the new size in the record so that growing reads back zeros. Called
+ * with page 0 locked.
+ */
+static int
+ezfs_inline_setsize(struct inode *inode, loff_t newsize)
+{
+	loff_t oldsize = inode->i_size;
+	struct ezfs_handle handle;
+	struct ezfs_inode *raw;
+	struct buffer_head *bh;
+
+	ezfs_journal_start(inode->i_sb, &handle);
+	bh = ezfs_inode_bread(inode->i_sb, inode->i_ino, &raw);
+	if (IS_ERR(bh)) {
+		ezfs_journal_stop(&handle);
+		return PTR_ERR(bh);
+	}
+	lock_buffer(bh);
+	memset(raw->inline_data + min(oldsize, newsize), 0,
+	       max(oldsize, newsize) - min(oldsize, newsize));
+	unlock_buffer(bh);
+	ezfs_journal_dirty(inode->i_sb, bh);
+	brelse(bh);
+	i_size_write(inode, newsize);
+	mark_inode_dirty(inode);
+	ezfs_journal_inode(inode);
+	return ezfs_journal_stop(&handle);
+}
+
+/* Changes the size of a regular file. Growing only leaves a hole past the
+ * old end. Shrinking zeroes the rest of the new last block, drops the page
+ * cache past it, and frees the blocks beyond it one extent at a time,
+ * committing with the new size.
+ */
+static int
+ezfs_setsize(struct inode *inode, loff_t newsize)
+{
+	loff_t oldsize = inode->i_size;
+	struct page *page, *pages[EZFS_CLUSTER_BLOCKS];
+	unsigned int i, nr = 0;
+	bool inline_done = false;
+	int ret = 0;
+	long keep;
+
+	inode_dio_wait(inode);
+
+	if (ezfs_has_inline_data(inode)) {
+		page = grab_cache_page(inode->i_mapping, 0);
+		if (!page)
+			return -ENOMEM;
+		if (newsize > EZFS_INLINE_DATA_SIZE) {
+			ret = ezfs_inline_to_blocks(inode, page);
+		} else if (ezfs_has_inline_data(inode)) {
+			ret = ezfs_inline_setsize(inode, newsize);
+			inline_done = !ret;
+		}
+		unlock_page(page);
+		put_page(page);
+		if (ret)
+			return ret;
+		if (inline_done) {
+			/* Only zeroes the tail of page 0. */
+			truncate_pagecache(inode, newsize);
+			return 0;
+		}
+	}
+
+	if (newsize > oldsize) {
+		truncate_setsize(inode, newsize);
+		return 0;
+	}
+
+	if (newsize & (EZFS_BLOCK_SIZE - 1)) {
+		ret = ezfs_zero_partial_block(inode, newsize,
+					      EZFS_BLOCK_SIZE -
+					      (newsize & (EZFS_BLOCK_SIZE - 1)));
+		if (ret)
+			return ret;
+	}
+	truncate_setsize(inode, newsize);
+
+	/* A compressed cluster cut in two is written again from the page
+	 * cache, so all of it goes.
+	 */
+	keep = DIV_ROUND_UP(newsize, EZFS_BLOCK_SIZE);
+	if (ezfs_compressed(inode)) {
+		ezfs_release_clusters(inode, DIV_ROUND_UP(newsize,
+							  EZFS_CLUSTER_SIZE));
+		keep = ezfs_truncate_cluster(inode, newsize, pages, &nr);
+		if (keep < 0)
+			return keep;
+	}
+
+	ret = ezfs_punch_extents(inode, keep, EZFS_MAX_LBLK);
+
+	for (i = 0; i < nr; i++) {
+		set_page_dirty(pages[i]);
+		unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
+	return ret;
+}
+
+int
+ezfs_setattr(struct dentry *dentry, struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ezfs_handle handle;
+	int ret;
+
+	ret = setattr_prepare(dentry, iattr);
+	if (ret)
+		return ret;
+
+	if ((iattr->ia_valid & ATTR_SIZE) &&
+	    iattr->ia_size != i_size_read(inode)) {
+		ret = ezfs_setsize(inode, iattr->ia_size);
+		if (ret)
+			return ret;
+	}
+
+	ezfs_journal_start(inode->i_sb, &handle);
+	setattr_copy(inode, iattr);
+	mark_inode_dirty(inode);
+	ezfs_journal_inode(inode);
+	return ezfs_journal_stop(&handle);
+}
+
+long
+ezfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	loff_t end = offset + len;
+	struct ezfs_handle handle;
+	sector_t first, last;
+	int ret, err;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if (!S_ISREG(inode->i_mode) || ezfs_compressed(inode))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	inode_dio_wait(inode);
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto out;
+	}
+
+	/* Delayed blocks in the range get their real home first, so that
+	 * everything below only has to deal with the extent list.
+	 */
+	ret = ezfs_convert_inline(inode);
+	if (ret)
+		goto out;
+	ret = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+	if (ret)
+		goto out;
+
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		ret = ezfs_zero_partial_blocks(inode, offset, len);
+		if (ret)
+			goto out;
+		truncate_pagecache_range(inode, offset, end - 1);
+
+		first = DIV_ROUND_UP(offset, EZFS_BLOCK_SIZE);
+		last = end >> inode->i_blkbits;
+		if (first < last) {
+			ret = ezfs_punch_extents(inode, first, last);
+			if (ret)
+				goto out_dirty;
+		}
+		inode->i_mtime = current_time(inode);
+	}
+
+	/* A run per transaction; the size goes with the last one. */
+	if (!(mode & FALLOC_FL_PUNCH_HOLE)) {
+		first = offset >> inode->i_blkbits;
+		last = DIV_ROUND_UP(end, EZFS_BLOCK_SIZE);
+		do {
+			ezfs_journal_start(inode->i_sb, &handle);
+			mutex_lock(ezfs_map_lock(inode));
+			ret = ezfs_prealloc_extent(inode, &first, last);
+			mutex_unlock(ezfs_map_lock(inode));
+			if (!ret && first >= last &&
+			    !(mode & FALLOC_FL_KEEP_SIZE) &&
+			    end > i_size_read(inode))
+				i_size_write(inode, end);
+			mark_inode_dirty(inode);
+			ezfs_journal_inode(inode);
+			err = ezfs_journal_stop(&handle);
+			if (!ret)
+				ret = err;
+			cond_resched();
+		} while (!ret && first < last);
+		if (ret)
+			goto out_dirty;
+	}
+
+out_dirty:
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+out:
+	inode_unlock(inode);
+	return ret;
+}
+
+/* Shares the source extent at @lblk, up to @end, with @dst at @dst_lblk,
+ * where @dst has a hole. Returns how many blocks were done.
+ */
+static long
+ezfs_clone_extent(struct inode *src, sector_t lblk, sector_t end,
+		  struct inode *dst, sector_t dst_lblk)
+{
+	struct super_block *sb = src->i_sb;
+	struct ezfs_extent ext;
+	unsigned int idx;
+	sector_t next;
+	uint64_t pblk;
+	uint32_t n;
+	int ret;
+
+	mutex_lock(ezfs_map_lock(src));
+	ret = ezfs_extent_find(src, lblk, &ext, &idx, &next);
+	if (ret) {
+		mutex_unlock(ezfs_map_lock(src));
+		if (ret == -ENOENT)
+			return min(next, end) - lblk;
+		return ret;
+	}
+	n = min_t(sector_t, min_t(sector_t, end, ext.e_lblk + ext.e_len),
+		  lblk + EZFS_JOURNAL_STEP_BLOCKS) - lblk;
+	/* Unwritten blocks read as zeros, and so does the hole. */
+	if (ext.e_flags & EZFS_EXT_UNWRITTEN) {
+		mutex_unlock(ezfs_map_lock(src));
+		return n;
+	}
+
+	pblk = ext.e_pblk + lblk - ext.e_lblk;
+	ret = ezfs_ref_get(sb, pblk, n);
+	if (!ret && !(ext.e_flags & EZFS_EXT_SHARED)) {
+		ret = ezfs_remove_extents(src, lblk, lblk + n, false);
+		if (!ret)
+			ret = ezfs_extent_append(src, lblk, pblk, n,
+						 EZFS_EXT_SHARED);
+		if (!ret)
+			src->i_blocks += (blkcnt_t) n * EZFS_BLOCK_SECTORS;
+		else
+			ezfs_ref_put(sb, pblk, n, ezfs_release_data_blocks);
+	}
+	mutex_unlock(ezfs_map_lock(src));
+	if (ret)
+		return ret;
+
+	mutex_lock(ezfs_map_lock(dst));
+	ret = ezfs_extent_append(dst, dst_lblk, pblk, n, EZFS_EXT_SHARED);
+	if (!ret)
+		dst->i_blocks += (blkcnt_t) n * EZFS_BLOCK_SECTORS;
+	mutex_unlock(ezfs_map_lock(dst));
+	if (ret) {
+		ezfs_ref_put(sb, pblk, n, ezfs_release_data_blocks);
+		return ret;
+	}
+	return n;
+}
+
+/* FICLONE, FICLONERANGE and FIDEDUPERANGE. The blocks behind the source
+ * range become shared with the destination, which lets go of its own, and
+ * both files copy a shared block on write. Compressed files cannot share
+ * their clusters.
+ */
+loff_t
+ezfs_remap_file_range(struct file *file_in, loff_t pos_in,
+		      struct file *file_out, loff_t pos_out, loff_t len,
+		      unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct super_block *sb = src->i_sb;
+	sector_t lblk, first, end, dst_first;
+	struct ezfs_handle handle;
+	loff_t ret;
+	long done;
+	int err;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN |
+			     REMAP_FILE_ADVISORY))
+		return -EINVAL;
+
+	lock_two_nondirectories(src, dst);
+	if (ezfs_compressed(src) || ezfs_compressed(dst)) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+	ret = ezfs_convert_inline(src);
+	if (!ret)
+		ret = ezfs_convert_inline(dst);
+	if (ret)
+		goto out;
 
-	idx = find_first_zero_bit(bitmap, EZFS_MAX_DATA_BLKS);
-	if (idx == EZFS_MAX_DATA_BLKS) {
-		mutex_unlock(sb_data->ezfs_lock);
-		return -ENOSPC;
+	/* This writes back both ranges. */
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+					    &len, remap_flags);
+	if (ret < 0 || !len)
+		goto out;
+	/* A partial last block would wipe what follows it in @dst. */
+	if (!IS_ALIGNED(len, EZFS_BLOCK_SIZE) &&
+	    pos_out + len < i_size_read(dst)) {
+		ret = -EINVAL;
+		goto out;
 	}
 
-	if (!total_blocks) {
-		physical_addr = idx + EZFS_ROOT_DATABLOCK_NUMBER;
-		inode_data->dbn = physical_addr;
-		goto allocation_success;
+	/* Buffers that still point at blocks about to be shared would let
+	 * writes go to them in place.
+	 */
+	ret = invalidate_inode_pages2_range(src->i_mapping,
+					    pos_in >> PAGE_SHIFT,
+					    (pos_in + len - 1) >> PAGE_SHIFT);
+	if (ret)
+		goto out;
+	truncate_inode_pages_range(dst->i_mapping, pos_out,
+				   round_up(pos_out + len, EZFS_BLOCK_SIZE) - 1);
+
+	first = pos_in >> src->i_blkbits;
+	end = DIV_ROUND_UP(pos_in + len, EZFS_BLOCK_SIZE);
+	dst_first = pos_out >> dst->i_blkbits;
+
+	ret = ezfs_punch_extents(dst, dst_first, dst_first + end - first);
+
+	/* One extent, or EZFS_JOURNAL_STEP_BLOCKS of one, per transaction,
+	 * so that a large clone does not overflow one.
+	 */
+	for (lblk = first; !ret && lblk < end; lblk += done) {
+		ezfs_journal_start(sb, &handle);
+		done = ezfs_clone_extent(src, lblk, end, dst,
+					 dst_first + lblk - first);
+		if (done < 0)
+			ret = done;
+		if (!ret && lblk + done >= end &&
+		    pos_out + len > i_size_read(dst))
+			i_size_write(dst, pos_out + len);
+		mark_inode_dirty(src);
+		mark_inode_dirty(dst);
+		ezfs_journal_inode(src);
+		ezfs_journal_inode(dst);
+		err = ezfs_journal_stop(&handle);
+		if (!ret)
+			ret = err;
+		cond_resched();
 	}
 
-	if (!test_bit(physical_addr - EZFS_ROOT_DATABLOCK_NUMBER, bitmap))
-		goto allocation_success;
+out:
+	unlock_two_nondirectories(src, dst);
+	return ret ? ret : len;
+}
 
-	expanded_block_count = total_blocks + 1;
-	for (idx = 0, searching_block = 0;
-	     searching_block < expanded_block_count && idx < EZFS_MAX_DATA_BLKS;
-	     idx++, searching_block++) {
-		block_idx = idx + EZFS_ROOT_DATABLOCK_NUMBER;
-		if (test_bit(idx, bitmap) &&
-		    (current_block_no > block_idx
-		     || current_block_no + total_blocks - 1 < block_idx)) {
-			searching_block = -1;
+/* Copies in the kernel. Where both positions sit at the same offset in a
+ * block, whole blocks are shared as by FICLONERANGE; the rest, and files
+ * that cannot share, go through a large buffer in EZFS_COPY_CHUNK reads
+ * and writes.
+ */
+ssize_t
+ezfs_copy_file_range(struct file *file_in, loff_t pos_in,
+		     struct file *file_out, loff_t pos_out, size_t len,
+		     unsigned int flags)
+{
+	bool share = file_inode(file_in)->i_sb == file_inode(file_out)->i_sb &&
+	    !((pos_in ^ pos_out) & (EZFS_BLOCK_SIZE - 1));
+	struct iov_iter iter;
+	struct kvec kv;
+	ssize_t ret = 0, done = 0;
+	loff_t cloned;
+	size_t n;
+
+	kv.iov_base = NULL;
+	while (done < len) {
+		n = len - done;
+		if (share && !(pos_in & (EZFS_BLOCK_SIZE - 1)) &&
+		    n >= EZFS_BLOCK_SIZE) {
+			n = round_down(n, EZFS_BLOCK_SIZE);
+			cloned = ezfs_remap_file_range(file_in, pos_in,
+						       file_out, pos_out, n,
+						       REMAP_FILE_CAN_SHORTEN);
+			if (cloned > 0) {
+				pos_in += cloned;
+				pos_out += cloned;
+				done += cloned;
+				continue;
+			}
+			share = false;
 		}
-	}
 
-	if (searching_block < expanded_block_count) {
-		status = -ENOSPC;
-		goto unlock_and_exit;
-	}
+		/* Up to the next block boundary, if sharing is still on. */
+		if (share)
+			n = min_t(size_t, n, EZFS_BLOCK_SIZE -
+				  (pos_in & (EZFS_BLOCK_SIZE - 1)));
+		n = min_t(size_t, n, EZFS_COPY_CHUNK);
+		if (!kv.iov_base) {
+			kv.iov_base = kvmalloc(EZFS_COPY_CHUNK, GFP_KERNEL);
+			if (!kv.iov_base) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
 
-	new_start_index = idx - expanded_block_count;
-	physical_addr = idx - 1 + EZFS_ROOT_DATABLOCK_NUMBER;
-	start_index = current_block_no - EZFS_ROOT_DATABLOCK_NUMBER;
-	for (i = 0; i < total_blocks; i++) {
-		ezfs_move_block(start_index, start_index + i,
-				new_start_index + i, sb, inode->i_mapping);
-		clear_bit(start_index + i, bitmap);
+		kv.iov_len = n;
+		iov_iter_kvec(&iter, READ, &kv, 1, n);
+		ret = vfs_iter_read(file_in, &iter, &pos_in, 0);
+		if (ret <= 0)
+			break;
+		kv.iov_len = ret;
+		iov_iter_kvec(&iter, WRITE, &kv, 1, ret);
+		ret = vfs_iter_write(file_out, &iter, &pos_out, 0);
+		if (ret <= 0)
+			break;
+		done += ret;
+		if (ret < kv.iov_len || fatal_signal_pending(current))
+			break;
+		cond_resched();
 	}
-	for (i = 0; i < total_blocks; i++)
-		set_bit(new_start_index + i, bitmap);
-	inode_data->dbn = new_start_index + EZFS_ROOT_DATABLOCK_NUMBER;
 
-allocation_success:
-	map_bh(bh_result, sb, physical_addr);
+	kvfree(kv.iov_base);
+	return done ? done : ret;
+}
 
-	set_bit(physical_addr - EZFS_ROOT_DATABLOCK_NUMBER, bitmap);
-	mark_buffer_dirty(sb_buffer_head);
+/* Unwritten blocks in [from, to) become written ones, one extent per
+ * operation.
+ */
+static int
+ezfs_convert_unwritten(struct inode *inode, sector_t from, sector_t to)
+{
+	struct ezfs_handle handle;
+	struct ezfs_extent ext;
+	unsigned int idx;
+	sector_t next;
+	uint32_t len;
+	int ret = 0, err;
+
+	while (!ret && from < to) {
+		ezfs_journal_start(inode->i_sb, &handle);
+		mutex_lock(ezfs_map_lock(inode));
+		while (from < to) {
+			ret = ezfs_extent_find(inode, from, &ext, &idx, &next);
+			if (ret == -ENOENT) {
+				ret = 0;
+				from = next;
+				continue;
+			}
+			if (ret)
+				break;
 
-unlock_and_exit:
-	mutex_unlock(sb_data->ezfs_lock);
-	return status;
+			len = min_t(sector_t, to,
+				    ext.e_lblk + ext.e_len) - from;
+			from += len;
+			if (ext.e_flags & EZFS_EXT_UNWRITTEN) {
+				ret = ezfs_extent_convert(inode, &ext,
+							  from - len, len);
+				break;
+			}
+		}
+		mutex_unlock(ezfs_map_lock(inode));
+		mark_inode_dirty(inode);
+		ezfs_journal_inode(inode);
+		err = ezfs_journal_stop(&handle);
+		if (!ret)
+			ret = err;
+	}
+	return ret;
 }
 
-int
-ezfs_iterate(struct file *file, struct dir_context *context)
+/* The data of a direct write is on disk: the blocks it went to can be read
+ * back now, and the file grows to cover it.
+ */
+static int
+ezfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+		      unsigned int flags)
 {
-	struct inode *inode = file_inode(file);
-	uint64_t block_number =
-	    ((struct ezfs_inode *)
-	     check_buffer_head(inode ? inode->i_private : NULL,
-			       "Inode private data"))->dbn;
-	struct buffer_head *buffer_head = sb_bread(inode->i_sb, block_number);
-	struct ezfs_dir_entry *entry_ptr;
-	int entry_index, total_entries = EZFS_MAX_CHILDREN;
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct ezfs_handle handle;
+	loff_t pos = iocb->ki_pos;
+	int ret = 0;
+
+	if (error || size <= 0)
+		return error;
+
+	set_bit(EZFS_STATE_FLUSH, &EZFS_I(inode)->state);
+	if (flags & IOMAP_DIO_UNWRITTEN)
+		ret = ezfs_convert_unwritten(inode, pos >> inode->i_blkbits,
+					     DIV_ROUND_UP(pos + size,
+							  EZFS_BLOCK_SIZE));
+	if (ret || pos + size <= i_size_read(inode))
+		return ret;
 
-	if (!dir_emit_dots(file, context))
-		return 0;
+	ezfs_journal_start(inode->i_sb, &handle);
+	mutex_lock(ezfs_map_lock(inode));
+	if (pos + size > i_size_read(inode))
+		i_size_write(inode, pos + size);
+	mutex_unlock(ezfs_map_lock(inode));
+	mark_inode_dirty(inode);
+	ezfs_journal_inode(inode);
+	return ezfs_journal_stop(&handle);
+}
 
-	if (!buffer_head) {
-		pr_warn("EZFS: Failed to read directory block %llu\n", block_number);
-		return -EIO;
-	}
+static const struct iomap_dio_ops ezfs_dio_write_ops = {
+	.end_io = ezfs_dio_write_end_io,
+};
+
+/* Delayed blocks only reach the extent list at writeback, so ranges that
+ * still have dirty pages are written back before holes are looked for.
+ */
+static int
+ezfs_flush_delayed(struct inode *inode)
+{
+	if (!mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY))
+		return 0;
+	return filemap_write_and_wait(inode->i_mapping);
+}
 
-	entry_ptr =
-	    (struct ezfs_dir_entry *) (buffer_head->b_data) + (context->pos -
-							       2);
+loff_t
+ezfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+	int ret;
 
-	for (entry_index = context->pos - 2; entry_index < total_entries;
-	     ++entry_index, ++entry_ptr, ++context->pos) {
-		if (entry_ptr->active) {
-			if (!dir_emit
-			    (context, entry_ptr->filename,
-			     strlen(entry_ptr->filename), entry_ptr->inode_no,
-			     DT_UNKNOWN)) {
-				break;
-			}
-		}
-	}
+	if (whence != SEEK_HOLE && whence != SEEK_DATA)
+		return generic_file_llseek(file, offset, whence);
 
-	brelse(buffer_head);
+	inode_lock_shared(inode);
+	ret = ezfs_flush_delayed(inode);
+	if (ret)
+		offset = ret;
+	else if (whence == SEEK_HOLE)
+		offset = iomap_seek_hole(inode, offset, &ezfs_iomap_ops);
+	else
+		offset = iomap_seek_data(inode, offset, &ezfs_iomap_ops);
+	inode_unlock_shared(inode);
 
-	return 0;
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
 }
 
 int
-ezfs_write_begin(struct file *file_desc, struct address_space *space,
-		 loff_t start_pos, unsigned int length,
-		 unsigned int write_flags, struct page **page_handle,
-		 void **fs_data)
+ezfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+	    u64 start, u64 len)
 {
-	int op_result;
+	int ret;
 
-	op_result =
-	    block_write_begin(space, start_pos, length, write_flags,
-			      page_handle, ezfs_get_block);
+	inode_lock_shared(inode);
+	ret = ezfs_flush_delayed(inode);
+	if (!ret)
+		ret = iomap_fiemap(inode, fieinfo, start, len,
+				   &ezfs_iomap_ops);
+	inode_unlock_shared(inode);
+	return ret;
+}
 
-	if (unlikely(op_result))
-		handle_write_failure(space, start_pos + length);
+/* O_DIRECT reads and writes go straight between the user buffer and the
+ * file's blocks. iomap_dio_rw() writes back and invalidates the cached
+ * pages of the range around the I/O.
+ */
+ssize_t
+ezfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	/* Inline and compressed data have no blocks to read directly. */
+	if (!(iocb->ki_flags & IOCB_DIRECT) || ezfs_has_inline_data(inode) ||
+	    ezfs_compressed(inode)) {
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		return generic_file_read_iter(iocb, to);
+	}
+	if (!iov_iter_count(to))
+		return 0;
 
-	return op_result;
+	inode_lock_shared(inode);
+	ret = iomap_dio_rw(iocb, to, &ezfs_iomap_ops, NULL,
+			   is_sync_kiocb(iocb));
+	inode_unlock_shared(inode);
+	file_accessed(iocb->ki_filp);
+	return ret;
 }
 
-int ezfs_write_end(struct file *file_handle, struct address_space *space,
-	loff_t start_pos, unsigned int length, unsigned int written_len,
-	struct page *page_obj, void *fs_data)
+ssize_t
+ezfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	int final_result;
-	struct inode *node = space->host;
-	loff_t prev_size = node->i_size;
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	ssize_t ret;
 
-	final_result =
-	    generic_write_end(file_handle, space, start_pos, length,
-			      written_len, page_obj, fs_data);
+	if (ezfs_compressed(inode))
+		iocb->ki_flags &= ~IOCB_DIRECT;
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_write_iter(iocb, from);
 
-	if (prev_size != node->i_size) {
-		int old_block_count =
-		    (prev_size + EZFS_BLOCK_SIZE - 1) / EZFS_BLOCK_SIZE;
-		int new_block_count =
-		    (node->i_size + EZFS_BLOCK_SIZE - 1) / EZFS_BLOCK_SIZE;
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out;
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out;
+	ret = file_update_time(file);
+	if (ret)
+		goto out;
+	ret = ezfs_convert_inline(inode);
+	if (ret)
+		goto out;
 
-		node->i_blocks = new_block_count * 8;
-		mark_inode_dirty(node);
+	if (ezfs_range_shared(inode, iocb->ki_pos, iov_iter_count(from)))
+		ret = -ENOTBLK;
+	else
+		ret = iomap_dio_rw(iocb, from, &ezfs_iomap_ops,
+				   &ezfs_dio_write_ops, is_sync_kiocb(iocb));
+	if (ret == -ENOTBLK) {
+		/* The cached pages could not be dropped, or the blocks
+		 * are shared; go through the page cache.
+		 */
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		ret = __generic_file_write_iter(iocb, from);
+		inode_unlock(inode);
+		if (ret > 0)
+			ret = generic_write_sync(iocb, ret);
+		return ret;
+	}
+out:
+	inode_unlock(inode);
+	return ret;
+}
 
-		if (old_block_count > new_block_count) {
-			struct ezfs_super_block *sb_info = get_ezfs_superblock(node->i_sb);
-			struct ezfs_inode *inode_data = (struct ezfs_inode *) check_buffer_head(node ? node->i_private : NULL, "Inode private data");
-			int idx, data_block_no = inode_data->dbn;
+/* A shared writable mapping writes through the page cache, so an inline
+ * file gets its blocks before the first store, and the page's blocks are
+ * reserved as for write(): a store to a hole fails here rather than at
+ * writeback when the filesystem is full.
+ */
+static vm_fault_t
+ezfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	int ret;
 
+	sb_start_pagefault(inode->i_sb);
+	ret = ezfs_convert_inline(inode);
+	if (!ret && ezfs_compressed(inode))
+		ret = ezfs_reserve_cluster(inode, vmf->pgoff);
+	if (!ret) {
+		file_update_time(vmf->vma->vm_file);
+		ret = block_page_mkwrite(vmf->vma, vmf, ezfs_get_block_delay);
+	}
+	sb_end_pagefault(inode->i_sb);
+	return block_page_mkwrite_return(ret);
+}
 
-			mutex_lock(sb_info->ezfs_lock);
+static const struct vm_operations_struct ezfs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ezfs_page_mkwrite,
+};
 
-			for (idx = new_block_count; idx < old_block_count;
-			     ++idx) {
-				CLEARBIT(sb_info->free_data_blocks,
-					 data_block_no + idx -
-					 EZFS_ROOT_DATABLOCK_NUMBER);
-			}
-			mutex_unlock(sb_info->ezfs_lock);
-		}
-	}
-	return final_result;
+int
+ezfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &ezfs_file_vm_ops;
+	return 0;
 }
 
 struct dentry *
@@ -506,28 +6310,27 @@ ezfs_lookup(struct inode *directory, struct dentry *child_entry,
 	struct ezfs_dir_entry *dir_entry;
 	struct buffer_head *buffer_head;
 	struct inode *found_inode = NULL;
-	uint64_t directory_block;
-	int index;
+	uint64_t ino = 0;
 
-	directory_block = get_ezfs_inode(directory)->dbn;
-	buffer_head = sb_bread(directory->i_sb, directory_block);
+	if (child_entry->d_name.len > EZFS_MAX_FILENAME_LENGTH)
+		return ERR_PTR(-ENAMETOOLONG);
 
-	if (!buffer_head)
-		return ERR_PTR(-EIO);
+	if (ezfs_name_cache_lookup(directory, &child_entry->d_name, &ino)) {
+		buffer_head = ezfs_find_entry(directory, &child_entry->d_name,
+					      &dir_entry);
+		if (IS_ERR(buffer_head))
+			return ERR_CAST(buffer_head);
 
-	dir_entry = (struct ezfs_dir_entry *) buffer_head->b_data;
-	for (index = 0; index < EZFS_MAX_CHILDREN; index++, dir_entry++) {
-		if (dir_entry->active
-		    && strncmp(dir_entry->filename, child_entry->d_name.name,
-			       child_entry->d_name.len) == 0
-		    && dir_entry->filename[child_entry->d_name.len] == '\0') {
-			found_inode =
-			    ezfs_iget(directory->i_sb, dir_entry->inode_no);
-			break;
+		if (buffer_head) {
+			ino = dir_entry->inode_no;
+			brelse(buffer_head);
 		}
+		ezfs_name_cache_set(directory, &child_entry->d_name, ino);
 	}
 
-	brelse(buffer_head);
+	if (ino)
+		found_inode = ezfs_iget(directory->i_sb, ino);
+
 	return d_splice_alias(found_inode, child_entry);
 }
 
@@ -535,177 +6338,156 @@ static struct inode *
 create_inode_helper(struct inode *dir, struct dentry *dentry, umode_t mode,
 		    bool isdir)
 {
-	int i, i_idx, d_idx, i_num, d_num;
-	struct ezfs_super_block *ezfs_sb = get_ezfs_superblock(dir->i_sb);
-	struct buffer_head *dir_bh, *i_bh;
-	struct ezfs_dir_entry *ezfs_dentry;
+	int err;
+	unsigned int group;
+	long i_num, d_num = 0;
+	struct ezfs_sb_info *sbi = dir->i_sb->s_fs_info;
 	struct inode *new_inode, *ret = NULL;
-	struct ezfs_inode *new_ezfs_inode;
-	uint64_t dir_blk_num = get_ezfs_inode(dir)->dbn;
-struct ezfs_sb_buffer_heads *sb_buf_heads;
+	struct ezfs_inode_info *ei;
 
-	if (strnlen(dentry->d_name.name, EZFS_MAX_FILENAME_LENGTH + 1) >
-	    EZFS_MAX_FILENAME_LENGTH) {
+	if (dentry->d_name.len > EZFS_MAX_FILENAME_LENGTH)
 		return ERR_PTR(-ENAMETOOLONG);
-	}
-
-	dir_bh = read_directory_block(dir->i_sb, dir_blk_num);
-	if (IS_ERR(dir_bh))
-		return ERR_CAST(dir_bh);
-
-	ezfs_dentry = (struct ezfs_dir_entry *) dir_bh->b_data;
-
-	for (i = 0; i < EZFS_MAX_CHILDREN && ezfs_dentry->active;
-	    ++i, ++ezfs_dentry)
-		;
-
-	if (i == EZFS_MAX_CHILDREN) {
-		brelse(dir_bh);
-		return ERR_PTR(-ENOSPC);
-	}
 
-	mutex_lock(ezfs_sb->ezfs_lock);
-	i_idx =
-	    find_free_index(ezfs_sb->free_inodes, EZFS_MAX_INODES,
-			    "No free inodes");
-	if (i_idx < 0) {
-		ret = ERR_PTR(i_idx);
-		goto out;
-	}
-	i_num = i_idx + EZFS_ROOT_INODE_NUMBER;
+	i_num = ezfs_alloc_ino(dir->i_sb);
+	if (i_num < 0)
+		return ERR_PTR(i_num);
 
 	if (isdir)
 		mode |= S_IFDIR;
 
+	/* Files live with their directory; directories are spread out. */
+	group = (mode & S_IFDIR) ? ezfs_orlov_group(dir) : ezfs_inode_group(dir);
+
 	if (mode & S_IFDIR) {
 		struct buffer_head *new_dir_bh;
 
-		d_idx =
-		    find_free_index(ezfs_sb->free_data_blocks,
-				    EZFS_MAX_DATA_BLKS, "No free data blocks");
-		if (d_idx < 0) {
-			ret = ERR_PTR(d_idx);
+		d_num = ezfs_alloc_data_block(dir->i_sb,
+					      sbi->groups[group].start +
+					      sbi->data_start,
+					      EZFS_META_RESERVE);
+		if (d_num < 0) {
+			pr_err("No free data blocks\n");
+			ret = ERR_PTR(d_num);
+			d_num = 0;
 			goto out;
 		}
-		d_num = d_idx + EZFS_ROOT_DATABLOCK_NUMBER;
 		new_dir_bh = read_directory_block(dir->i_sb, d_num);
 		if (IS_ERR(new_dir_bh)) {
 			ret = ERR_CAST(new_dir_bh);
 			goto out;
 		}
 		memset(new_dir_bh->b_data, 0, EZFS_BLOCK_SIZE);
-		mark_buffer_dirty(new_dir_bh);
+		ezfs_journal_dirty(dir->i_sb, new_dir_bh);
 		brelse(new_dir_bh);
 	}
 
+	/* The inode table slot is only written by ezfs_write_inode(). */
 	new_inode = iget_locked(dir->i_sb, i_num);
-	if (IS_ERR(new_inode)) {
-		ret = ERR_CAST(new_inode);
+	if (!new_inode) {
+		ret = ERR_PTR(-ENOMEM);
 		goto out;
 	}
 
-	i_bh = get_ezfs_buffer_head(dir->i_sb);
-	new_ezfs_inode = ((struct ezfs_inode *) i_bh->b_data) + i_idx;
+	/* From here on, evicting the new inode gives its resources back. */
+	ei = EZFS_I(new_inode);
+	ei->group = group;
+	if (ezfs_compressed(dir))
+		set_bit(EZFS_STATE_COMPRESS, &ei->state);
 	new_inode->i_mode = mode;
 	new_inode->i_op = &ezfs_inode_ops;
 	new_inode->i_sb = dir->i_sb;
 	if (mode & S_IFDIR) {
 		new_inode->i_fop = &ezfs_dir_ops;
 		new_inode->i_size = EZFS_BLOCK_SIZE;
-		new_inode->i_blocks = 8;
-		new_ezfs_inode->dbn = d_num;
+		new_inode->i_blocks = EZFS_BLOCK_SECTORS;
+		ei->map[0].e_lblk = 0;
+		ei->map[0].e_len = 1;
+		ei->map[0].e_flags = 0;
+		ei->map[0].e_pblk = d_num;
+		ei->order[0] = 0;
+		ei->nextents = 1;
 		set_nlink(new_inode, 2);
 	} else {
+		/* Files start out inline and get blocks once they outgrow
+		 * the inode.
+		 */
 		new_inode->i_fop = &ezfs_file_ops;
 		new_inode->i_size = 0;
 		new_inode->i_blocks = 0;
-		new_ezfs_inode->dbn = -1;
+		set_bit(EZFS_STATE_INLINE_DATA, &ei->state);
 		set_nlink(new_inode, 1);
 	}
 	new_inode->i_mapping->a_ops = &ezfs_aops;
 	new_inode->i_atime = new_inode->i_mtime = new_inode->i_ctime =
 	    current_time(new_inode);
 	inode_init_owner(new_inode, dir, mode);
+	if (mode & S_IFDIR)
+		ezfs_group_count_dir(new_inode, 1);
 
-	write_inode_helper(new_inode, new_ezfs_inode);
-	mark_buffer_dirty(i_bh);
-	new_inode->i_private = (void *) new_ezfs_inode;
+	err = ezfs_add_entry(dir, &dentry->d_name, i_num);
+	if (err) {
+		clear_nlink(new_inode);
+		iget_failed(new_inode);
+		return ERR_PTR(err);
+	}
+	ezfs_name_cache_set(dir, &dentry->d_name, i_num);
 
 	d_instantiate_new(dentry, new_inode);
 	mark_inode_dirty(new_inode);
 
-	strncpy(ezfs_dentry->filename, dentry->d_name.name,
-		strlen(dentry->d_name.name));
-	ezfs_dentry->active = 1;
-	ezfs_dentry->inode_no = i_num;
-	mark_buffer_dirty(dir_bh);
-
 	dir->i_mtime = dir->i_ctime = current_time(dir);
 	if (mode & S_IFDIR)
 		inc_nlink(dir);
 	mark_inode_dirty(dir);
 
-	SETBIT(ezfs_sb->free_inodes, i_idx);
-	if (mode & S_IFDIR)
-		SETBIT(ezfs_sb->free_data_blocks, d_idx);
-	sb_buf_heads = dir->i_sb->s_fs_info;
-	mark_buffer_dirty(sb_buf_heads->sb_bh);
+	/* Both inodes commit along with the new entry. */
+	ezfs_journal_inode(new_inode);
+	ezfs_journal_inode(dir);
+	return new_inode;
 
 out:
-	brelse(dir_bh);
-	mutex_unlock(ezfs_sb->ezfs_lock);
+	if (d_num)
+		ezfs_free_meta_blocks(dir->i_sb, d_num, 1);
+	ezfs_free_ino(dir->i_sb, i_num);
 	return ret;
 }
 
 int
 ezfs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
 {
+	struct ezfs_handle handle;
 	struct inode *inode;
+	int ret = 0, err;
 
+	ezfs_journal_start(dir->i_sb, &handle);
+	handle.sync = IS_DIRSYNC(dir);
 	inode = create_inode_helper(dir, dentry, mode, false);
-
 	if (IS_ERR(inode))
-		return PTR_ERR(inode);
-
-	return 0;
-}
-
-static int
-deactivate_dir_entry(struct buffer_head *bh, const char *filename)
-{
-	struct ezfs_dir_entry *ezfs_dentry =
-	    (struct ezfs_dir_entry *) bh->b_data;
-	int i;
+		ret = PTR_ERR(inode);
+	err = ezfs_journal_stop(&handle);
 
-	for (i = 0; i < EZFS_MAX_CHILDREN; i++) {
-		if (ezfs_dentry[i].active
-		    && strcmp(ezfs_dentry[i].filename, filename) == 0) {
-			memset(&ezfs_dentry[i], 0,
-			       sizeof(struct ezfs_dir_entry));
-			mark_buffer_dirty(bh);
-			return 1;
-		}
-	}
-	return 0;
+	return ret ? ret : err;
 }
 
 int
 ezfs_unlink(struct inode *dir, struct dentry *dentry)
 {
-	int result;
-	uint64_t dir_blk_num = get_ezfs_inode(dir)->dbn;
-	struct buffer_head *bh = sb_bread(dir->i_sb, dir_blk_num);
-
-	if (!bh)
-		return -EIO;
-
-	result = deactivate_dir_entry(bh, dentry->d_name.name);
-	if (result)
-		update_inode_metadata(d_inode(dentry), dir);
-
-	brelse(bh);
+	struct inode *inode = d_inode(dentry);
+	struct ezfs_handle handle;
+	int result, err;
+
+	ezfs_journal_start(dir->i_sb, &handle);
+	handle.sync = IS_DIRSYNC(dir);
+	result = ezfs_delete_entry(dir, &dentry->d_name);
+	if (!result) {
+		ezfs_name_cache_set(dir, &dentry->d_name, 0);
+		update_inode_metadata(inode, dir);
+		ezfs_journal_inode(inode);
+		ezfs_journal_inode(dir);
+	}
+	err = ezfs_journal_stop(&handle);
 
-	return result ? 0 : -ENOENT;
+	return result ? result : err;
 }
 
 int
@@ -717,46 +6499,31 @@ ezfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	return ret;
 }
 
-static int
-ezfs_dir_empty(struct buffer_head *bh)
-{
-	struct ezfs_dir_entry *dentry = (struct ezfs_dir_entry *) bh->b_data;
-	int i;
-
-	for (i = 0; i < EZFS_MAX_CHILDREN; i++) {
-		if (dentry[i].active)
-			return 0;
-	}
-
-	return 1;
-}
-
 int
 ezfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
 	struct inode *dentry_inode = d_inode(dentry);
-	uint64_t dir_blk_num = get_ezfs_inode(dentry_inode)->dbn;
-	struct buffer_head *dir_bh = sb_bread(dir->i_sb, dir_blk_num);
-	int result;
-
-	if (!dir_bh)
-		return -EIO;
+	struct ezfs_handle handle;
+	int result, err;
 
-	if (!ezfs_dir_empty(dir_bh)) {
-		brelse(dir_bh);
+	result = ezfs_dir_empty(dentry_inode);
+	if (result < 0)
+		return result;
+	if (!result)
 		return -ENOTEMPTY;
-	}
 
+	ezfs_journal_start(dir->i_sb, &handle);
+	handle.sync = IS_DIRSYNC(dir);
 	result = ezfs_unlink(dir, dentry);
-	brelse(dir_bh);
-
-	if (result)
-		return result;
-
-	drop_nlink(dentry_inode);
-	drop_nlink(dir);
+	if (!result) {
+		drop_nlink(dentry_inode);
+		drop_nlink(dir);
+		ezfs_journal_inode(dentry_inode);
+		ezfs_journal_inode(dir);
+	}
+	err = ezfs_journal_stop(&handle);
 
-	return 0;
+	return result ? result : err;
 }
 
 int
@@ -772,59 +6539,311 @@ ezfs_sync_inode_to_disk(struct buffer_head *i_bh, struct writeback_control *wbc)
 	return 0;
 }
 
+/* Copies the inode into its slot in the inode table. Only the table block
+ * that holds it is read and written. With a journal the record joins the
+ * running transaction, which is only waited for if the caller needs it on
+ * disk.
+ */
 int
 ezfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
-	struct buffer_head *i_bh = get_ezfs_buffer_head(inode->i_sb);
-	struct ezfs_inode *ez_inode = get_ezfs_inode(inode);
+	struct ezfs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_inode *raw;
+	struct buffer_head *i_bh;
+	uint64_t sequence;
+	bool datasync;
+	int ret;
+
+	i_bh = ezfs_inode_bread(inode->i_sb, inode->i_ino, &raw);
+	if (IS_ERR(i_bh))
+		return PTR_ERR(i_bh);
+
+	/* Cleared before the copy, so a change racing with it sets the bit
+	 * again for the next write.
+	 */
+	datasync = test_and_clear_bit(EZFS_STATE_DATASYNC, &ei->state);
+	mutex_lock(ezfs_map_lock(inode));
+	lock_buffer(i_bh);
+	write_inode_helper(inode, raw);
+	unlock_buffer(i_bh);
+	mutex_unlock(ezfs_map_lock(inode));
+
+	if (!sbi->journal) {
+		ret = ezfs_sync_inode_to_disk(i_bh, wbc);
+		brelse(i_bh);
+		return ret;
+	}
+
+	ezfs_journal_dirty(inode->i_sb, i_bh);
+	brelse(i_bh);
+	sequence = ezfs_journal_running_seq(sbi->journal);
+	WRITE_ONCE(ei->sync_seq, sequence);
+	if (datasync)
+		WRITE_ONCE(ei->datasync_seq, sequence);
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		return ezfs_journal_commit_seq(sbi->journal, sequence);
+	return 0;
+}
+
+void
+ezfs_dirty_inode(struct inode *inode, int flags)
+{
+	if (flags & I_DIRTY_DATASYNC)
+		set_bit(EZFS_STATE_DATASYNC, &EZFS_I(inode)->state);
+}
+
+/* Copies @inode into the inode table as part of the running transaction,
+ * so that it commits with the operation that changed it. Should that fail,
+ * the inode is still dirty and writeback tries again.
+ */
+static void
+ezfs_journal_inode(struct inode *inode)
+{
+	struct writeback_control wbc = { .sync_mode = WB_SYNC_NONE };
+
+	ezfs_write_inode(inode, &wbc);
+}
+
+/* Commits the journal, so that everything done before the call is on
+ * disk, data included.
+ */
+int
+ezfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+
+	if (!sbi->journal)
+		return 0;
+	if (!wait) {
+		mod_delayed_work(system_wq, &sbi->journal->commit_work, 0);
+		return 0;
+	}
+	return ezfs_journal_commit(sbi->journal);
+}
+
+/* Flushes the device's write cache. Flushes go out one at a time, and a
+ * caller that waited behind one which started after it came in is covered
+ * by that one.
+ */
+static int
+ezfs_issue_flush(struct super_block *sb)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	uint64_t seen = READ_ONCE(sbi->flush_started);
+	int ret = 0;
+
+	mutex_lock(&sbi->flush_mutex);
+	if (sbi->flush_done <= seen) {
+		WRITE_ONCE(sbi->flush_started, sbi->flush_started + 1);
+		ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+		if (!ret)
+			sbi->flush_done = sbi->flush_started;
+	}
+	mutex_unlock(&sbi->flush_mutex);
+	return ret;
+}
+
+/* Writes back the range and commits the transaction that has the inode's
+ * record, if it is not committed yet; the commit's flush covers the data
+ * too. Otherwise only data written since the last fsync needs a flush,
+ * and with nothing written there is nothing to do.
+ */
+int
+ezfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct ezfs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	uint64_t sequence;
+	bool flush;
 	int ret;
 
-	ret = ezfs_update_inode_from_vfs(ez_inode, inode);
+	ret = file_write_and_wait_range(file, start, end);
 	if (ret)
 		return ret;
+	flush = test_and_clear_bit(EZFS_STATE_FLUSH, &ei->state);
+
+	if (sbi->journal) {
+		ret = sync_inode_metadata(inode, 0);
+		sequence = datasync ? READ_ONCE(ei->datasync_seq) :
+				      READ_ONCE(ei->sync_seq);
+		if (!ret && sequence > READ_ONCE(sbi->journal->committed))
+			return ezfs_journal_commit_seq(sbi->journal, sequence);
+	} else if (inode->i_state &
+		   (datasync ? I_DIRTY_DATASYNC : I_DIRTY_ALL)) {
+		ret = sync_inode_metadata(inode, 1);
+		flush = true;
+	}
+
+	if (!ret && flush)
+		ret = ezfs_issue_flush(inode->i_sb);
+	return ret;
+}
+
+/* Free blocks come from the allocator's counter, which every allocation
+ * and free keeps up to date; blocks promised to delayed allocation count
+ * as used. Reading it without the lock can be a little stale, which is
+ * fine here.
+ */
+int
+ezfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+	uint64_t free = READ_ONCE(sbi->free_blocks);
+	uint64_t reserved = READ_ONCE(sbi->reserved_blocks);
+
+	buf->f_type = EZFS_MAGIC_NUMBER;
+	buf->f_bsize = EZFS_BLOCK_SIZE;
+	buf->f_blocks = sbi->nr_data_blocks;
+	buf->f_bfree = free - min(free, reserved);
+	buf->f_bavail = buf->f_bfree - min_t(uint64_t, buf->f_bfree,
+					     EZFS_META_RESERVE);
+	buf->f_files = sbi->nr_inodes;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->free_inodes);
+	buf->f_namelen = EZFS_MAX_FILENAME_LENGTH;
+	buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+	return 0;
+}
+
+void
+ezfs_put_super(struct super_block *sb)
+{
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
 
-	return ezfs_sync_inode_to_disk(i_bh, wbc);
+	if (sbi->opt_discard) {
+		cancel_delayed_work_sync(&sbi->discard_work);
+		ezfs_discard_flush(sb);
+		/* What the last checkpoint frees goes back right away. */
+		WRITE_ONCE(sbi->opt_discard, false);
+	}
+	if (sbi->journal)
+		ezfs_journal_shutdown(sbi->journal);
 }
 
+/* Reads the superblock, checks the geometry it describes against the
+ * device and reads in the inode bitmap.
+ */
 static int
 ezfs_init_superblock_buffers(struct super_block *sb,
-			     struct ezfs_sb_buffer_heads *sb_buffers)
+			     struct ezfs_sb_info *sbi)
 {
-	sb_buffers->sb_bh = sb_bread(sb, EZFS_SUPERBLOCK_DATABLOCK_NUMBER);
-	if (!sb_buffers->sb_bh)
-		return -EIO;
+	uint64_t dev_blks =
+	    i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+	struct ezfs_super_block *ezfs_sb;
+	uint64_t i, nblocks, bits, nfree = 0;
+	int ret;
 
-	sb_buffers->i_store_bh =
-	    sb_bread(sb, EZFS_INODE_STORE_DATABLOCK_NUMBER);
-	if (!sb_buffers->i_store_bh) {
-		brelse(sb_buffers->sb_bh);
+	sbi->sb_bh = sb_bread(sb, EZFS_SUPERBLOCK_DATABLOCK_NUMBER);
+	if (!sbi->sb_bh)
 		return -EIO;
+	ezfs_sb = (struct ezfs_super_block *) sbi->sb_bh->b_data;
+
+	if (ezfs_sb->magic != EZFS_MAGIC_NUMBER ||
+	    ezfs_sb->version != EZFS_VERSION) {
+		pr_err("EZFS: not a version %d ezfs filesystem\n",
+		       EZFS_VERSION);
+		return -EINVAL;
 	}
+	if (ezfs_sb->block_size != EZFS_BLOCK_SIZE) {
+		pr_err("EZFS: %s has %llu-byte blocks, this module uses %d\n",
+		       sb->s_id, ezfs_sb->block_size, EZFS_BLOCK_SIZE);
+		return -EINVAL;
+	}
+	nblocks = DIV_ROUND_UP(ezfs_sb->nr_inodes, EZFS_BITS_PER_BLOCK);
+	if (!ezfs_sb->nr_inodes || ezfs_sb->data_blk >= dev_blks ||
+	    ezfs_sb->inode_table_blk +
+	    DIV_ROUND_UP(ezfs_sb->nr_inodes, EZFS_INODES_PER_BLOCK) >
+	    ezfs_sb->data_blk ||
+	    (ezfs_sb->journal_len &&
+	     (ezfs_sb->journal_len < EZFS_JOURNAL_MIN_BLOCKS ||
+	      ezfs_sb->journal_blk + ezfs_sb->journal_len >
+	      ezfs_sb->inode_table_blk)) ||
+	    ezfs_sb->refcount_blk +
+	    DIV_ROUND_UP(ezfs_sb->nr_data_blocks, EZFS_REFS_PER_BLOCK) >
+	    ezfs_sb->journal_blk) {
+		pr_err("EZFS: bad filesystem geometry\n");
+		return -EUCLEAN;
+	}
+
+	/* Replay has to finish before any metadata is read in. */
+	ret = ezfs_journal_load(sb, ezfs_sb);
+	if (ret)
+		return ret;
+
+	sbi->inode_bitmap = kcalloc(nblocks, sizeof(*sbi->inode_bitmap),
+				    GFP_KERNEL);
+	if (!sbi->inode_bitmap)
+		return -ENOMEM;
+	sbi->nr_inodes = ezfs_sb->nr_inodes;
+	for (i = 0; i < nblocks; i++) {
+		sbi->inode_bitmap[i] =
+		    sb_bread(sb, ezfs_sb->inode_bitmap_blk + i);
+		if (!sbi->inode_bitmap[i])
+			return -EIO;
+		bits = min_t(uint64_t, EZFS_BITS_PER_BLOCK,
+			     sbi->nr_inodes - i * EZFS_BITS_PER_BLOCK);
+		nfree += bits -
+			 bitmap_weight((unsigned long *)
+				       sbi->inode_bitmap[i]->b_data, bits);
+	}
+	ret = percpu_counter_init(&sbi->free_inodes, nfree, GFP_KERNEL);
+	if (ret)
+		return ret;
 
+	sbi->inode_table_start = ezfs_sb->inode_table_blk;
+	sbi->data_start = ezfs_sb->data_blk;
+	sbi->refcount_start = ezfs_sb->refcount_blk;
+	/* Only the part of the data area the device actually backs can be
+	 * handed out.
+	 */
+	sbi->nr_data_blocks = min(ezfs_sb->nr_data_blocks,
+				  dev_blks - ezfs_sb->data_blk);
 	return 0;
 }
 
 static int
 ezfs_fill_super(struct super_block *sb, struct fs_context *fc)
 {
-	struct ezfs_sb_buffer_heads *sb_buffers = sb->s_fs_info;
-	struct ezfs_super_block *ez_superblock;
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
 	struct inode *root_inode;
+	int ret;
 
-	sb->s_maxbytes = EZFS_BLOCK_SIZE * EZFS_MAX_DATA_BLKS;
+	sb->s_maxbytes = min_t(loff_t, MAX_LFS_FILESIZE,
+			       EZFS_MAX_LBLK * EZFS_BLOCK_SIZE);
 	sb->s_magic = EZFS_MAGIC_NUMBER;
 	sb->s_op = &ezfs_sb_ops;
 	sb->s_time_gran = 1;
+	sb->s_time_min = 0;
+	sb->s_time_max = (1LL << (32 + 32 - EZFS_NSEC_BITS)) - 1;
+	sb->s_max_links = EZFS_LINK_MAX;
 
-	if (!sb_set_blocksize(sb, EZFS_BLOCK_SIZE)
-	    || ezfs_init_superblock_buffers(sb, sb_buffers))
+	/* Pages are written back and read as single blocks. */
+	BUILD_BUG_ON(EZFS_BLOCK_SIZE != PAGE_SIZE);
+	if (!sb_set_blocksize(sb, EZFS_BLOCK_SIZE))
 		return -EIO;
+	sbi->sb = sb;
+	if (sbi->opt_discard &&
+	    !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		pr_warn("EZFS: %s does not support discard, ignoring it\n",
+			sb->s_id);
+		sbi->opt_discard = false;
+	}
+	ret = ezfs_init_superblock_buffers(sb, sbi);
+	if (ret)
+		return ret;
+
+	sbi->reserved_blocks = 0;
+	ret = ezfs_build_free_space(sb);
+	if (ret)
+		return ret;
 
-	ez_superblock = (struct ezfs_super_block *) sb_buffers->sb_bh->b_data;
-	ez_superblock->ezfs_lock = kzalloc(sizeof(struct mutex), GFP_KERNEL);
-	if (!ez_superblock->ezfs_lock)
+	sbi->name_shrinker.count_objects = ezfs_name_cache_count;
+	sbi->name_shrinker.scan_objects = ezfs_name_cache_scan;
+	sbi->name_shrinker.seeks = DEFAULT_SEEKS;
+	if (register_shrinker(&sbi->name_shrinker))
 		return -ENOMEM;
-	mutex_init(ez_superblock->ezfs_lock);
 
 	root_inode = ezfs_iget(sb, EZFS_ROOT_INODE_NUMBER);
 	if (IS_ERR(root_inode))
@@ -834,34 +6853,76 @@ ezfs_fill_super(struct super_block *sb, struct fs_context *fc)
 	if (!sb->s_root)
 		return -ENOMEM;
 
+	if (sbi->opt_defrag) {
+		sbi->defrag_thread = kthread_run(ezfs_defrag_thread, sb,
+						 "ezfs-defrag/%s", sb->s_id);
+		if (IS_ERR(sbi->defrag_thread)) {
+			ret = PTR_ERR(sbi->defrag_thread);
+			sbi->defrag_thread = NULL;
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
 static void
-ezfs_release_buffers(struct ezfs_sb_buffer_heads *buffers)
+ezfs_release_buffers(struct ezfs_sb_info *sbi)
 {
-	if (buffers->sb_bh) {
-		struct ezfs_super_block *superblock =
-		    (struct ezfs_super_block *) buffers->sb_bh->b_data;
-		if (superblock->ezfs_lock) {
-			mutex_destroy(superblock->ezfs_lock);
-			kfree(superblock->ezfs_lock);
-		}
-		brelse(buffers->sb_bh);
+	uint64_t i;
+
+	if (sbi->sb_bh)
+		brelse(sbi->sb_bh);
+	if (sbi->inode_bitmap) {
+		for (i = 0; i < DIV_ROUND_UP(sbi->nr_inodes,
+					     EZFS_BITS_PER_BLOCK); i++)
+			brelse(sbi->inode_bitmap[i]);
+		kfree(sbi->inode_bitmap);
 	}
-	if (buffers->i_store_bh)
-		brelse(buffers->i_store_bh);
 }
 
 static void
 ezfs_free_fc(struct fs_context *fc)
 {
-	struct ezfs_sb_buffer_heads *buffers = fc->s_fs_info;
+	struct ezfs_sb_info *sbi = fc->s_fs_info;
+
+	if (sbi) {
+		ezfs_release_buffers(sbi);
+		kfree(sbi);
+	}
+}
+
+enum {
+	Opt_defrag,
+	Opt_discard,
+};
+
+static const struct fs_parameter_spec ezfs_param_specs[] = {
+	fsparam_flag("defrag", Opt_defrag),
+	fsparam_flag("discard", Opt_discard),
+	{}
+};
 
-	if (buffers) {
-		ezfs_release_buffers(buffers);
-		kfree(buffers);
+static int
+ezfs_parse_param(struct fs_context *fc, struct fs_parameter *param)
+{
+	struct ezfs_sb_info *sbi = fc->s_fs_info;
+	struct fs_parse_result result;
+	int opt;
+
+	opt = fs_parse(fc, ezfs_param_specs, param, &result);
+	if (opt < 0)
+		return opt;
+
+	switch (opt) {
+	case Opt_defrag:
+		sbi->opt_defrag = true;
+		break;
+	case Opt_discard:
+		sbi->opt_discard = true;
+		break;
 	}
+	return 0;
 }
 
 static int
@@ -871,14 +6932,15 @@ ezfs_get_tree(struct fs_context *fc)
 }
 
 static int
-setup_fs_context(struct fs_context *fc, struct ezfs_sb_buffer_heads *sb_buffers)
+setup_fs_context(struct fs_context *fc, struct ezfs_sb_info *sbi)
 {
 	static const struct fs_context_operations ezfs_context_ops = {
 		.free = ezfs_free_fc,
+		.parse_param = ezfs_parse_param,
 		.get_tree = ezfs_get_tree,
 	};
 
-	fc->s_fs_info = sb_buffers;
+	fc->s_fs_info = sbi;
 	fc->ops = &ezfs_context_ops;
 	return 0;
 }
@@ -886,38 +6948,53 @@ setup_fs_context(struct fs_context *fc, struct ezfs_sb_buffer_heads *sb_buffers)
 int
 ezfs_init_fs_context(struct fs_context *fc)
 {
-	struct ezfs_sb_buffer_heads *sb_buffers =
-	    kzalloc(sizeof(*sb_buffers), GFP_KERNEL);
-	if (!sb_buffers)
+	struct ezfs_sb_info *sbi =
+	    kzalloc(sizeof(*sbi), GFP_KERNEL);
+
+	if (!sbi)
 		return -ENOMEM;
 
-	return setup_fs_context(fc, sb_buffers);
+	spin_lock_init(&sbi->alloc_lock);
+	mutex_init(&sbi->flush_mutex);
+	mutex_init(&sbi->refcount_lock);
+	spin_lock_init(&sbi->name_lock);
+	INIT_LIST_HEAD(&sbi->name_lru);
+	spin_lock_init(&sbi->defrag_lock);
+	spin_lock_init(&sbi->discard_lock);
+	INIT_LIST_HEAD(&sbi->discard_list);
+	INIT_DELAYED_WORK(&sbi->discard_work, ezfs_discard_work);
+
+	return setup_fs_context(fc, sbi);
 }
 
 static void
-cleanup_superblock_resources(struct ezfs_sb_buffer_heads *sb_buffers)
+cleanup_superblock_resources(struct ezfs_sb_info *sbi)
 {
-	if (sb_buffers->sb_bh) {
-		struct ezfs_super_block *sb_data =
-		    (struct ezfs_super_block *) sb_buffers->sb_bh->b_data;
-		if (sb_data->ezfs_lock) {
-			mutex_destroy(sb_data->ezfs_lock);
-			kfree(sb_data->ezfs_lock);
-		}
-		brelse(sb_buffers->sb_bh);
-	}
-
-	if (sb_buffers->i_store_bh)
-		brelse(sb_buffers->i_store_bh);
-
-	kfree(sb_buffers);
+	struct ezfs_deferred_free *df, *next;
+
+	cancel_delayed_work_sync(&sbi->discard_work);
+	list_for_each_entry_safe(df, next, &sbi->discard_list, list)
+		kfree(df);
+	if (sbi->journal)
+		ezfs_journal_free(sbi->journal);
+	ezfs_release_buffers(sbi);
+
+	ezfs_destroy_free_space(sbi);
+	percpu_counter_destroy(&sbi->free_inodes);
+	unregister_shrinker(&sbi->name_shrinker);
+	kfree(sbi);
 }
 
 static void
 ezfs_kill_superblock(struct super_block *sb)
 {
-	cleanup_superblock_resources(sb->s_fs_info);
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
+
+	if (sbi->defrag_thread)
+		kthread_stop(sbi->defrag_thread);
+	/* Evicting the last inodes still frees blocks into our state. */
 	kill_block_super(sb);
+	cleanup_superblock_resources(sbi);
 }
 
 struct file_system_type ezfs_fs_type = {
@@ -930,12 +7007,29 @@ struct file_system_type ezfs_fs_type = {
 static int __init
 init_ezfs_fs(void)
 {
-	int ret = register_filesystem(&ezfs_fs_type);
+	int ret;
 
-	if (likely(ret == 0))
+	ezfs_inode_cachep = kmem_cache_create("ezfs_inode_cache",
+					      sizeof(struct ezfs_inode_info), 0,
+					      SLAB_RECLAIM_ACCOUNT |
+					      SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+					      ezfs_inode_init_once);
+	if (!ezfs_inode_cachep)
+		return -ENOMEM;
+	ezfs_end_io_wq = alloc_workqueue("ezfs-end-io", WQ_MEM_RECLAIM, 0);
+	if (!ezfs_end_io_wq) {
+		kmem_cache_destroy(ezfs_inode_cachep);
+		return -ENOMEM;
+	}
+
+	ret = register_filesystem(&ezfs_fs_type);
+	if (likely(ret == 0)) {
 		pr_info("EZFS registered\n");
-	else
+	} else {
 		pr_err("Failed to register EZFS: %d\n", ret);
+		destroy_workqueue(ezfs_end_io_wq);
+		kmem_cache_destroy(ezfs_inode_cachep);
+	}
 	return ret;
 }
 
@@ -948,6 +7042,11 @@ exit_ezfs_fs(void)
 		pr_info("EZFS unregistered\n");
 	else
 		pr_err("Failed to unregister EZFS: %d\n", ret);
+
+	/* Inodes are freed after an RCU grace period. */
+	rcu_barrier();
+	destroy_workqueue(ezfs_end_io_wq);
+	kmem_cache_destroy(ezfs_inode_cachep);
 }
 
 module_init(init_ezfs_fs);
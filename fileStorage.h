@@ -1,36 +1,116 @@
 #ifndef __EZFS_H__
 #define __EZFS_H__
 
+/* A file's data is described by a list of extents. Each extent maps a run of
+ * logical file blocks onto a run of physically contiguous disk blocks, so a
+ * file that grows can pick up a new run somewhere else on disk instead of
+ * being copied as a whole to a bigger hole.
+ */
+struct ezfs_extent {
+	uint32_t e_lblk;  /* First logical block covered by this extent */
+	uint16_t e_len;   /* Number of blocks in the run */
+	uint16_t e_flags; /* EZFS_EXT_* */
+	uint64_t e_pblk;  /* First physical block of the run */
+};
+
+#define EZFS_MAX_EXTENT_LEN 0xffff
+#define EZFS_MAX_LBLK 0xffffffffULL /* one past the last logical block */
+
+/* The blocks are allocated (by fallocate) but were never written. They read
+ * back as zeros without any I/O.
+ */
+#define EZFS_EXT_UNWRITTEN 0x1
+
+/* The extent is one compressed cluster. Its e_len logical blocks are kept,
+ * behind a struct ezfs_cluster_header, in the number of disk blocks found
+ * in the top byte of e_flags, which is fewer.
+ */
+#define EZFS_EXT_COMPRESSED 0x2
+#define EZFS_EXT_PHYS_SHIFT 8
+
+/* The extent's blocks were shared with another file by a clone, and some
+ * may still be. Writes to them go to new blocks.
+ */
+#define EZFS_EXT_SHARED 0x4
+
+/* Compressed files are written back in aligned clusters of this many
+ * blocks.
+ */
+#define EZFS_CLUSTER_BLOCKS 4
+#define EZFS_CLUSTER_SIZE (EZFS_CLUSTER_BLOCKS * EZFS_BLOCK_SIZE)
+
+struct ezfs_cluster_header {
+	uint16_t algo;     /* EZFS_COMPRESS_* */
+	uint16_t __reserved;
+	uint32_t len;      /* compressed bytes following the header */
+};
+
+#define EZFS_COMPRESS_LZ4 1
+
+/* The first few extents are kept inline in the inode. Once those are used
+ * up, the rest spill into a chain of extent blocks.
+ */
+#define EZFS_INLINE_EXTENTS 4
+
+/* Seconds are 34 bits wide: the low 32 bits are in sec and the high 2 in
+ * the top of nsec, which only needs 30.
+ */
+struct ezfs_timestamp {
+	uint32_t sec;
+	uint32_t nsec;
+};
+
+#define EZFS_NSEC_BITS 30
+#define EZFS_NSEC_MASK ((1U << EZFS_NSEC_BITS) - 1)
+
+/* A regular file no bigger than this keeps its data in the inode itself,
+ * with no data block at all, as long as it never grew past it.
+ */
+#define EZFS_INLINE_DATA_SIZE 120
+
+/* ezfs_inode.flags */
+#define EZFS_INODE_INLINE_DATA 0x1 /* data is in inline_data, no extents */
+#define EZFS_INODE_COMPRESS    0x2 /* compressed clusters; inherited */
+
 /* An inode contains metadata about the file it represents. This includes
  * permissions, access times, size, etc. All the stuff you can see with the ls
  * command is taken right from the inode.
  *
- * Note that the inode does not contain the file data itself. But it must
- * contain information to find the file data. In our case, we store the block
- * number where the data is.
+ * The inode does not contain the file data itself, except for tiny files.
+ * But it must contain information to find the file data. In our case, we
+ * store the extents that map the file's blocks to disk blocks.
  */
 struct ezfs_inode {
 	/* What kind of file this is (i.e. directory, plain old file, etc). */
-	mode_t mode;
+	uint16_t mode;
+	uint16_t nlink;
 
-	uid_t uid;
-	gid_t gid;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nblocks; /* number of blocks, extent blocks included */
 
-	struct timespec64 i_atime; /* Access time */
-	struct timespec64 i_mtime; /* Modified time */
-	struct timespec64 i_ctime; /* Change time */
-	unsigned int nlink;
-	unsigned long access_flags;
-	uint64_t dbn;
+	struct ezfs_timestamp i_atime; /* Access time */
+	struct ezfs_timestamp i_mtime; /* Modified time */
+	struct ezfs_timestamp i_ctime; /* Change time */
 
 	/* A file can be a directory or a plain file. In the latter case
-	 * we store the file size. Each directory's size is 4096.
+	 * we store the file size. A directory's size is a multiple of the
+	 * block size.
 	 */
 	uint64_t file_size;
 
-	uint64_t nblocks; /* number of blocks */
+	uint32_t nextents; /* number of extents in use, inline ones included */
+	uint32_t group;    /* allocation group the inode's blocks go to */
+	uint64_t extent_blk; /* first extent block, 0 if none */
+	struct ezfs_extent extents[EZFS_INLINE_EXTENTS];
+
+	uint32_t flags;      /* EZFS_INODE_* */
+	uint32_t __reserved;
+	uint8_t inline_data[EZFS_INLINE_DATA_SIZE];
 };
 
+#define EZFS_LINK_MAX 0xffff
+
 /* Directories store a mapping from filename -> inode number. Each of these
  * mappings is a single "directory entry" and is represented by the struct
  * below.
@@ -48,13 +128,19 @@ struct ezfs_dir_entry {
 #define CLEARBIT(A, k)   (A[((k) / 32)] &= ~(1 << ((k) % 32)))
 #define IS_SET(A, k)     (A[((k) / 32)] &   (1 << ((k) % 32)))
 
-/* This macro will declare a bit vector. I use it to declare an array of the
- * right size inside the ezfs_sb.
- */
-#define DECLARE_BIT_VECTOR(name, size) uint32_t name[(size / 32) + 1];
-
 #define EZFS_MAGIC_NUMBER  0x00004118
+#define EZFS_VERSION 8
+
+/* The block size the module is built for, which has to be the page size of
+ * the kernel it runs on; see the Makefile. The formatter takes any size in
+ * the supported range and records it in the superblock.
+ */
+#ifndef EZFS_BLOCK_SIZE
 #define EZFS_BLOCK_SIZE 4096
+#endif
+#define EZFS_MIN_BLOCK_SIZE 4096
+#define EZFS_MAX_BLOCK_SIZE 65536
+#define EZFS_BLOCK_SECTORS (EZFS_BLOCK_SIZE / 512)
 
 
 /* Inode numbers start from 1. It's because if a function is supposed to
@@ -62,29 +148,82 @@ struct ezfs_dir_entry {
  */
 #define EZFS_ROOT_INODE_NUMBER 1
 
-/*  Data block #  |  Contents
- * -------------------------------
- *	0         |  Superblock
- *	1         |  Inode Store
- *	2         |  Root Data Block
+/*  Block #          |  Contents
+ * ----------------------------------------------
+ *	0            |  Superblock
+ *	inode_bitmap |  Inode bitmap, one bit per inode
+ *	data_bitmap  |  Data bitmap, one bit per data block
+ *	group_desc   |  Allocation group descriptors
+ *	refcount     |  Reference counts, one per data block
+ *	journal      |  Metadata journal, if journal_len is not 0
+ *	inode_table  |  Inode table
+ *	data         |  Data blocks, the root directory's first
+ *
+ * Every region but the superblock is sized at format time and located
+ * through the superblock.
  */
 #define EZFS_SUPERBLOCK_DATABLOCK_NUMBER 0
-#define EZFS_INODE_STORE_DATABLOCK_NUMBER 1
-#define EZFS_ROOT_DATABLOCK_NUMBER 2
 
-/* The inode store is one 4096 byte-block. The following macro calculates
- * how many ezfs_inodes we can shove in the inode store.
- */
-#define EZFS_MAX_INODES (EZFS_BLOCK_SIZE / sizeof(struct ezfs_inode))
-#define EZFS_MAX_DATA_BLKS EZFS_MAX_INODES * 512
+#define EZFS_BITS_PER_BLOCK (EZFS_BLOCK_SIZE * 8)
+#define EZFS_INODES_PER_BLOCK (EZFS_BLOCK_SIZE / sizeof(struct ezfs_inode))
 #define EZFS_MAX_CHILDREN ((loff_t) (EZFS_BLOCK_SIZE / sizeof(struct ezfs_dir_entry)))
 
+/* An extent block holds the extents that did not fit inline in the inode.
+ * Extent blocks are chained through ->next; slot i of the inode's extent
+ * list lives in the ((i - EZFS_INLINE_EXTENTS) / EZFS_EXTENTS_PER_BLOCK)-th
+ * block of the chain.
+ */
+#define EZFS_EXTENTS_PER_BLOCK \
+	((EZFS_BLOCK_SIZE - 2 * sizeof(uint64_t)) / sizeof(struct ezfs_extent))
+struct ezfs_extent_block {
+	uint64_t next; /* next extent block, 0 ends the chain */
+	uint64_t __reserved;
+	struct ezfs_extent extents[EZFS_EXTENTS_PER_BLOCK];
+};
+
+/* A directory starts out as a single block of directory entries. When that
+ * block fills up, the directory is indexed by name hash: its logical block 0
+ * becomes the root of a small tree of index nodes and the entries move to
+ * leaf blocks, each laid out like a single-block directory. Below the root
+ * there is at most one level of index nodes.
+ *
+ * An index node overlays a directory entry that is neither free nor active,
+ * so the two kinds of block can be told apart by their first entry.
+ */
+#define EZFS_DX_NODE 2 /* ->active of the first entry of an index node */
+#define EZFS_DX_MAX_LEVELS 1
+#define EZFS_DX_HASH_SEED 0x455a4653
+
+struct ezfs_dx_entry {
+	uint32_t hash; /* lowest name hash found below this entry */
+	uint32_t lblk; /* logical block of the child node or leaf */
+};
+
+#define EZFS_DX_ENTRIES \
+	((EZFS_BLOCK_SIZE - 2 * sizeof(uint64_t)) / sizeof(struct ezfs_dx_entry))
+struct ezfs_dx_node {
+	uint64_t __zero;   /* overlays ezfs_dir_entry.inode_no */
+	uint8_t marker;    /* EZFS_DX_NODE, overlays ezfs_dir_entry.active */
+	uint8_t levels;    /* root only: index levels below the root */
+	uint16_t count;    /* entries in use, sorted by hash */
+	uint32_t __reserved;
+	struct ezfs_dx_entry entries[EZFS_DX_ENTRIES];
+};
+
 #define EZFS_SB_MEMBERS uint64_t version;\
 	uint64_t magic;\
 	uint64_t disk_blks;\
-	DECLARE_BIT_VECTOR(free_inodes, EZFS_MAX_INODES);\
-	DECLARE_BIT_VECTOR(free_data_blocks, EZFS_MAX_DATA_BLKS);\
-	struct mutex *ezfs_lock;
+	uint64_t nr_inodes;\
+	uint64_t nr_data_blocks;\
+	uint64_t inode_bitmap_blk;\
+	uint64_t data_bitmap_blk;\
+	uint64_t group_desc_blk;\
+	uint64_t journal_blk;\
+	uint64_t journal_len;\
+	uint64_t inode_table_blk;\
+	uint64_t data_blk;\
+	uint64_t refcount_blk;\
+	uint64_t block_size;
 
 /* This is the superblock, as it will be serialized onto the disk. */
 struct ezfs_super_block {
@@ -94,12 +233,374 @@ struct ezfs_super_block {
 	char __padding__[EZFS_BLOCK_SIZE - sizeof(struct {EZFS_SB_MEMBERS})];
 };
 
-/* In the VFS superblock, we need to have a pointer to the buffer_heads for the
- * inode store and superblock so that we can mark them as dirty when they're
- * modified inode.
+/* The data area is split into allocation groups of this many blocks, the
+ * last one possibly shorter. A new directory is placed in a group of its
+ * own choosing and the files in it follow it there.
+ */
+#define EZFS_BLOCKS_PER_GROUP 1024
+
+/* What a group remembers across mounts. Its free space is read back from
+ * the data bitmap instead.
+ */
+struct ezfs_group_desc {
+	uint32_t ndirs;  /* directories placed in the group */
+	uint32_t __reserved;
+};
+
+#define EZFS_DESCS_PER_BLOCK \
+	(EZFS_BLOCK_SIZE / sizeof(struct ezfs_group_desc))
+
+/* The refcount table counts the owners each data block has beyond the
+ * first, so that a freshly formatted, all-zero table shares nothing.
+ */
+#define EZFS_REFS_PER_BLOCK (EZFS_BLOCK_SIZE / sizeof(uint16_t))
+#define EZFS_REF_MAX 0xffff
+
+/* The metadata journal is a superblock followed by a log of transactions.
+ * A transaction is one or more descriptor blocks, each followed by copies
+ * of the blocks it lists, and then a commit block. The log starts over at
+ * journal block 1 each time it is checkpointed, which is when everything
+ * in it has reached its home location.
+ */
+#define EZFS_JOURNAL_MAGIC 0x455a4a4c
+#define EZFS_JOURNAL_DESCRIPTOR 1
+#define EZFS_JOURNAL_COMMIT 2
+/* A running transaction may fill half the log, less the journal
+ * superblock. At this size that leaves room for 15 operations of
+ * EZFS_JOURNAL_CREDITS at once.
+ */
+#define EZFS_JOURNAL_MIN_BLOCKS 1024
+
+struct ezfs_journal_super {
+	uint32_t magic;
+	uint32_t __reserved;
+	uint64_t sequence; /* of the transaction at journal block 1 */
+};
+
+struct ezfs_journal_header {
+	uint32_t magic;
+	uint32_t type;     /* EZFS_JOURNAL_DESCRIPTOR or EZFS_JOURNAL_COMMIT */
+	uint64_t sequence;
+};
+
+#define EZFS_JOURNAL_DESC_BLOCKS \
+	((EZFS_BLOCK_SIZE - sizeof(struct ezfs_journal_header) - \
+	  2 * sizeof(uint32_t)) / sizeof(uint64_t))
+struct ezfs_journal_desc {
+	struct ezfs_journal_header h;
+	uint32_t count;    /* blocks listed, and following this one */
+	uint32_t __reserved;
+	uint64_t blocknr[EZFS_JOURNAL_DESC_BLOCKS]; /* their home locations */
+};
+
+struct ezfs_journal_commit_block {
+	struct ezfs_journal_header h;
+	uint32_t nr_blocks; /* log blocks of the transaction before this one */
+	uint32_t checksum;  /* crc32 of those blocks */
+};
+
+/* EZFS_IOC_DEFRAG rewrites the fragmented parts of a file that lie inside
+ * [start, start + len) as contiguous runs; len 0 means to the end of the
+ * file. The ioctl fills in what it did.
+ */
+struct ezfs_defrag_range {
+	uint64_t start;
+	uint64_t len;
+	uint64_t blocks_moved;   /* out */
+	uint64_t extents_merged; /* out */
+};
+
+/* Totals since mount, of the ioctl and the background thread together. */
+struct ezfs_defrag_stats {
+	uint64_t files_scanned;
+	uint64_t files_defragged;
+	uint64_t extents_merged;
+	uint64_t blocks_moved;
+	uint64_t runs_skipped; /* no room for a contiguous run, or file busy */
+};
+
+#define EZFS_IOC_DEFRAG _IOWR('z', 1, struct ezfs_defrag_range)
+#define EZFS_IOC_DEFRAG_STATS _IOR('z', 2, struct ezfs_defrag_stats)
+
+/* Blocks that delayed-allocation reservations may not touch, so that
+ * writeback can always allocate the extent blocks it needs.
  */
-struct ezfs_sb_buffer_heads {
+#define EZFS_META_RESERVE 8
+
+#ifdef __KERNEL__
+/* Where BH_Delay buffers point until writeback gives them a real block. */
+#define EZFS_DELAYED_BLOCK (~(sector_t) 0)
+
+/* Pages writeback keeps locked while it allocates one run of delayed
+ * blocks.
+ */
+#define EZFS_DELAYED_RUN_PAGES 2048
+
+/* Background defragmentation: inode numbers looked at per pass, the time
+ * between passes, and the pause after each run that was moved.
+ */
+#define EZFS_DEFRAG_BATCH 256
+#define EZFS_DEFRAG_INTERVAL (30 * HZ)
+#define EZFS_DEFRAG_PAUSE_MS 20
+
+/* Extents merged into one run at most, so that the run's map change fits
+ * one transaction.
+ */
+#define EZFS_DEFRAG_RUN_EXTENTS 16
+
+/* Freed blocks wait this long to be discarded with whatever is freed after
+ * them, unless this many pile up first.
+ */
+#define EZFS_DISCARD_INTERVAL HZ
+#define EZFS_DISCARD_BATCH 8192
+
+/* copy_file_range() moves what it cannot share through a buffer this big. */
+#define EZFS_COPY_CHUNK (1024 * 1024)
+
+/* A run of free data blocks in the in-memory free space index. It sits in
+ * two rbtrees at once, one ordered by start and one by length.
+ */
+struct ezfs_free_extent {
+	struct rb_node by_start;
+	struct rb_node by_len;
+	uint64_t start; /* data bitmap index of the first block */
+	uint64_t len;
+};
+
+/* A name cached for a directory. ino 0 records that the name is not there.
+ * Entries live in their directory's hash table and on the sb-wide LRU.
+ */
+struct ezfs_name_entry {
+	struct hlist_node node;
+	struct list_head lru;
+	uint64_t ino;
+	uint32_t hash;
+	uint8_t len;
+	char name[];
+};
+
+#define EZFS_NAME_CACHE_BITS 6
+struct ezfs_dir_cache {
+	DECLARE_HASHTABLE(names, EZFS_NAME_CACHE_BITS);
+};
+
+/* An allocation group, with its own lock and its own index of the free data
+ * blocks in [start, start + len). Block numbers are data bitmap indices;
+ * groups are long-aligned, so their bitmap words do not overlap, and never
+ * straddle a bitmap block.
+ */
+struct ezfs_group {
+	struct mutex lock;
+	uint64_t start;
+	uint64_t len;
+	uint64_t free_blocks;
+
+	struct buffer_head *bitmap_bh; /* data bitmap block of the group */
+	struct buffer_head *desc_bh;
+	struct ezfs_group_desc *desc;
+
+	struct rb_root free_by_start; /* struct ezfs_free_extent, by start */
+	struct rb_root free_by_len;   /* the same extents, by length */
+};
+
+/* The in-memory inode. Its extent list is decoded once, when the inode is
+ * read: map holds every slot in on-disk order, spilled ones included, so
+ * mapping a block needs no I/O, and order lists the slots by e_lblk, so
+ * finding one is a binary search. Changes are written through to the
+ * extent blocks as they are made; inline slots reach the disk with the
+ * inode.
+ */
+struct ezfs_inode_info {
+	struct mutex map_lock;   /* serializes changes to the extent list */
+	unsigned int nextents;
+	unsigned int map_cap;    /* slots map has room for */
+	struct ezfs_extent *map; /* inline_map until it outgrows it */
+	unsigned int *order;     /* inline_order until then */
+	struct ezfs_extent inline_map[EZFS_INLINE_EXTENTS];
+	unsigned int inline_order[EZFS_INLINE_EXTENTS];
+	uint64_t extent_blk;
+	uint32_t group;
+
+	/* Where the last allocation ended, the goal for the next one. */
+	sector_t next_lblk;
+	uint64_t next_pblk;
+
+	struct ezfs_dir_cache *dir_cache; /* directories only */
+
+	/* Journal transactions that last took the inode record, and the
+	 * last that took a change fdatasync has to wait for.
+	 */
+	uint64_t sync_seq;
+	uint64_t datasync_seq;
+	unsigned long state;     /* EZFS_STATE_* bits */
+
+	/* Written buffers over unwritten blocks, linked through b_private,
+	 * for io_work to convert; see ezfs_end_buffer_write().
+	 */
+	spinlock_t io_lock;
+	struct buffer_head *io_done;
+	struct work_struct io_work;
+
+	/* Clusters of a compressed file that hold a reservation of
+	 * EZFS_CLUSTER_BLOCKS, by cluster number.
+	 */
+	struct xarray cluster_resv;
+
+	struct inode vfs_inode;
+};
+
+/* Bits in ezfs_inode_info.state */
+#define EZFS_STATE_DATASYNC    0 /* dirtied in a way fdatasync must see */
+#define EZFS_STATE_FLUSH       1 /* data written since fsync last flushed */
+#define EZFS_STATE_INLINE_DATA 2 /* cleared only with page 0 locked */
+#define EZFS_STATE_COMPRESS    3 /* changed only while the file is empty */
+
+static inline struct ezfs_inode_info *
+EZFS_I(struct inode *inode)
+{
+	return container_of(inode, struct ezfs_inode_info, vfs_inode);
+}
+
+enum ezfs_bh_state_bits {
+	/* a metadata buffer in the running transaction */
+	BH_EzfsJournal = BH_PrivateStart,
+	/* a data buffer whose block is converted once its write completes */
+	BH_EzfsUnwritten,
+};
+BUFFER_FNS(EzfsJournal, ezfs_journal)
+BUFFER_FNS(EzfsUnwritten, ezfs_unwritten)
+
+/* A metadata buffer the journal holds on to, from the time it joins a
+ * transaction until that has been checkpointed.
+ */
+struct ezfs_jblock {
+	struct list_head list;
+	struct buffer_head *bh; /* the home buffer, referenced */
+	struct page *copy;      /* its contents as of the commit */
+};
+
+/* Metadata blocks freed while their old contents may still be in the log.
+ * They are handed out again once the log has been checkpointed.
+ */
+struct ezfs_deferred_free {
+	struct list_head list;
+	uint64_t start;
+	uint64_t count;
+};
+
+/* Log I/O in flight. */
+struct ezfs_jio {
+	atomic_t pending;
+	int error;
+	struct completion done;
+};
+
+/* Blocks an operation may dirty at most, and how long a transaction stays
+ * open for more operations to join it. Operations that free, share or
+ * move more data blocks than EZFS_JOURNAL_STEP_BLOCKS split the work over
+ * several transactions, which keeps the bitmap and refcount blocks they
+ * dirty within the credits.
+ */
+#define EZFS_JOURNAL_CREDITS 32
+#define EZFS_JOURNAL_STEP_BLOCKS (8 * EZFS_REFS_PER_BLOCK)
+#define EZFS_JOURNAL_INTERVAL (5 * HZ)
+#define EZFS_JOURNAL_DEFER_MAX 1024
+
+/* Operations run inside a handle, which holds updates shared. A commit
+ * takes it exclusively, so a transaction always closes between operations,
+ * and every operation that ran since the last commit goes out with it.
+ */
+struct ezfs_journal {
+	struct super_block *sb;
+	uint64_t first;           /* block of the journal superblock */
+	uint64_t len;             /* journal blocks, the superblock included */
+	unsigned int max_running; /* blocks a transaction should stay under */
+
+	struct rw_semaphore updates;
+	struct mutex commit_mutex;
+
+	/* Protects the running transaction. */
+	spinlock_t lock;
+	uint64_t sequence;        /* of the running transaction */
+	struct list_head running; /* struct ezfs_jblock */
+	unsigned int nr_running;
+	unsigned int nr_reserved; /* credits of the handles in progress */
+	struct list_head running_frees; /* struct ezfs_deferred_free */
+
+	/* The rest is only touched under commit_mutex. */
+	uint64_t committed;       /* last committed sequence */
+	int error;                /* the commit failed, the journal aborted */
+	uint64_t head;            /* next free log block */
+	struct list_head checkpoint;      /* committed, not at home yet */
+	struct list_head committed_frees; /* released at the checkpoint */
+	uint64_t nr_deferred;
+	struct page *scratch;     /* journal superblock and replay I/O */
+
+	struct delayed_work commit_work;
+};
+
+/* A journal operation in progress; see ezfs_journal_start(). */
+struct ezfs_handle {
+	struct ezfs_journal *journal;
+	bool nested;
+	bool sync;                /* commit before returning */
+	unsigned int nofs_flags;
+};
+
+/* The in-memory superblock. The superblock and the bitmaps stay in
+ * memory, so that we can mark them as dirty when they're modified. Inode
+ * table blocks are only read while an inode in them is read or written.
+ *
+ * Lock order: a directory's i_rwsem, then a page lock, then a journal
+ * handle, then an inode's map lock, then a group's lock, then alloc_lock.
+ * The name cache lock nests inside all of them. Nobody holding a handle
+ * waits for a page lock or for page writeback.
+ */
+struct ezfs_sb_info {
 	struct buffer_head *sb_bh;
-	struct buffer_head *i_store_bh;
+	struct buffer_head **inode_bitmap; /* one per inode bitmap block */
+	uint64_t nr_inodes;
+	uint64_t inode_table_start;
+	uint64_t data_start;      /* block of data bitmap bit 0 */
+	uint64_t refcount_start;
+	struct mutex refcount_lock; /* serializes refcount table updates */
+
+	/* Protects the inode bitmap and the counters below. */
+	spinlock_t alloc_lock;
+	uint64_t ino_hint;        /* where to look for a free inode next */
+	uint64_t nr_data_blocks;  /* data blocks backed by the device */
+	uint64_t free_blocks;     /* free data blocks nobody has claimed */
+	uint64_t reserved_blocks; /* promised to delayed allocation */
+	struct percpu_counter free_inodes; /* not under alloc_lock */
+
+	struct ezfs_group *groups;
+	unsigned int nr_groups;
+
+	struct ezfs_journal *journal; /* NULL if the filesystem has none */
+
+	/* Serializes cache flushes issued by fsync, so that callers waiting
+	 * behind one can share the next.
+	 */
+	struct mutex flush_mutex;
+	uint64_t flush_started;
+	uint64_t flush_done;
+
+	spinlock_t name_lock;         /* protects the tables and the LRU */
+	struct list_head name_lru;    /* struct ezfs_name_entry, newest first */
+	unsigned long nr_names;
+	struct shrinker name_shrinker;
+
+	bool opt_defrag;                /* "defrag" mount option */
+	struct task_struct *defrag_thread;
+	uint64_t defrag_cursor;         /* next inode index it looks at */
+	spinlock_t defrag_lock;         /* protects defrag_stats */
+	struct ezfs_defrag_stats defrag_stats;
+	bool opt_discard;               /* "discard" mount option */
+	spinlock_t discard_lock;        /* protects the two below */
+	struct list_head discard_list;  /* struct ezfs_deferred_free */
+	uint64_t nr_discard;            /* blocks queued on discard_list */
+	struct delayed_work discard_work;
+	struct super_block *sb;
 };
+#endif /* __KERNEL__ */
 #endif /* ifndef __EZFS_H__ */
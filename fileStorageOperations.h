@@ -11,6 +11,14 @@ struct page;
 struct writeback_control;
 struct address_space;
 struct super_block;
+struct readahead_control;
+struct iomap;
+struct kiocb;
+struct iov_iter;
+struct kstatfs;
+struct vm_area_struct;
+struct fiemap_extent_info;
+struct iattr;
 
 // Function prototypes
 struct dentry *ezfs_lookup(struct inode *parent, struct dentry *child_dentry, unsigned int flags);
@@ -18,28 +26,74 @@ int ezfs_create(struct inode *parent, struct dentry *dentry, umode_t mode, bool
 int ezfs_unlink(struct inode *dir, struct dentry *dentry);
 int ezfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
 int ezfs_rmdir(struct inode *dir, struct dentry *dentry);
-void setup_inode(struct inode *inode, struct inode *parent, umode_t mode, struct ezfs_inode *ez_inode_data, int dbn);
+int ezfs_setattr(struct dentry *dentry, struct iattr *iattr);
 void update_parent_directory_times(struct inode *parent);
 void update_directory_inode(struct inode *dir, bool directory_flag, struct buffer_head *inode_bh, struct ezfs_super_block *sb_data, int inode_idx, int data_blk_idx);
+struct inode *ezfs_alloc_inode(struct super_block *sb);
+void ezfs_free_inode(struct inode *inode);
 void ezfs_evict_inode(struct inode *inode);
 int ezfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+void ezfs_dirty_inode(struct inode *inode, int flags);
+static void ezfs_journal_inode(struct inode *inode);
+int ezfs_sync_fs(struct super_block *sb, int wait);
+void ezfs_put_super(struct super_block *sb);
+int ezfs_statfs(struct dentry *dentry, struct kstatfs *buf);
+int ezfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 int ezfs_iterate(struct file *filp, struct dir_context *ctx);
 int ezfs_readpage(struct file *file, struct page *page);
+void ezfs_readahead(struct readahead_control *rac);
 int ezfs_writepage(struct page *page, struct writeback_control *wbc);
+int ezfs_writepages(struct address_space *mapping, struct writeback_control *wbc);
+void ezfs_invalidatepage(struct page *page, unsigned int offset, unsigned int length);
 int ezfs_write_begin(struct file *file, struct address_space *mapping,
                      loff_t pos, unsigned int len, unsigned int flags,
                      struct page **pagep, void **fsdata);
 int ezfs_write_end(struct file *file, struct address_space *mapping,
                    loff_t pos, unsigned len, unsigned copied,
                    struct page *page, void *fsdata);
+long ezfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+ssize_t ezfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t ezfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from);
+int ezfs_file_mmap(struct file *file, struct vm_area_struct *vma);
+loff_t ezfs_file_llseek(struct file *file, loff_t offset, int whence);
+int ezfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+                u64 start, u64 len);
+long ezfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+loff_t ezfs_remap_file_range(struct file *file_in, loff_t pos_in,
+                             struct file *file_out, loff_t pos_out,
+                             loff_t len, unsigned int remap_flags);
+ssize_t ezfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                             struct file *file_out, loff_t pos_out,
+                             size_t len, unsigned int flags);
 sector_t ezfs_bmap(struct address_space *mapping, sector_t block);
-static int ezfs_move_block(unsigned long base_offset, unsigned long src_offset,
-                           unsigned long dest_offset, struct super_block *sb,
-                           struct address_space *map);
 static int ezfs_get_block(struct inode *inode, sector_t block,
                           struct buffer_head *bh_result, int create);
+static int ezfs_alloc_delayed(struct address_space *mapping, pgoff_t index,
+                              pgoff_t end);
+static int ezfs_convert_unwritten(struct inode *inode, sector_t from,
+                                  sector_t to);
+static void ezfs_end_io_work(struct work_struct *work);
+static void ezfs_release_clusters(struct inode *inode, unsigned long from);
+static int ezfs_readpage_compressed(struct page *page);
+static void ezfs_readahead_compressed(struct readahead_control *rac);
+static int ezfs_writepages_compressed(struct address_space *mapping,
+                                      struct writeback_control *wbc);
+static void ezfs_release_reservation(struct super_block *sb, uint64_t count);
+static void ezfs_free_data_blocks(struct super_block *sb, uint64_t pblk,
+                                  uint64_t count);
+static void ezfs_release_data_blocks(struct super_block *sb, uint64_t pblk,
+                                     uint64_t count);
+static struct mutex *ezfs_map_lock(struct inode *inode);
+static inline int ezfs_extent_lookup(struct inode *inode, sector_t lblk,
+                                     struct ezfs_extent *ext,
+                                     unsigned int *idx);
+static int ezfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+                            unsigned int flags, struct iomap *iomap,
+                            struct iomap *srcmap);
+static int ezfs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+                          ssize_t written, unsigned int flags,
+                          struct iomap *iomap);
 struct buffer_head *read_directory_block(struct super_block *sb, uint64_t block_number);
-int find_free_index(uint32_t *bitmap, int max, const char *error_msg);
 struct ezfs_super_block *get_ezfs_superblock(struct super_block *sb);
 
 // File system operations structures
@@ -49,34 +103,55 @@ static const struct inode_operations ezfs_inode_ops = {
     .unlink = ezfs_unlink,
     .mkdir = ezfs_mkdir,
     .rmdir = ezfs_rmdir,
+    .setattr = ezfs_setattr,
+    .fiemap = ezfs_fiemap,
 };
 
 static const struct file_operations ezfs_dir_ops = {
     .owner = THIS_MODULE,
     .iterate_shared = ezfs_iterate,
+    .fsync = ezfs_fsync,
+    .unlocked_ioctl = ezfs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
 static const struct file_operations ezfs_file_ops = {
     .owner = THIS_MODULE,
-    .llseek = generic_file_llseek,
-    .read_iter = generic_file_read_iter,
-    .write_iter = generic_file_write_iter,
-    .mmap = generic_file_mmap,
+    .llseek = ezfs_file_llseek,
+    .read_iter = ezfs_file_read_iter,
+    .write_iter = ezfs_file_write_iter,
+    .mmap = ezfs_file_mmap,
     .splice_read = generic_file_splice_read,
-    .fsync = generic_file_fsync,
+    .splice_write = iter_file_splice_write,
+    .fsync = ezfs_fsync,
+    .fallocate = ezfs_fallocate,
+    .remap_file_range = ezfs_remap_file_range,
+    .copy_file_range = ezfs_copy_file_range,
+    .unlocked_ioctl = ezfs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
 static const struct address_space_operations ezfs_aops = {
     .readpage = ezfs_readpage,
+    .readahead = ezfs_readahead,
     .writepage = ezfs_writepage,
+    .writepages = ezfs_writepages,
+    .invalidatepage = ezfs_invalidatepage,
     .write_begin = ezfs_write_begin,
     .write_end = ezfs_write_end,
     .bmap = ezfs_bmap,
+    .direct_IO = noop_direct_IO,
 };
 
 static struct super_operations ezfs_sb_ops = {
+    .alloc_inode = ezfs_alloc_inode,
+    .free_inode = ezfs_free_inode,
     .evict_inode = ezfs_evict_inode,
+    .dirty_inode = ezfs_dirty_inode,
     .write_inode = ezfs_write_inode,
+    .sync_fs = ezfs_sync_fs,
+    .put_super = ezfs_put_super,
+    .statfs = ezfs_statfs,
 };
 
 #endif /* __EZFS_OPS_H__ */
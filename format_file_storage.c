@@ -8,9 +8,6 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-/* These are the same on a 64-bit architecture */
-#define timespec64 timespec
-
 #include "fileStorage.h"
 
 void
@@ -27,13 +24,41 @@ void
 inode_reset(struct ezfs_inode *inode)
 {
 	struct timespec current_time;
+	struct ezfs_timestamp now;
 
 	memset(inode, 0, sizeof(*inode));
 	memset(&current_time, 0, sizeof(current_time));
 	inode->uid = 1000;
 	inode->gid = 1000;
 	clock_gettime(CLOCK_REALTIME, &current_time);
-	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time;
+	now.sec = (uint32_t) current_time.tv_sec;
+	now.nsec = current_time.tv_nsec |
+		   (uint32_t) ((uint64_t) current_time.tv_sec >> 32) <<
+		   EZFS_NSEC_BITS;
+	inode->i_atime = inode->i_mtime = inode->i_ctime = now;
+}
+
+/* Every file the formatter lays down is one contiguous run on disk, so a
+ * single inline extent covers it.
+ */
+void
+inode_set_extent(struct ezfs_inode *inode, uint64_t pblk, uint32_t nblocks)
+{
+	inode->nextents = 1;
+	inode->extents[0].e_lblk = 0;
+	inode->extents[0].e_len = nblocks;
+	inode->extents[0].e_pblk = pblk;
+	inode->nblocks = nblocks;
+}
+
+/* Small files go in the inode itself and take no data block. */
+void
+inode_set_inline(struct ezfs_inode *inode, const char *data, size_t size)
+{
+	passert(size <= EZFS_INLINE_DATA_SIZE, "Contents fit inline");
+	inode->flags = EZFS_INODE_INLINE_DATA;
+	inode->file_size = size;
+	memcpy(inode->inline_data, data, size);
 }
 
 void
@@ -54,6 +79,72 @@ open_file(const char *filename, int flags)
 	return fd;
 }
 
+/* Set with -b; everything below counts in blocks of this size. */
+uint64_t block_size = EZFS_BLOCK_SIZE;
+
+void
+write_at(int fd, const void *buf, size_t count, uint64_t blk, size_t offset,
+	 char *message)
+{
+	ssize_t ret = pwrite(fd, buf, count,
+			     (off_t) (blk * block_size + offset));
+
+	passert(ret == (ssize_t) count, message);
+}
+
+/* Zeroes @count blocks from @blk on, a megabyte at a time. */
+void
+zero_blocks(int fd, uint64_t blk, uint64_t count, char *message)
+{
+	uint64_t chunk = (1 << 20) / block_size, n;
+	char *zeroes = calloc(chunk, block_size);
+	ssize_t ret = 0;
+
+	passert(zeroes != NULL, "Allocate zeroes");
+	for (; count; count -= n, blk += n) {
+		n = count < chunk ? count : chunk;
+		ret = pwrite(fd, zeroes, n * block_size,
+			     (off_t) (blk * block_size));
+		if (ret != (ssize_t) (n * block_size))
+			break;
+	}
+	free(zeroes);
+	passert(!count, message);
+}
+
+/* Parses a size with an optional K, M, G or T suffix. */
+uint64_t
+parse_size(const char *arg)
+{
+	char *end;
+	uint64_t n = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'T':
+	case 't':
+		n <<= 10;
+		/* fall through */
+	case 'G':
+	case 'g':
+		n <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		n <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		n <<= 10;
+	}
+	return n;
+}
+
+uint64_t
+div_round_up(uint64_t n, uint64_t d)
+{
+	return (n + d - 1) / d;
+}
+
 ssize_t
 read_file(int fd, void *buf, size_t count, const char *errmsg)
 {
@@ -70,189 +161,263 @@ read_file(int fd, void *buf, size_t count, const char *errmsg)
 int
 main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		printf("Usage: ./format_disk_as_ezfs DEVICE_NAME.\n");
+	uint64_t nr_inodes = 0, j_blks = 0, fs_size = 0;
+	int opt, j_set = 0;
+
+	while ((opt = getopt(argc, argv, "b:i:j:s:")) != -1) {
+		if (opt == 'b') {
+			block_size = parse_size(optarg);
+		} else if (opt == 'i') {
+			nr_inodes = strtoull(optarg, NULL, 0);
+		} else if (opt == 'j') {
+			j_blks = strtoull(optarg, NULL, 0);
+			j_set = 1;
+		} else if (opt == 's') {
+			fs_size = parse_size(optarg);
+		} else {
+			break;
+		}
+	}
+	if (optind != argc - 1 ||
+	    (j_blks && j_blks < EZFS_JOURNAL_MIN_BLOCKS) ||
+	    block_size < EZFS_MIN_BLOCK_SIZE ||
+	    block_size > EZFS_MAX_BLOCK_SIZE ||
+	    (block_size & (block_size - 1))) {
+		printf("Usage: ./format_disk_as_ezfs [-b BLOCK_SIZE] "
+		       "[-s SIZE] [-i INODES] [-j JOURNAL_BLOCKS] "
+		       "DEVICE_NAME.\n"
+		       "BLOCK_SIZE is a power of two from %d to %d and must "
+		       "match the module's\nEZFS_BLOCK_SIZE. SIZE defaults to "
+		       "the whole device and may carry a K, M, G\nor T "
+		       "suffix. A journal needs at least %d blocks; -j 0 "
+		       "leaves it out.\n", EZFS_MIN_BLOCK_SIZE,
+		       EZFS_MAX_BLOCK_SIZE, EZFS_JOURNAL_MIN_BLOCKS);
 		return -1;
 	}
 
-	int fd = open_file(argv[1], O_RDWR);
+	int fd = open_file(argv[optind], O_RDWR);
 
 	struct ezfs_super_block sb;
 	struct ezfs_inode inode;
 	struct ezfs_dir_entry dentry;
+	struct ezfs_group_desc desc;
+	struct ezfs_journal_super jsb;
 	char *hello_contents = "Hello world!\n";
 	char *names_contents = "Jiawei; Monirul; Faiza\n";
-	char buf[EZFS_BLOCK_SIZE], pbuf[EZFS_BLOCK_SIZE * 8],
-	    bbuf[EZFS_BLOCK_SIZE * 2];
-	const char zeroes[EZFS_BLOCK_SIZE] = { 0 };
-	ssize_t len;
+	char pbuf[EZFS_BLOCK_SIZE * 8], bbuf[EZFS_BLOCK_SIZE * 2];
+	uint32_t bitmap[EZFS_BLOCK_SIZE / sizeof(uint32_t)];
+	uint64_t disk_blks, data_blks, ib_blks, db_blks, gd_blks, rc_blks;
+	uint64_t it_blks, img_blks, txt_blks;
+	uint64_t root;
 
 	memset(&sb, 0, sizeof(sb));
 
 	int fp = open_file("./big_files/big_img.jpeg", O_RDWR);
 	ssize_t pret =
-	    read_file(fp, pbuf, EZFS_BLOCK_SIZE * 9, "Read big img contents");
+	    read_file(fp, pbuf, sizeof(pbuf), "Read big img contents");
 	close(fp);
 
 	fp = open_file("./big_files/big_txt.txt", O_RDWR);
 	ssize_t bret =
-	    read_file(fp, bbuf, EZFS_BLOCK_SIZE * 2, "Read big txt contents");
+	    read_file(fp, bbuf, sizeof(bbuf), "Read big txt contents");
 	close(fp);
 
-	sb.version = 1;
+	/* Size the regions for the device: by default one inode for every
+	 * 16 KiB, a whole number of inode table blocks and a journal of
+	 * one block in 64, within limits.
+	 */
+	off_t dev_size = lseek(fd, 0, SEEK_END);
+
+	passert(dev_size >= 0, "Get device size");
+	if (fs_size > (uint64_t) dev_size) {
+		/* An image file grows to the size asked for. */
+		passert(ftruncate(fd, fs_size) == 0, "Extend image file");
+		dev_size = fs_size;
+	} else if (fs_size) {
+		dev_size = fs_size;
+	}
+	disk_blks = dev_size / block_size;
+	if (!nr_inodes)
+		nr_inodes = dev_size / 16384;
+	it_blks = div_round_up(nr_inodes ? nr_inodes : 1,
+			       block_size / sizeof(struct ezfs_inode));
+	nr_inodes = it_blks * (block_size / sizeof(struct ezfs_inode));
+	ib_blks = div_round_up(nr_inodes, block_size * 8);
+	if (!j_set) {
+		j_blks = disk_blks / 64;
+		if (j_blks < EZFS_JOURNAL_MIN_BLOCKS)
+			j_blks = EZFS_JOURNAL_MIN_BLOCKS;
+		if (j_blks > 8192)
+			j_blks = 8192;
+		/* Unless asked for, a device that small goes without. */
+		if (j_blks > disk_blks / 4) {
+			printf("No journal: the device is too small for one "
+			       "of %d blocks.\n", EZFS_JOURNAL_MIN_BLOCKS);
+			j_blks = 0;
+		}
+	}
+	passert(disk_blks > 1 + ib_blks + j_blks + it_blks,
+		"Inode table and journal fit");
+	data_blks = disk_blks - 1 - ib_blks - j_blks - it_blks;
+	db_blks = div_round_up(data_blks, block_size * 8);
+	gd_blks = div_round_up(div_round_up(data_blks, EZFS_BLOCKS_PER_GROUP),
+			       block_size / sizeof(struct ezfs_group_desc));
+	rc_blks = div_round_up(data_blks, block_size / sizeof(uint16_t));
+	img_blks = div_round_up(pret, block_size);
+	txt_blks = div_round_up(bret, block_size);
+
+	sb.version = EZFS_VERSION;
 	sb.magic = EZFS_MAGIC_NUMBER;
-	for (int i = 0; i < 6; ++i)
-		SETBIT(sb.free_inodes, i);
-	for (int i = 0; i < 14; ++i)
-		SETBIT(sb.free_data_blocks, i);
-
-	ssize_t ret = write(fd, &sb, sizeof(sb));
+	sb.block_size = block_size;
+	sb.disk_blks = disk_blks;
+	sb.nr_inodes = nr_inodes;
+	sb.inode_bitmap_blk = 1;
+	sb.data_bitmap_blk = sb.inode_bitmap_blk + ib_blks;
+	sb.group_desc_blk = sb.data_bitmap_blk + db_blks;
+	sb.refcount_blk = sb.group_desc_blk + gd_blks;
+	sb.journal_blk = sb.refcount_blk + rc_blks;
+	sb.journal_len = j_blks;
+	sb.inode_table_blk = sb.journal_blk + j_blks;
+	sb.data_blk = sb.inode_table_blk + it_blks;
+	passert(sb.data_blk + 2 + img_blks + txt_blks <= disk_blks,
+		"Device is large enough");
+	sb.nr_data_blocks = disk_blks - sb.data_blk;
+	root = sb.data_blk;
+
+	write_at(fd, &sb, sizeof(sb), EZFS_SUPERBLOCK_DATABLOCK_NUMBER, 0,
+		 "Write superblock");
+
+	/* Inode table slots are only looked at once the inode bitmap says
+	 * they are in use, so the table itself need not be cleared.
+	 */
+	zero_blocks(fd, sb.inode_bitmap_blk, sb.journal_blk - 1,
+		    "Clear bitmaps, group descriptors and refcounts");
+
+	/* An empty journal: the first transaction to replay would be in
+	 * block 1 with sequence 1, and that block holds nothing.
+	 */
+	if (sb.journal_len) {
+		memset(&jsb, 0, sizeof(jsb));
+		jsb.magic = EZFS_JOURNAL_MAGIC;
+		jsb.sequence = 1;
+		write_at(fd, &jsb, sizeof(jsb), sb.journal_blk, 0,
+			 "Write journal superblock");
+		zero_blocks(fd, sb.journal_blk + 1, 1, "Clear journal");
+	}
 
-	passert(ret == EZFS_BLOCK_SIZE, "Write superblock");
+	memset(bitmap, 0, sizeof(bitmap));
+	for (int i = 0; i < 6; ++i)
+		SETBIT(bitmap, i);
+	write_at(fd, bitmap, sizeof(bitmap), sb.inode_bitmap_blk, 0,
+		 "Write inode bitmap");
+
+	memset(bitmap, 0, sizeof(bitmap));
+	for (int i = 0; i < 2 + img_blks + txt_blks; ++i)
+		SETBIT(bitmap, i);
+	write_at(fd, bitmap, sizeof(bitmap), sb.data_bitmap_blk, 0,
+		 "Write data bitmap");
+
+	/* Both directories are in group 0. */
+	memset(&desc, 0, sizeof(desc));
+	desc.ndirs = 2;
+	write_at(fd, &desc, sizeof(desc), sb.group_desc_blk, 0,
+		 "Write group descriptor");
 
 	inode_reset(&inode);
 	inode.mode = S_IFDIR | 0777;
 	inode.nlink = 3;	// add 1 to 2 because adding another directory
-	inode.dbn = EZFS_ROOT_DATABLOCK_NUMBER;
-	inode.file_size = EZFS_BLOCK_SIZE;
-	inode.nblocks = 1;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write root inode");
+	inode.file_size = block_size;
+	inode_set_extent(&inode, root, 1);
+	write_at(fd, &inode, sizeof(inode), sb.inode_table_blk,
+		 0 * sizeof(inode), "Write root inode");
 
 	inode_reset(&inode);
 	inode.nlink = 1;
 	inode.mode = S_IFREG | 0666;
-	inode.dbn = EZFS_ROOT_DATABLOCK_NUMBER + 1;
-	inode.file_size = strlen(hello_contents);
-	inode.nblocks = 1;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write hello.txt inode");
+	inode_set_inline(&inode, hello_contents, strlen(hello_contents));
+	write_at(fd, &inode, sizeof(inode), sb.inode_table_blk,
+		 1 * sizeof(inode), "Write hello.txt inode");
 
 	inode_reset(&inode);
 	inode.mode = S_IFDIR | 0777;
 	inode.nlink = 2;
-	inode.dbn = EZFS_ROOT_DATABLOCK_NUMBER + 2;
-	inode.file_size = EZFS_BLOCK_SIZE;
-	inode.nblocks = 1;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write subdir inode");
+	inode.file_size = block_size;
+	inode_set_extent(&inode, root + 1, 1);
+	write_at(fd, &inode, sizeof(inode), sb.inode_table_blk,
+		 2 * sizeof(inode), "Write subdir inode");
 
 	inode_reset(&inode);
 	inode.nlink = 1;
 	inode.mode = S_IFREG | 0666;
-	inode.dbn = EZFS_ROOT_DATABLOCK_NUMBER + 3;
-	inode.file_size = strlen(names_contents);
-	inode.nblocks = 1;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write names.txt inode");
+	inode_set_inline(&inode, names_contents, strlen(names_contents));
+	write_at(fd, &inode, sizeof(inode), sb.inode_table_blk,
+		 3 * sizeof(inode), "Write names.txt inode");
 
 	inode_reset(&inode);
 	inode.nlink = 1;
 	inode.mode = S_IFREG | 0666;
-	inode.dbn = EZFS_ROOT_DATABLOCK_NUMBER + 4;
 	inode.file_size = pret;
-	inode.nblocks = 8;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write big_img.jpeg inode");
+	inode_set_extent(&inode, root + 2, img_blks);
+	write_at(fd, &inode, sizeof(inode), sb.inode_table_blk,
+		 4 * sizeof(inode), "Write big_img.jpeg inode");
 
 	inode_reset(&inode);
 	inode.nlink = 1;
 	inode.mode = S_IFREG | 0666;
-	inode.dbn = EZFS_ROOT_DATABLOCK_NUMBER + 4 + 8;
 	inode.file_size = bret;
-	inode.nblocks = 2;
+	inode_set_extent(&inode, root + 2 + img_blks, txt_blks);
+	write_at(fd, &inode, sizeof(inode), sb.inode_table_blk,
+		 5 * sizeof(inode), "Write big_txt.txt inode");
 
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write big_txt.txt inode");
-
-	ret =
-	    lseek(fd, EZFS_BLOCK_SIZE - 6 * sizeof(struct ezfs_inode),
-		  SEEK_CUR);
-	passert(ret >= 0, "Seek past inode table");
+	zero_blocks(fd, root, 1, "Clear root dentries");
 
 	dentry_reset(&dentry);
 	strncpy(dentry.filename, "hello.txt", sizeof(dentry.filename));
 	dentry.active = 1;
 	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 1;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for hello.txt");
+	write_at(fd, &dentry, sizeof(dentry), root, 0 * sizeof(dentry),
+		 "Write dentry for hello.txt");
 
 	dentry_reset(&dentry);
 	strncpy(dentry.filename, "subdir", sizeof(dentry.filename));
 	dentry.active = 1;
 	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 2;
+	write_at(fd, &dentry, sizeof(dentry), root, 1 * sizeof(dentry),
+		 "Write dentry for subdir");
 
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for subdir");
-
-	len = EZFS_BLOCK_SIZE - 2 * sizeof(struct ezfs_dir_entry);
-	ret = write(fd, zeroes, len);
-	passert(ret == len, "Pad to end of root dentries");
-
-	len = strlen(hello_contents);
-	strncpy(buf, hello_contents, len);
-	ret = write(fd, buf, len);
-	passert(ret == len, "Write hello.txt contents");
-
-	ret = lseek(fd, EZFS_BLOCK_SIZE - len, SEEK_CUR);
-	passert(ret >= 0, "Seek to next file block");
+	zero_blocks(fd, root + 1, 1, "Clear subdir dentries");
 
 	dentry_reset(&dentry);
 	strncpy(dentry.filename, "names.txt", sizeof(dentry.filename));
 	dentry.active = 1;
 	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 3;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for names.txt");
+	write_at(fd, &dentry, sizeof(dentry), root + 1, 0 * sizeof(dentry),
+		 "Write dentry for names.txt");
 
 	dentry_reset(&dentry);
 	strncpy(dentry.filename, "big_img.jpeg", sizeof(dentry.filename));
 	dentry.active = 1;
 	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 4;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for big_img.jpeg");
+	write_at(fd, &dentry, sizeof(dentry), root + 1, 1 * sizeof(dentry),
+		 "Write dentry for big_img.jpeg");
 
 	dentry_reset(&dentry);
 	strncpy(dentry.filename, "big_txt.txt", sizeof(dentry.filename));
 	dentry.active = 1;
 	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 5;
+	write_at(fd, &dentry, sizeof(dentry), root + 1, 2 * sizeof(dentry),
+		 "Write dentry for big_txt.txt");
 
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for big_txt.txt");
-
-	len = EZFS_BLOCK_SIZE - 3 * sizeof(struct ezfs_dir_entry);
-	ret = write(fd, zeroes, len);
-	passert(ret == len, "Pad to end of subdir dentries");
-
-	len = strlen(names_contents);
-	strncpy(buf, names_contents, len);
-	ret = write(fd, buf, len);
-	passert(ret == len, "Write names.txt contents");
-
-	ret = lseek(fd, EZFS_BLOCK_SIZE - len, SEEK_CUR);
-	passert(ret >= 0, "Seek to next file block for big_img.jpeg");
-
-	ret = write(fd, pbuf, pret);
-	passert(ret == pret, "Write big_img.jpeg contents");
-
-	ret = lseek(fd, EZFS_BLOCK_SIZE * 8 - pret, SEEK_CUR);
-	passert(ret >= 0, "Seek to next file block for big_txt.txt");
+	write_at(fd, pbuf, pret, root + 2, 0, "Write big_img.jpeg contents");
 
-	ret = write(fd, bbuf, bret);
-	passert(ret == bret, "Write big_txt.txt contents");
+	write_at(fd, bbuf, bret, root + 2 + img_blks, 0,
+		 "Write big_txt.txt contents");
 
-	ret = fsync(fd);
+	int ret = fsync(fd);
 	passert(ret == 0, "Flush writes to disk");
 
 	close(fd);
-	printf("Device [%s] formatted successfully.\n", argv[1]);
+	printf("Device [%s] formatted successfully.\n", argv[optind]);
 
 	return 0;
 }